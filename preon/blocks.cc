@@ -5,15 +5,17 @@ Blocks::Blocks(size_t n_blocks) :
     m_n_done(0),
     m_states(n_blocks, EMPTY) {}
 
-void Blocks::set_state(int blk_id, int state) {
+void Blocks::set_state(int64_t blk_id, int state) {
     is_valid(blk_id);
 
     if (state == DONE && m_states[blk_id] != DONE)
         m_n_done++;
+    else if (state != DONE && m_states[blk_id] == DONE)
+        m_n_done--;
     m_states[blk_id] = state;
 }
 
-int Blocks::get_state(int blk_id) {
+int Blocks::get_state(int64_t blk_id) {
     is_valid(blk_id);
 
     return m_states[blk_id];
@@ -27,7 +29,7 @@ void Blocks::append_states(const std::vector<int> &states) {
     }
 }
 
-void Blocks::set_n_blocks(int n_blocks, int state) {
+void Blocks::set_n_blocks(int64_t n_blocks, int state) {
     if (state == DONE)
         m_n_done = n_blocks;
     else
@@ -35,7 +37,7 @@ void Blocks::set_n_blocks(int n_blocks, int state) {
     m_states.assign(n_blocks, state);
 }
 
-int Blocks::get_n_blocks() const {
+int64_t Blocks::get_n_blocks() const {
     return m_states.size();
 }
 
@@ -49,7 +51,7 @@ bool Blocks::finished() const {
     return m_n_done == m_states.size();
 }
 
-void Blocks::is_valid(int blk_id) {
+void Blocks::is_valid(int64_t blk_id) {
     if (blk_id < 0 || (size_t)blk_id >= m_states.size())
         throw PE("Invalid block id");
 }
@@ -3,26 +3,28 @@
 
 #include "consts.h"
 
+#include <cstdint>
 #include <vector>
 
 const int EMPTY         = 0;
 const int DOWNLOADING   = 1;
 const int DONE          = 2;
 
-inline int size_to_nblks(size_t size) {
-    return (size + PREON_BLOCK_SIZE - 1) / PREON_BLOCK_SIZE;
+inline int64_t size_to_nblks(uint64_t size, uint64_t block_size) {
+    return (size + block_size - 1) / block_size;
 }
 
 class Blocks {
     public:
         Blocks(size_t n_blocks = 0);
 
-        void set_state(int blk_id, int state);
-        int get_state(int blk_id);
+        void set_state(int64_t blk_id, int state);
+        int get_state(int64_t blk_id);
         void append_states(const std::vector<int> &states);
 
-        void set_n_blocks(int n_blocks, int state);
-        int get_n_blocks() const;
+        void set_n_blocks(int64_t n_blocks, int state);
+        int64_t get_n_blocks() const;
+        int64_t get_n_done() const {return m_n_done;}
 
         void reset();
 
@@ -35,7 +37,7 @@ class Blocks {
         size_t m_n_done;
         std::vector<int> m_states;
 
-        void is_valid(int blk_id);
+        void is_valid(int64_t blk_id);
 };
 
 #endif  //#ifndef __BLOCKS_H__
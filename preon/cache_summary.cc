@@ -0,0 +1,90 @@
+#include "cache_summary.h"
+#include "error.h"
+
+namespace {
+
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+uint64_t fnv1a(const std::string &key, uint64_t seed) {
+    uint64_t hash = seed;
+    for (unsigned char c: key) {
+        hash ^= c;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+}
+
+BloomFilter::BloomFilter(size_t n_bits, unsigned n_hashes)
+        : m_bits((n_bits + 7) / 8, 0), m_n_hashes(n_hashes) {
+    if (m_bits.empty() || m_n_hashes == 0)
+        throw PE("Bloom filter needs bits and hashes");
+}
+
+void BloomFilter::add(const std::string &key) {
+    for (unsigned i = 0; i < m_n_hashes; i++) {
+        size_t bit = bit_index(key, i);
+        m_bits[bit / 8] |= (uint8_t)(1 << (bit % 8));
+    }
+}
+
+bool BloomFilter::contains(const std::string &key) const {
+    for (unsigned i = 0; i < m_n_hashes; i++) {
+        size_t bit = bit_index(key, i);
+        if (!(m_bits[bit / 8] & (1 << (bit % 8))))
+            return false;
+    }
+
+    return true;
+}
+
+void BloomFilter::set_bits(const std::vector<uint8_t> &bits) {
+    if (bits.empty())
+        throw PE("Bloom filter needs bits");
+
+    m_bits = bits;
+}
+
+// Kirsch-Mitzenmacher: the i-th position is h1 + i * h2
+size_t BloomFilter::bit_index(const std::string &key, unsigned i) const {
+    uint64_t h1 = fnv1a(key, FNV_OFFSET);
+    uint64_t h2 = fnv1a(key, h1) | 1;
+
+    return (size_t)((h1 + i * h2) % get_n_bits());
+}
+
+bool CacheSummaries::get(const PreonAddr &addr, BloomFilter &filter) {
+    bool found = false;
+
+    m_lock.lock();
+    unsafe_expire();
+    auto it = m_summaries.find(addr);
+    if (it != m_summaries.end()) {
+        filter = it->second.filter;
+        found = true;
+    }
+    m_lock.unlock();
+
+    return found;
+}
+
+void CacheSummaries::set(const PreonAddr &addr, const BloomFilter &filter) {
+    m_lock.lock();
+    unsafe_expire();
+    m_summaries[addr] = {filter, Clock::now()};
+    m_lock.unlock();
+}
+
+// Idle peers come and go, so old summaries are dropped rather than kept
+void CacheSummaries::unsafe_expire() {
+    Clock::time_point oldest = Clock::now() - std::chrono::seconds(CACHE_SUMMARY_TTL);
+    for (auto it = m_summaries.begin(); it != m_summaries.end();) {
+        if (it->second.fetched <= oldest)
+            it = m_summaries.erase(it);
+        else
+            it++;
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef __cache_summary_h__
+#define __cache_summary_h__
+
+#include "consts.h"
+#include "preon_types.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Set of content hashes with false positives but no false negatives. The
+// bit positions only depend on the key (FNV-1a, double hashing), so peers
+// built by different compilers agree on them.
+class BloomFilter {
+    public:
+        BloomFilter(size_t n_bits = BLOOM_FILTER_BITS, unsigned n_hashes = BLOOM_FILTER_HASHES);
+
+        void add(const std::string &key);
+        bool contains(const std::string &key) const;
+
+        // As sent in GET_CACHE_SUMMARY; the size of bits gives the number
+        // of bits
+        const std::vector<uint8_t> &get_bits() const {return m_bits;}
+        void set_bits(const std::vector<uint8_t> &bits);
+
+    private:
+        std::vector<uint8_t>    m_bits;
+        unsigned                m_n_hashes;
+
+        size_t get_n_bits() const {return m_bits.size() * 8;}
+        size_t bit_index(const std::string &key, unsigned i) const;
+};
+
+// The cache summaries of other peers, reused for CACHE_SUMMARY_TTL
+class CacheSummaries {
+    public:
+        CacheSummaries() {};
+
+        // False if we have none for the peer, or it's too old
+        bool get(const PreonAddr &addr, BloomFilter &filter);
+        void set(const PreonAddr &addr, const BloomFilter &filter);
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Summary {
+            BloomFilter         filter;
+            Clock::time_point   fetched;
+        };
+
+        std::mutex                          m_lock;
+        std::map<PreonAddr, Summary>        m_summaries;
+
+        void unsafe_expire();
+};
+
+#endif //#ifndef __cache_summary_h__
@@ -1,23 +1,40 @@
+#include <algorithm>
 #include <iostream>
 #include <exception>
 #include <fstream>
 #include <limits>
 
 #include "config.h"
+#include "consts.h"
 #include "error.h"
 #include "utils.h"
 
 Config::Config(const std::string &config_filename) {
     m_tracker_url   = "";
     m_tracker_port  = 8000;
+    m_dht           = false;
     m_listen_port   = 42069;
     m_download_folder = "/tmp/preon/";
-    m_n_workers     = 8;
+    m_n_workers     = 0;
+    m_steal_jobs    = true;
+    m_prefetch_budget = PREFETCH_BUDGET;
+    m_capacity      = {0, 0, 0};
+    m_reserve_cpu   = true;
 
     load_file(config_filename);
 
-    if (m_tracker_url.empty())
-        throw PE("Tracker URL not set");
+    if (m_n_workers == 0) {
+        std::vector<int> cpus;
+        get_cpus(cpus);
+        m_n_workers = cpus.size() - (m_reserve_cpu && cpus.size() > 1);
+    }
+
+    // in dht mode the peers are their own tracker
+    if (m_trackers.empty() && !m_dht) {
+        if (m_tracker_url.empty())
+            throw PE("Tracker URL not set");
+        m_trackers.push_back({m_tracker_url, m_tracker_port});
+    }
 }
 
 void Config::load_file(const std::string &filename) {
@@ -46,6 +63,17 @@ void Config::load_file(const std::string &filename) {
         else if (key == "tracker_port") {
             m_tracker_port = str_to_port(value);
         }
+        else if (key == "trackers") {
+            parse_addr_list(value, m_trackers);
+        }
+        else if (key == "dht") {
+            if (value != "true" && value != "false")
+                throw PE("Invalid value for dht, expected true or false");
+            m_dht = value == "true";
+        }
+        else if (key == "dht_bootstrap") {
+            parse_addr_list(value, m_dht_bootstrap);
+        }
         else if (key == "listen_port") {
             m_listen_port = str_to_port(value);
         }
@@ -55,8 +83,103 @@ void Config::load_file(const std::string &filename) {
         else if (key == "n_workers") {
             m_n_workers = str_to_unsigned(value);
         }
+        else if (key == "n_fetch_workers") {
+            m_n_stage_workers[JobStage::fetch] = str_to_unsigned(value);
+        }
+        else if (key == "n_verify_workers") {
+            m_n_stage_workers[JobStage::verify] = str_to_unsigned(value);
+        }
+        else if (key == "n_publish_workers") {
+            m_n_stage_workers[JobStage::publish] = str_to_unsigned(value);
+        }
+        else if (key == "prefetch_budget_mb") {
+            m_prefetch_budget = (uint64_t)str_to_unsigned(value) * 1024 * 1024;
+        }
+        else if (key == "cores") {
+            m_capacity.cores = str_to_unsigned(value);
+        }
+        else if (key == "memory_mb") {
+            m_capacity.memory = (uint64_t)str_to_unsigned(value) * 1024 * 1024;
+        }
+        else if (key == "scratch_mb") {
+            m_capacity.scratch = (uint64_t)str_to_unsigned(value) * 1024 * 1024;
+        }
+        else if (key == "reserve_cpu") {
+            if (value != "true" && value != "false")
+                throw PE("Invalid value for reserve_cpu, expected true or false");
+            m_reserve_cpu = value == "true";
+        }
+        else if (key == "steal_jobs") {
+            if (value != "true" && value != "false")
+                throw PE("Invalid value for steal_jobs, expected true or false");
+            m_steal_jobs = value == "true";
+        }
+        else if (key.compare(0, 11, "rate_limit_") == 0) {
+            parse_rate_limit(key, value);
+        }
         else {
             warn("ignoring key '" + key + "'");
         }
     }
 }
+
+// By default there is a fetch per executing job, so the next job's inputs
+// are there when a core frees up. Hashing is quick compared to both.
+unsigned Config::get_n_stage_workers(JobStage stage) const {
+    if (stage == JobStage::execute)
+        return m_n_workers;
+
+    auto it = m_n_stage_workers.find(stage);
+    if (it != m_n_stage_workers.end() && it->second > 0)
+        return it->second;
+
+    if (stage == JobStage::fetch)
+        return m_n_workers;
+    return std::max(1u, m_n_workers / 4);
+}
+
+Resources Config::get_capacity() const {
+    Resources capacity = m_capacity;
+
+    if (capacity.cores == 0)
+        capacity.cores = std::max(1u, m_n_workers);
+    if (capacity.memory == 0)
+        capacity.memory = physical_memory();
+    if (capacity.scratch == 0)
+        capacity.scratch = free_disk_space(m_download_folder);
+
+    return capacity;
+}
+
+// comma separated list of host:port
+void Config::parse_addr_list(const std::string &value, PreonAddrList &list) {
+    std::vector<std::string> addrs;
+    split(value, addrs, ',');
+
+    list.clear();
+    for (const std::string &addr: addrs) {
+        std::string a = strip(addr);
+        if (a.empty())
+            continue;
+
+        size_t sep = a.rfind(':');
+        if (sep == std::string::npos || sep == 0)
+            throw PE("Invalid address '" + a + "', expected host:port");
+
+        list.push_back({a.substr(0, sep), str_to_port(a.substr(sep + 1))});
+    }
+}
+
+void Config::parse_rate_limit(const std::string &key, const std::string &value) {
+    std::string name = key.substr(11);
+    size_t sep = name.find('_');
+
+    RateLimit limit;
+    if (sep == std::string::npos
+            || !parse_rate_scope(name.substr(0, sep), limit.scope)
+            || !parse_rate_dir(name.substr(sep + 1), limit.dir))
+        throw PE("Invalid rate limit '" + key + "'");
+    limit.rate = str_to_unsigned(value);
+
+    m_rate_limits.push_back(limit);
+}
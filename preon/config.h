@@ -1,28 +1,71 @@
 #ifndef __config_h__
 #define __config_h__
 
+#include "job_queue.h"
+#include "preon_types.h"
+#include "rate_limiter.h"
+
+#include <cstdint>
+#include <map>
 #include <string>
+#include <vector>
 
 class Config {
     public:
         Config(const std::string &config_filename);
 
-        const std::string  &get_tracker_url() const {return m_tracker_url;}
-        unsigned short      get_tracker_port() const {return m_tracker_port;}
+        // all tracker shards, a single tracker_url/tracker_port is one shard
+        const PreonAddrList &get_trackers() const {return m_trackers;}
+        bool                get_dht() const {return m_dht;}
+        const PreonAddrList &get_dht_bootstrap() const {return m_dht_bootstrap;}
         unsigned short      get_listen_port() const {return m_listen_port;}
         const std::string  &get_download_folder() const {return m_download_folder;}
 
+        // rate_limit_<global|peer|job>_<upload|download>=bytes/s
+        const std::vector<RateLimit> &get_rate_limits() const {return m_rate_limits;}
+
+        // the execute pool, by default the cpus we may run on, but for the
+        // reserved one
         unsigned            get_n_workers() const {return m_n_workers;}
         void                set_n_workers(unsigned n_workers) {m_n_workers = n_workers;}
+        // threads per stage, n_<stage>_workers=... in the config file
+        unsigned            get_n_stage_workers(JobStage stage) const;
+
+        // What we offer for executing jobs: cores=, memory_mb= and
+        // scratch_mb= in the config file. By default a core per execute
+        // worker, the host's memory and the free space of the download folder.
+        Resources           get_capacity() const;
+
+        // keep a cpu for the daemon's network threads, jobs run on the
+        // others; reserve_cpu=true|false, ignored with a single cpu
+        bool                get_reserve_cpu() const {return m_reserve_cpu;}
+
+        // bytes, prefetch_budget_mb=... in the config file
+        uint64_t            get_prefetch_budget() const {return m_prefetch_budget;}
+
+        // pull jobs from masters with free workers (STEAL_JOBS), besides
+        // being pushed them
+        bool                get_steal_jobs() const {return m_steal_jobs;}
 
     private:
         std::string     m_tracker_url;
         unsigned short  m_tracker_port;
+        PreonAddrList   m_trackers;
+        bool            m_dht;
+        PreonAddrList   m_dht_bootstrap;
         unsigned short  m_listen_port;
         std::string     m_download_folder;
         unsigned        m_n_workers;
+        std::map<JobStage, unsigned> m_n_stage_workers;    // if set
+        uint64_t        m_prefetch_budget;
+        Resources       m_capacity;     // 0 means the default
+        bool            m_reserve_cpu;
+        bool            m_steal_jobs;
+        std::vector<RateLimit> m_rate_limits;
 
         void load_file(const std::string &filename);
+        void parse_addr_list(const std::string &value, PreonAddrList &list);
+        void parse_rate_limit(const std::string &key, const std::string &value);
 };
 
 #endif //#ifndef __config_h__
@@ -2,19 +2,90 @@
 #define __consts_h__
 
 #include <cstddef>
+#include <cstdint>
 #include <string>
 
-const std::string   PREON_LOCK_FILE     = "/tmp/preon.lock";
+const std::string   PREON_LOCK_PREFIX   = "/tmp/preon_";    // + listen port + ".lock"
 const std::string   PREON_STATUS_FILE   = "status.txt";
 const std::string   PREON_MANIFEST_FILE = "manifest.txt";
 const std::string   PREON_CONFIG_FILE   = "preon.conf";
-const size_t        PREON_BLOCK_SIZE    = 1024 * 1024; // 1 MiB
+const std::string   PREON_CONTENT_STORE = ".cas";           // in the download folder
+const std::string   PREON_CONTENT_REFS  = ".cas_refs";      // in a job directory
+const size_t        PREON_BLOCK_SIZE    = 1024 * 1024; // 1 MiB, unless the manifest sets one
+const size_t        MIN_BLOCK_SIZE      = 64 * 1024;            // 64 KiB
+const size_t        MAX_BLOCK_SIZE      = 64 * 1024 * 1024;     // 64 MiB
 
-const int WORKER_THREAD_TIMEOUT         = 1 * 1000000;  // s * μs/s
-const int FS_WATCH_TIMEOUT              = 1 * 1000000;  // s * μs/s
-const int RETRY_TIME                    = 60 * 1000000; // s * μs/s
+const int FS_SCAN_INTERVAL              = 60;           // s, full scan besides inotify
+const int FS_POLL_INTERVAL              = 1;            // s, full scan without inotify
 const int RANDOM_DELAY                  = 10 * 1000000; // 10 s
 
+const int DEFAULT_PRIORITY              = 0;
+const int MIN_PRIORITY                  = -10;
+const int MAX_PRIORITY                  = 10;
+const double PRIORITY_AGING_TIME        = 30.0;         // s of waiting per priority level
+const size_t QUEUE_WAIT_SAMPLES         = 1000;         // per priority level
+
 const int IDLE_REPORT_TIME              = 60;           // s
 
+// inputs fetched for jobs which don't execute yet, unless the config sets it
+const uint64_t PREFETCH_BUDGET          = 1024ull * 1024 * 1024;   // 1 GiB
+
+// Masters with jobs no idle worker took are announced under this key, so
+// peers with free workers can pull them (STEAL_JOBS). It is sha256("queued"),
+// which passes as a job id everywhere but is never one.
+const std::string QUEUED_KEY = "d36be6494248ee06ac18f38ea1119dfe4699fdcfcbbcc30a2e4f1ccbce68dfac";
+const int STEAL_INTERVAL                = 5;            // s, without a tracker push
+const size_t JOB_BATCH_MAX              = 32;           // jobs offered in an INFORM_JOBS
+// an offer line "job_id priority cores memory scratch\n" at its widest:
+// 64 hex, int, unsigned, two uint64 and the separators
+const size_t INFORM_JOB_MAX_BYTES       = 64 + 11 + 10 + 20 + 20 + 5;
+const size_t TRACKER_BATCH_MAX          = 64;           // job ids per INFORM_BATCH
+
+// Workers report the stage of the jobs they took to the master, which
+// dispatches a duplicate of a job whose workers went silent, or which runs
+// STRAGGLER_FACTOR times the median of its class (jobs with the same exec)
+const int HEARTBEAT_INTERVAL            = 10;           // s
+const int HEARTBEAT_TIMEOUT             = 3 * HEARTBEAT_INTERVAL;  // s
+const double STRAGGLER_FACTOR           = 2.0;
+const size_t STRAGGLER_MIN_SAMPLES      = 3;            // finished jobs of the class
+const size_t STRAGGLER_SAMPLES          = 32;           // durations kept per class
+const size_t MAX_DUPLICATES             = 1;            // per job, besides the original
+const size_t MAX_HEARTBEAT_SIZE         = 1024 * 1024;  // bytes of job lines
+
+// Peers summarize the content hashes of the files they hold in a Bloom
+// filter (GET_CACHE_SUMMARY); a job is pushed to the idle peers holding
+// most of its inputs first
+const size_t BLOOM_FILTER_BITS          = 8192;         // ~2% false positives at 1000 files
+const unsigned BLOOM_FILTER_HASHES      = 4;
+const int CACHE_SUMMARY_TTL             = 10;           // s, a peer's summary is reused
+const size_t LOCALITY_PROBE_MAX         = 8;            // idle peers asked per dispatch
+
+// Verified inputs by content hash, in the download folder; a job links the
+// inputs it has in there instead of downloading them
+const int CONTENT_STORE_GC_INTERVAL     = 60;           // s
+
+const double RETRY_MIN_TIME             = 1.0;          // s, backoff after the first failure
+const double RETRY_MAX_TIME             = 60.0;         // s
+
+const int BITFIELD_REFRESH_TIME         = 5;            // s
+const int ENDGAME_BLOCKS                = 4;            // missing blocks of a file
+const size_t ENDGAME_PEERS              = 3;            // requests per block
+
+const double SCORE_EWMA_ALPHA           = 0.3;          // weight of a new sample
+const double SCORE_EXPLORE              = 0.1;          // chance of a random peer
+
+const size_t RATE_LIMIT_CHUNK           = 64 * 1024;    // bytes throttled at once
+const double RATE_LIMIT_BURST           = 0.25;         // s of traffic
+const double RATE_LIMIT_PRUNE_INTERVAL  = 60.0;         // s, idle peer buckets are dropped
+
+const int PEX_INTERVAL                  = 10;           // s
+const size_t PEX_MAX_PEERS              = 50;
+
+const size_t DHT_K                      = 8;            // bucket size and replication
+const size_t DHT_ALPHA                  = 3;            // nodes queried per lookup round
+const int DHT_BOOTSTRAP_RETRY_TIME      = 5;            // s
+const int DHT_REFRESH_TIME              = 60;           // s
+const int DHT_REPUBLISH_TIME            = 10 * 60;      // s
+const int DHT_RECORD_TTL                = 30 * 60;      // s
+
 #endif //#ifndef __consts_h__
@@ -0,0 +1,174 @@
+#include "consts.h"
+#include "content_store.h"
+#include "error.h"
+#include "utils.h"
+
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <sstream>
+#include <unistd.h>
+#include <sys/stat.h>
+
+void ContentStore::init(const std::string &dir) {
+    m_dir = dir;
+    create_dir(m_dir);
+}
+
+// The store gets its own copy, read-only, so a job writing into its input
+// can't change it. Racing adds of the same content are fine, the first link
+// wins.
+void ContentStore::add(const std::string &path, const File &file, const std::string &job_dir) {
+    std::string stored = get_path(file.hash);
+    if (stored.empty())
+        return;
+
+    try {
+        if (access(stored.c_str(), F_OK) == -1) {
+            std::string refs = job_dir + "/" + PREON_CONTENT_REFS;
+            create_dir(refs);
+
+            std::string tmp_path = refs + "/" + file.hash + ".tmp";
+            unlink(tmp_path.c_str());
+            clone_file(tmp_path, path);
+            chmod(tmp_path.c_str(), S_IRUSR | S_IRGRP | S_IROTH);
+
+            int ret = link(tmp_path.c_str(), stored.c_str());
+            int link_errno = errno;
+            unlink(tmp_path.c_str());
+            if (ret == -1 && link_errno != EEXIST)
+                throw PE("Failed to store '" + path + "': " + strerror(link_errno));
+        }
+
+        reference(file, job_dir);
+    }
+    catch (PreonExcept &e) {
+        warn(e.what());
+    }
+}
+
+// A hardlink in the job directory, which goes when the job is removed
+void ContentStore::reference(const File &file, const std::string &job_dir) {
+    std::string stored = get_path(file.hash);
+    if (stored.empty())
+        return;
+
+    std::string refs = job_dir + "/" + PREON_CONTENT_REFS;
+    create_dir(refs);
+
+    std::string ref = refs + "/" + file.hash;
+    if (link(stored.c_str(), ref.c_str()) == -1 && errno != EEXIST)
+        warn("Failed to reference '" + stored + "': " + strerror(errno));
+}
+
+void ContentStore::remove(const File &file) {
+    std::string stored = get_path(file.hash);
+    if (stored.empty() || access(stored.c_str(), F_OK) == -1)
+        return;
+
+    if (calc_hash(stored) != file.hash) {
+        warn("Removing '" + stored + "' from the content store, it doesn't match its hash");
+        unlink(stored.c_str());
+    }
+}
+
+std::string ContentStore::find(const File &file) {
+    std::string stored = get_path(file.hash);
+    if (stored.empty())
+        return "";
+
+    struct stat stat_buf;
+    if (stat(stored.c_str(), &stat_buf) == -1 || (uint64_t)stat_buf.st_size != file.size)
+        return "";
+
+    return stored;
+}
+
+void ContentStore::count_hit(const File &file) {
+    m_lock.lock();
+    m_n_hits++;
+    m_hit_bytes += file.size;
+    m_lock.unlock();
+}
+
+void ContentStore::get_summary(BloomFilter &filter) {
+    filter = BloomFilter();
+
+    DIR *dir = opendir(m_dir.c_str());
+    if (dir == nullptr)
+        return;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        if (is_job_hash(ent->d_name))
+            filter.add(ent->d_name);
+    }
+
+    closedir(dir);
+}
+
+// A job cloning a file while it's collected keeps its clone, the file is
+// just stored again once that job verified it
+size_t ContentStore::collect_garbage() {
+    DIR *dir = opendir(m_dir.c_str());
+    if (dir == nullptr)
+        return 0;
+
+    size_t n_removed = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        if (!is_job_hash(ent->d_name))
+            continue;
+
+        std::string stored = m_dir + "/" + ent->d_name;
+        struct stat stat_buf;
+        if (stat(stored.c_str(), &stat_buf) == 0 && stat_buf.st_nlink == 1
+                && unlink(stored.c_str()) == 0)
+            n_removed++;
+    }
+
+    closedir(dir);
+
+    if (n_removed > 0)
+        info("Removed " + STR(n_removed) + " files no job uses from the content store");
+
+    return n_removed;
+}
+
+std::string ContentStore::report() {
+    uint64_t n_files = 0, bytes = 0;
+
+    DIR *dir = opendir(m_dir.c_str());
+    if (dir != nullptr) {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != nullptr) {
+            struct stat stat_buf;
+            if (is_job_hash(ent->d_name)
+                    && stat((m_dir + "/" + ent->d_name).c_str(), &stat_buf) == 0) {
+                n_files++;
+                bytes += (uint64_t)stat_buf.st_size;
+            }
+        }
+        closedir(dir);
+    }
+
+    std::stringstream ss;
+
+    m_lock.lock();
+    ss << "content_store_files " << n_files << "\n"
+       << "content_store_bytes " << bytes << "\n"
+       << "content_store_hits " << m_n_hits << "\n"
+       << "content_store_hit_bytes " << m_hit_bytes << "\n";
+    m_lock.unlock();
+
+    return ss.str();
+}
+
+// The hash comes from a manifest of another peer, so it's checked before
+// it becomes part of a path
+std::string ContentStore::get_path(const std::string &hash) const {
+    if (m_dir.empty() || !is_job_hash(hash))
+        return "";
+
+    return m_dir + "/" + hash;
+}
@@ -0,0 +1,58 @@
+#ifndef __content_store_h__
+#define __content_store_h__
+
+#include "cache_summary.h"
+#include "preon_types.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Verified inputs of all jobs, by content hash, in one directory of the
+// download folder. A job gets an input we already have as a clone of the
+// stored file (a reflink where the filesystem can, a copy otherwise), so
+// it isn't downloaded again, and writing into it can't touch the store.
+// Every job using a stored file has a hardlink to it in its directory
+// (PREON_CONTENT_REFS), so the link count is the reference count: a stored
+// file only linked from the store belongs to no job anymore and is
+// collected.
+class ContentStore {
+    public:
+        ContentStore() {};
+
+        // creates the directory
+        void init(const std::string &dir);
+
+        // Stores a copy of a verified file of the job in job_dir, unless we
+        // have its content already, and references it from job_dir
+        void add(const std::string &path, const File &file, const std::string &job_dir);
+        // The job in job_dir uses the stored file
+        void reference(const File &file, const std::string &job_dir);
+        // Forgets the stored file with file's hash if it doesn't have that
+        // content after all, when a job's copy failed to verify
+        void remove(const File &file);
+        // The stored file with file's content, empty if there is none
+        std::string find(const File &file);
+        // a job cloned it instead of downloading it
+        void count_hit(const File &file);
+
+        void get_summary(BloomFilter &filter);
+
+        // Removes the stored files no job links to, returns their number
+        size_t collect_garbage();
+
+        // files, bytes and hits, one "key value" per line
+        std::string report();
+
+    private:
+        std::string m_dir;
+
+        std::mutex  m_lock;     // of the counters, the files are linked atomically
+        uint64_t    m_n_hits = 0;
+        uint64_t    m_hit_bytes = 0;
+
+        // empty if the hash can't be a file name of ours
+        std::string get_path(const std::string &hash) const;
+};
+
+#endif //#ifndef __content_store_h__
@@ -0,0 +1,174 @@
+#include "cpu_placer.h"
+#include "error.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cctype>
+#include <dirent.h>
+#include <set>
+
+namespace {
+
+const std::string NUMA_NODE_DIR = "/sys/devices/system/node";
+
+// "0-3,8-11" as in a node's cpulist
+void parse_cpulist(const std::string &list, std::vector<int> &cpus) {
+    std::vector<std::string> ranges;
+    split(strip(list), ranges, ',');
+
+    for (const std::string &range: ranges) {
+        if (range.empty())
+            continue;
+
+        size_t sep = range.find('-');
+        int first = std::stoi(range.substr(0, sep));
+        int last = sep == std::string::npos ? first : std::stoi(range.substr(sep + 1));
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+}
+
+// cpu -> NUMA node, empty if the kernel has no NUMA support
+void read_numa_nodes(std::map<int, int> &cpu_nodes) {
+    cpu_nodes.clear();
+
+    DIR *dir = opendir(NUMA_NODE_DIR.c_str());
+    if (dir == nullptr)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        std::string name = entry->d_name;
+        if (name.compare(0, 4, "node") != 0 || name.size() == 4 || !isdigit(name[4]))
+            continue;
+
+        try {
+            int node = std::stoi(name.substr(4));
+            std::vector<int> cpus;
+            parse_cpulist(file_to_str(NUMA_NODE_DIR + "/" + name + "/cpulist"), cpus);
+            for (int cpu: cpus)
+                cpu_nodes[cpu] = node;
+        }
+        catch (...) {
+            warn("Failed to read the cpus of NUMA " + name);
+        }
+    }
+
+    closedir(dir);
+}
+
+}
+
+// The first cpu is reserved, interrupts tend to be handled there anyway
+void CpuPlacer::init(unsigned n_slots, bool reserve_cpu) {
+    std::vector<int> cpus;
+    ::get_cpus(cpus);
+
+    std::map<int, int> cpu_nodes;
+    read_numa_nodes(cpu_nodes);
+
+    m_reserved_cpu = -1;
+    if (reserve_cpu && cpus.size() > 1) {
+        m_reserved_cpu = cpus.front();
+        cpus.erase(cpus.begin());
+    }
+
+    m_slots.clear();
+    for (unsigned i = 0; i < n_slots; i++) {
+        int cpu = cpus[i % cpus.size()];
+        auto it = cpu_nodes.find(cpu);
+        m_slots.push_back({cpu, it == cpu_nodes.end() ? 0 : it->second, false});
+    }
+}
+
+size_t CpuPlacer::get_n_free() const {
+    size_t n_free = 0;
+    for (const Slot &slot: m_slots)
+        n_free += !slot.used;
+
+    return n_free;
+}
+
+bool CpuPlacer::place(const std::string &job_id, unsigned n) {
+    if (get_n_free() < n)
+        return false;
+
+    release(job_id);
+
+    std::map<int, std::vector<size_t>> free;   // per node
+    for (size_t i = 0; i < m_slots.size(); i++) {
+        if (!m_slots[i].used)
+            free[m_slots[i].node].push_back(i);
+    }
+
+    const std::vector<size_t> *best = nullptr;
+    for (const auto &node: free) {
+        if (node.second.size() >= n && (best == nullptr || node.second.size() < best->size()))
+            best = &node.second;
+    }
+
+    std::vector<size_t> &placed = m_placed[job_id];
+    if (best != nullptr) {
+        placed.assign(best->begin(), best->begin() + n);
+    }
+    else {
+        // no node fits it, so spread it over as few as possible
+        std::vector<const std::vector<size_t> *> nodes;
+        for (const auto &node: free)
+            nodes.push_back(&node.second);
+        std::sort(nodes.begin(), nodes.end(), [](const std::vector<size_t> *a,
+                    const std::vector<size_t> *b) {
+            return a->size() > b->size();
+        });
+
+        for (const std::vector<size_t> *node: nodes) {
+            for (size_t slot: *node) {
+                if (placed.size() == n)
+                    break;
+                placed.push_back(slot);
+            }
+        }
+    }
+
+    for (size_t slot: placed)
+        m_slots[slot].used = true;
+
+    return true;
+}
+
+void CpuPlacer::release(const std::string &job_id) {
+    auto it = m_placed.find(job_id);
+    if (it == m_placed.end())
+        return;
+
+    for (size_t slot: it->second)
+        m_slots[slot].used = false;
+    m_placed.erase(it);
+}
+
+void CpuPlacer::get_cpus(const std::string &job_id, std::vector<int> &cpus) const {
+    cpus.clear();
+
+    auto it = m_placed.find(job_id);
+    if (it == m_placed.end())
+        return;
+
+    // a cpu comes up twice if we offer more cores than there are cpus
+    std::set<int> unique;
+    for (size_t slot: it->second)
+        unique.insert(m_slots[slot].cpu);
+    cpus.assign(unique.begin(), unique.end());
+}
+
+void CpuPlacer::get_nodes(const std::string &job_id, std::vector<int> &nodes) const {
+    nodes.clear();
+
+    auto it = m_placed.find(job_id);
+    if (it == m_placed.end())
+        return;
+
+    std::set<int> unique;
+    for (size_t slot: it->second)
+        unique.insert(m_slots[slot].node);
+    nodes.assign(unique.begin(), unique.end());
+}
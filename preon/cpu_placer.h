@@ -0,0 +1,51 @@
+#ifndef __cpu_placer_h__
+#define __cpu_placer_h__
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+// Which cpus the executing jobs run on. Every job gets cpus of its own,
+// from a single NUMA node if one has enough free (the one with the fewest
+// free that does, so the others stay whole for large jobs), so its threads
+// don't migrate across sockets or share a cpu with another job. One cpu can
+// be kept for the daemon's network threads.
+//
+// There is a slot per core we offer; the slots map onto the cpus left for
+// jobs, more than once if we offer more cores than there are cpus. Not
+// thread safe, ProgramState locks it.
+class CpuPlacer {
+    public:
+        CpuPlacer() {};
+
+        void init(unsigned n_slots, bool reserve_cpu);
+        bool is_initialized() const {return !m_slots.empty();}
+
+        size_t get_n_slots() const {return m_slots.size();}
+        size_t get_n_free() const;
+
+        // False if fewer than n slots are free
+        bool place(const std::string &job_id, unsigned n);
+        void release(const std::string &job_id);
+
+        // Empty if the job isn't placed
+        void get_cpus(const std::string &job_id, std::vector<int> &cpus) const;
+        void get_nodes(const std::string &job_id, std::vector<int> &nodes) const;
+
+        // -1 if no cpu is reserved
+        int get_reserved_cpu() const {return m_reserved_cpu;}
+
+    private:
+        struct Slot {
+            int     cpu;
+            int     node;
+            bool    used;
+        };
+
+        std::vector<Slot>                           m_slots;
+        std::map<std::string, std::vector<size_t>>  m_placed;
+        int                                         m_reserved_cpu = -1;
+};
+
+#endif //#ifndef __cpu_placer_h__
@@ -0,0 +1,544 @@
+#include "consts.h"
+#include "dht.h"
+#include "error.h"
+#include "network_client.h"
+#include "sha256.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <unistd.h>
+
+namespace {
+
+NodeId hash_id(const std::string &str) {
+    SHA256_CTX ctx;
+    NodeId id;
+    sha256_init(&ctx);
+    sha256_update(&ctx, (const BYTE *)str.data(), str.size());
+    sha256_final(&ctx, id.data());
+
+    return id;
+}
+
+// hex must be validated with is_job_hash()
+NodeId hex_to_id(const std::string &hex) {
+    NodeId id;
+    for (size_t i = 0; i < id.size(); i++)
+        id[i] = (uint8_t)std::stoi(hex.substr(2 * i, 2), nullptr, 16);
+
+    return id;
+}
+
+std::string id_to_hex(const NodeId &id) {
+    BYTE buf[SHA256_BLOCK_SIZE];
+    std::copy(id.begin(), id.end(), buf);
+
+    return sha256_to_str(buf);
+}
+
+// Job ids are hashes already, anything else is hashed into the key space
+NodeId key_to_id(const std::string &key) {
+    if (is_job_hash(key))
+        return hex_to_id(key);
+
+    return hash_id(key);
+}
+
+std::string local_hostname() {
+    char buf[256];
+    if (gethostname(buf, sizeof(buf)) == -1)
+        return "localhost";
+    buf[sizeof(buf) - 1] = '\0';
+
+    return buf;
+}
+
+// Several nodes may run on one host, possibly started in the same second
+NodeId random_id(unsigned short port) {
+    return hash_id(local_hostname() + ":" + STR(port) + ":" + STR(getpid())
+            + ":" + STR(time(nullptr)) + ":" + random_string(16));
+}
+
+// true if a is closer to target than b in the XOR metric
+bool closer(const NodeId &a, const NodeId &b, const NodeId &target) {
+    for (size_t i = 0; i < target.size(); i++) {
+        uint8_t da = a[i] ^ target[i];
+        uint8_t db = b[i] ^ target[i];
+        if (da != db)
+            return da < db;
+    }
+
+    return false;
+}
+
+// Index of the highest differing bit, -1 if the ids are equal
+int bucket_index(const NodeId &self, const NodeId &id) {
+    for (size_t i = 0; i < self.size(); i++) {
+        uint8_t x = self[i] ^ id[i];
+        if (x != 0)
+            return 255 - (i * 8 + __builtin_clz(x) - 24);
+    }
+
+    return -1;
+}
+
+void sort_by_distance(std::vector<DhtContact> &contacts, const NodeId &target) {
+    std::sort(contacts.begin(), contacts.end(),
+            [&target](const DhtContact &a, const DhtContact &b) {
+                return closer(a.id, b.id, target);
+            });
+}
+
+bool parse_contact(const std::string &line, DhtContact &contact) {
+    std::stringstream ss(line);
+    std::string id;
+    unsigned short port;
+    if (!(ss >> id >> contact.addr.ip_addr >> port) || !is_job_hash(id))
+        return false;
+
+    contact.id = hex_to_id(id);
+    contact.addr.port = port;
+
+    return true;
+}
+
+std::string make_response(const NodeId &id, const std::string &body) {
+    std::string payload = id_to_hex(id) + "\n" + body;
+    return STR(payload.size()) + "\n" + payload;
+}
+
+}
+
+Dht::Dht(unsigned short port) :
+    m_id(random_id(port)),
+    m_port(port),
+    m_buckets(256),
+    m_n_rpcs(0),
+    m_stop(false) {}
+
+Dht::~Dht() {
+    m_lock.lock();
+    m_stop = true;
+    m_lock.unlock();
+    m_stop_cv.notify_all();
+
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void Dht::start(const PreonAddrList &bootstrap_nodes) {
+    m_lock.lock();
+    m_bootstrap_nodes = bootstrap_nodes;
+    m_lock.unlock();
+
+    m_thread = std::thread(&Dht::maintenance_thread, this);
+}
+
+void Dht::announce(const std::string &key, unsigned short port) {
+    m_lock.lock();
+    m_announced.insert({key, port});
+    m_lock.unlock();
+
+    store_at(key_to_id(key), port, true);
+}
+
+void Dht::withdraw(const std::string &key, unsigned short port) {
+    m_lock.lock();
+    m_announced.erase({key, port});
+    m_lock.unlock();
+
+    store_at(key_to_id(key), port, false);
+}
+
+PreonAddrList Dht::lookup(const std::string &key) {
+    NodeId id = key_to_id(key);
+
+    PreonAddrList values = local_values(id, "127.0.0.1");
+    if (!values.empty())
+        return values;
+
+    iterative_find(id, true, &values);
+
+    return values;
+}
+
+std::string Dht::handle_msg(const std::string &header, const std::string &remote_ip,
+        const std::string &local_ip) {
+    std::stringstream ss(header);
+    std::string type, sender;
+    unsigned short sender_port;
+    if (!(ss >> type >> sender >> sender_port) || !is_job_hash(sender))
+        return "FALSE\n";
+
+    if (sender_port != 0)
+        observe({hex_to_id(sender), {remote_ip, sender_port}});
+
+    std::string arg;
+    if (type != "DHT_PING") {
+        if (!(ss >> arg) || !is_job_hash(arg))
+            return "FALSE\n";
+    }
+
+    if (type == "DHT_PING") {
+        return make_response(m_id, "");
+    }
+    else if (type == "DHT_FIND_NODE" || type == "DHT_FIND_VALUE") {
+        NodeId target = hex_to_id(arg);
+
+        std::stringstream body;
+        if (type == "DHT_FIND_VALUE") {
+            PreonAddrList values = local_values(target, local_ip);
+            if (!values.empty()) {
+                body << "VALUES\n";
+                for (const PreonAddr &addr: values)
+                    body << addr.ip_addr << " " << addr.port << "\n";
+                return make_response(m_id, body.str());
+            }
+            body << "NODES\n";
+        }
+
+        for (const DhtContact &c: closest(target, DHT_K))
+            body << id_to_hex(c.id) << " " << c.addr.ip_addr << " " << c.addr.port << "\n";
+
+        return make_response(m_id, body.str());
+    }
+    else if (type == "DHT_STORE" || type == "DHT_UNSTORE") {
+        unsigned short port;
+        if (!(ss >> port))
+            return "FALSE\n";
+
+        PreonAddr value = {remote_ip, port};
+        NodeId key = hex_to_id(arg);
+
+        m_lock.lock();
+        if (type == "DHT_STORE")
+            m_store[key][value] = time(nullptr) + DHT_RECORD_TTL;
+        else {
+            auto it = m_store.find(key);
+            if (it != m_store.end()) {
+                it->second.erase(value);
+                if (it->second.empty())
+                    m_store.erase(it);
+            }
+        }
+        m_lock.unlock();
+
+        return make_response(m_id, "");
+    }
+
+    return "FALSE\n";
+}
+
+size_t Dht::get_n_contacts() {
+    size_t result = 0;
+
+    m_lock.lock();
+    for (const auto &bucket: m_buckets)
+        result += bucket.size();
+    m_lock.unlock();
+
+    return result;
+}
+
+void Dht::bootstrap() {
+    m_lock.lock();
+    PreonAddrList nodes = m_bootstrap_nodes;
+    m_lock.unlock();
+
+    // a successful ping puts the node in the routing table
+    for (const PreonAddr &addr: nodes) {
+        std::vector<std::string> lines;
+        rpc(addr, request_header("DHT_PING") + "\n", lines);
+    }
+
+    // looking ourselves up fills the buckets close to us, and announces
+    // us to the nodes on the way
+    iterative_find(m_id, false, nullptr);
+}
+
+void Dht::maintenance_thread() {
+    bool joined = false;    // our announcements reached the network
+    time_t next_republish = 0;
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (!m_stop) {
+        // expire records
+        time_t now = time(nullptr);
+        for (auto it = m_store.begin(); it != m_store.end();) {
+            for (auto v = it->second.begin(); v != it->second.end();) {
+                if (v->second < now)
+                    v = it->second.erase(v);
+                else
+                    v++;
+            }
+
+            if (it->second.empty())
+                it = m_store.erase(it);
+            else
+                it++;
+        }
+
+        size_t n_contacts = 0;
+        for (const auto &bucket: m_buckets)
+            n_contacts += bucket.size();
+
+        lock.unlock();
+
+        if (joined && n_contacts == 0) {
+            warn("DHT routing table empty, bootstrapping again");
+            joined = false;
+        }
+
+        if (!joined) {
+            bootstrap();
+
+            // publish everything announced while we were alone
+            joined = get_n_contacts() != 0;
+            next_republish = now;
+        }
+        else {
+            // refresh: a lookup of a random id spreads the routing table
+            // over the whole key space
+            iterative_find(hash_id(random_string(32)), false, nullptr);
+        }
+
+        lock.lock();
+
+        // also while alone, which keeps the records we store ourselves
+        if (next_republish <= now) {
+            next_republish = now + DHT_REPUBLISH_TIME;
+            auto announced = m_announced;
+
+            lock.unlock();
+            for (const auto &a: announced)
+                store_at(key_to_id(a.first), a.second, true);
+            lock.lock();
+        }
+
+        int timeout = joined ? DHT_REFRESH_TIME : DHT_BOOTSTRAP_RETRY_TIME;
+        m_stop_cv.wait_for(lock, std::chrono::seconds(timeout));
+    }
+}
+
+// New contacts are only added when their bucket has room; like Kademlia we
+// prefer long lived nodes. Dead nodes are removed when an rpc to them fails.
+void Dht::observe(const DhtContact &contact) {
+    int index = bucket_index(m_id, contact.id);
+    if (index == -1)
+        return;
+
+    m_lock.lock();
+
+    std::list<DhtContact> &bucket = m_buckets[index];
+    for (auto it = bucket.begin(); it != bucket.end(); it++) {
+        if (it->id == contact.id) {
+            bucket.erase(it);
+            break;
+        }
+    }
+
+    // most recently seen at the back
+    if (bucket.size() < DHT_K)
+        bucket.push_back(contact);
+
+    m_lock.unlock();
+}
+
+void Dht::remove_contact(const NodeId &id) {
+    int index = bucket_index(m_id, id);
+    if (index == -1)
+        return;
+
+    m_lock.lock();
+    m_buckets[index].remove_if([&id](const DhtContact &c) {return c.id == id;});
+    m_lock.unlock();
+}
+
+std::vector<DhtContact> Dht::closest(const NodeId &target, size_t n) {
+    std::vector<DhtContact> result;
+
+    m_lock.lock();
+    for (const auto &bucket: m_buckets)
+        result.insert(result.end(), bucket.begin(), bucket.end());
+    m_lock.unlock();
+
+    sort_by_distance(result, target);
+    if (result.size() > n)
+        result.resize(n);
+
+    return result;
+}
+
+// Our own announcements are stored without an ip, the one we're reached at
+// is filled in
+PreonAddrList Dht::local_values(const NodeId &key, const std::string &self_ip) {
+    PreonAddrList result;
+    time_t now = time(nullptr);
+
+    m_lock.lock();
+    auto it = m_store.find(key);
+    if (it != m_store.end()) {
+        for (const auto &v: it->second) {
+            if (v.second < now)
+                continue;
+
+            PreonAddr addr = v.first;
+            if (addr.ip_addr.empty())
+                addr.ip_addr = self_ip;
+            result.push_back(addr);
+        }
+    }
+    m_lock.unlock();
+
+    return result;
+}
+
+// Iterative lookup: query the DHT_ALPHA closest unqueried nodes of the
+// shortlist each round, until the DHT_K closest nodes have all answered.
+// With find_value it stops at the first node that has values for target.
+std::vector<DhtContact> Dht::iterative_find(const NodeId &target,
+        bool find_value, PreonAddrList *values) {
+    std::vector<DhtContact> shortlist = closest(target, DHT_K);
+    std::set<NodeId> seen;
+    std::set<NodeId> queried;
+    for (const DhtContact &c: shortlist)
+        seen.insert(c.id);
+
+    std::string type = find_value ? "DHT_FIND_VALUE" : "DHT_FIND_NODE";
+    std::string msg = request_header(type) + " " + id_to_hex(target) + "\n";
+
+    for (;;) {
+        std::vector<DhtContact> round;
+        for (size_t i = 0; i < shortlist.size() && i < DHT_K && round.size() < DHT_ALPHA; i++) {
+            if (queried.count(shortlist[i].id) == 0)
+                round.push_back(shortlist[i]);
+        }
+
+        if (round.empty())
+            break;
+
+        for (const DhtContact &c: round) {
+            queried.insert(c.id);
+
+            std::vector<std::string> lines;
+            if (!rpc(c.addr, msg, lines)) {
+                shortlist.erase(std::remove_if(shortlist.begin(), shortlist.end(),
+                            [&c](const DhtContact &s) {return s.id == c.id;}),
+                        shortlist.end());
+                continue;
+            }
+
+            size_t first = 0;
+            if (find_value && !lines.empty() && lines[0] == "VALUES") {
+                for (size_t i = 1; i < lines.size(); i++) {
+                    std::stringstream ss(lines[i]);
+                    PreonAddr addr;
+                    if (ss >> addr.ip_addr >> addr.port)
+                        values->push_back(addr);
+                }
+                return shortlist;
+            }
+            else if (find_value)
+                first = 1;  // skip "NODES"
+
+            for (size_t i = first; i < lines.size(); i++) {
+                DhtContact contact;
+                if (!parse_contact(lines[i], contact) || contact.id == m_id)
+                    continue;
+                if (seen.insert(contact.id).second)
+                    shortlist.push_back(contact);
+            }
+        }
+
+        sort_by_distance(shortlist, target);
+        if (shortlist.size() > DHT_K)
+            shortlist.resize(DHT_K);
+    }
+
+    return shortlist;
+}
+
+// Like Kademlia, we store the record ourselves if we are among the DHT_K
+// nodes closest to the key, so a DHT of a few nodes (or just us) works
+void Dht::store_at(const NodeId &key, unsigned short port, bool store) {
+    std::vector<DhtContact> nodes = iterative_find(key, false, nullptr);
+
+    if (nodes.size() < DHT_K || closer(m_id, nodes.back().id, key)) {
+        if (nodes.size() == DHT_K)
+            nodes.pop_back();
+
+        PreonAddr self = {"", port};
+        m_lock.lock();
+        if (store)
+            m_store[key][self] = time(nullptr) + DHT_RECORD_TTL;
+        else {
+            auto it = m_store.find(key);
+            if (it != m_store.end()) {
+                it->second.erase(self);
+                if (it->second.empty())
+                    m_store.erase(it);
+            }
+        }
+        m_lock.unlock();
+    }
+
+    if (nodes.empty()) {
+        // announcements are (re)published once we joined
+        debug("DHT has no other nodes to store '" + id_to_hex(key) + "' at");
+        return;
+    }
+
+    std::string type = store ? "DHT_STORE" : "DHT_UNSTORE";
+    std::string msg = request_header(type) + " " + id_to_hex(key) + " " + STR(port) + "\n";
+    for (const DhtContact &c: nodes) {
+        std::vector<std::string> lines;
+        rpc(c.addr, msg, lines);
+    }
+}
+
+// Sends msg and splits the payload of the response into lines, the
+// responder's id (first line) is taken off and put in the routing table.
+bool Dht::rpc(const PreonAddr &addr, const std::string &msg,
+        std::vector<std::string> &lines) {
+    m_n_rpcs++;
+
+    std::string payload;
+    try {
+        NetworkClient client(addr, nullptr);
+        if (!client.request(msg, payload))
+            return false;
+    }
+    catch (PreonExcept &e) {
+        debug(STR("DHT rpc failed: ") + e.what());
+
+        // forget the node, whatever its id was
+        std::vector<NodeId> dead;
+        m_lock.lock();
+        for (const auto &bucket: m_buckets) {
+            for (const DhtContact &c: bucket) {
+                if (c.addr == addr)
+                    dead.push_back(c.id);
+            }
+        }
+        m_lock.unlock();
+        for (const NodeId &id: dead)
+            remove_contact(id);
+
+        return false;
+    }
+
+    split(payload, lines, '\n');
+    if (lines.empty() || !is_job_hash(lines[0]))
+        return false;
+
+    observe({hex_to_id(lines[0]), addr});
+    lines.erase(lines.begin());
+
+    return true;
+}
+
+std::string Dht::request_header(const std::string &type) {
+    return type + " " + id_to_hex(m_id) + " " + STR(m_port);
+}
@@ -0,0 +1,98 @@
+#ifndef __dht_h__
+#define __dht_h__
+
+#include "preon_types.h"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::array<uint8_t, 32> NodeId;
+
+struct DhtContact {
+    NodeId      id;
+    PreonAddr   addr;
+};
+
+// Kademlia style distributed hash table mapping job ids to the peers that
+// have the job, which replaces the tracker in dht mode. Job ids are already
+// 256 bit hashes and are used as keys directly; other keys ("idle") are
+// hashed. Messages go over the normal preon port (DHT_* in NetworkClient):
+//
+//     DHT_PING       sender_id sender_port
+//     DHT_FIND_NODE  sender_id sender_port target
+//     DHT_FIND_VALUE sender_id sender_port key
+//     DHT_STORE      sender_id sender_port key port
+//     DHT_UNSTORE    sender_id sender_port key port
+//
+// Every response is "size\n" followed by a payload which starts with the
+// responder's id. A sender_port of 0 marks a client which can't be contacted.
+class Dht {
+    public:
+        Dht(unsigned short port);
+        ~Dht();
+
+        Dht(const Dht &) = delete;
+        Dht &operator=(const Dht &) = delete;
+
+        // Starts the maintenance thread, which joins the network through the
+        // given nodes and then refreshes the routing table, republishes our
+        // announcements and expires records. Announcements made before the
+        // join completed are published as soon as it did.
+        void start(const PreonAddrList &bootstrap_nodes);
+
+        void announce(const std::string &key, unsigned short port);
+        void withdraw(const std::string &key, unsigned short port);
+        PreonAddrList lookup(const std::string &key);
+
+        // Handles a DHT_* request and returns the complete response;
+        // local_ip is where the request reached us
+        std::string handle_msg(const std::string &header, const std::string &remote_ip,
+                const std::string &local_ip);
+
+        uint64_t get_n_rpcs() const {return m_n_rpcs;}
+        size_t get_n_contacts();
+
+    private:
+        const NodeId            m_id;
+        const unsigned short    m_port;
+
+        std::mutex                                  m_lock;
+        std::vector<std::list<DhtContact>>          m_buckets;
+        std::map<NodeId, std::map<PreonAddr, time_t>> m_store;
+        std::set<std::pair<std::string, unsigned short>> m_announced;
+        PreonAddrList                               m_bootstrap_nodes;
+
+        std::atomic<uint64_t>   m_n_rpcs;
+
+        std::thread             m_thread;
+        std::condition_variable m_stop_cv;
+        bool                    m_stop;
+
+        void bootstrap();
+        void maintenance_thread();
+
+        void observe(const DhtContact &contact);
+        void remove_contact(const NodeId &id);
+        std::vector<DhtContact> closest(const NodeId &target, size_t n);
+        PreonAddrList local_values(const NodeId &key, const std::string &self_ip);
+
+        std::vector<DhtContact> iterative_find(const NodeId &target,
+                bool find_value, PreonAddrList *values);
+        void store_at(const NodeId &key, unsigned short port, bool store);
+
+        bool rpc(const PreonAddr &addr, const std::string &msg,
+                std::vector<std::string> &lines);
+        std::string request_header(const std::string &type);
+};
+
+#endif //#ifndef __dht_h__
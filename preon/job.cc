@@ -14,12 +14,16 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/socket.h>
 
 
 Job::Job(const std::string &_dir, const std::string &_id) :
     id(_id), dir(_dir),
     manifest(_dir + "/" + PREON_MANIFEST_FILE),
-    status(_dir + "/" + PREON_STATUS_FILE)
+    status(_dir + "/" + PREON_STATUS_FILE),
+    worker_informed(false),
+    priority(DEFAULT_PRIORITY),
+    master_addr_known(false)
 { }
 
 std::string Job::get_job_id() {
@@ -40,9 +44,15 @@ std::string Job::get_manifest() {
     return result;
 }
 
+// Does nothing if the manifest was already read by an earlier attempt
 void Job::read_manifest() {
     lock.lock();
 
+    if (!manifest.get_text_empty()) {
+        lock.unlock();
+        return;
+    }
+
     try {
         manifest.read();
     }
@@ -51,8 +61,12 @@ void Job::read_manifest() {
         throw;
     }
 
+    priority = manifest.get_priority();
+    resources = manifest.get_resources();
+
     std::vector<File> files;
     manifest.get_files(files);
+    status.set_block_size(manifest.get_block_size());
 
     if (status.read(files)) {
         lock.unlock();
@@ -89,7 +103,7 @@ bool Job::is_master() {
     return result;
 }
 
-void Job::write_block(const std::string &filename, int block_id, const std::vector<uint8_t> &data) {
+void Job::write_block(const std::string &filename, int64_t block_id, const std::vector<uint8_t> &data) {
     lock.lock();
     try {
         unsafe_write_block(filename, block_id, data);
@@ -98,10 +112,11 @@ void Job::write_block(const std::string &filename, int block_id, const std::vect
         lock.unlock();
         throw e;
     }
+    unsafe_notify_have(filename, block_id);
     lock.unlock();
 }
 
-bool Job::read_block(const std::string &filename, int block_id, std::vector<uint8_t> &data) {
+bool Job::read_block(const std::string &filename, int64_t block_id, std::vector<uint8_t> &data) {
     bool result;
 
     lock.lock();
@@ -117,16 +132,85 @@ bool Job::read_block(const std::string &filename, int block_id, std::vector<uint
     return result;
 }
 
-int Job::claim_empty_block(const std::string &filename) {
-    int result;
+int64_t Job::claim_rarest_block(const std::string &filename,
+        const std::vector<int> &availability) {
+    int64_t result;
 
     lock.lock();
-    result = status.file_claim_empty_block(filename);
+    result = status.file_claim_rarest_block(filename, availability);
     lock.unlock();
 
     return result;
 }
 
+// Gives back a claimed block which couldn't be downloaded
+void Job::release_block(const std::string &filename, int64_t block_id) {
+    lock.lock();
+    if (status.file_get_block_state(filename, block_id) == DOWNLOADING)
+        status.set_block_status(filename, block_id, EMPTY);
+    lock.unlock();
+}
+
+bool Job::get_bitfield(const std::string &filename, std::string &bitfield) {
+    lock.lock();
+
+    if (manifest.get_text_empty()) {
+        lock.unlock();
+        return false;
+    }
+
+    try {
+        bitfield = status.file_get_bitfield(filename);
+    }
+    catch (PreonExcept &e) {
+        lock.unlock();
+        return false;
+    }
+
+    lock.unlock();
+
+    return true;
+}
+
+// blocks of the file which are not DONE
+int64_t Job::get_n_missing_blocks(const std::string &filename) {
+    int64_t result;
+
+    lock.lock();
+    try {
+        result = status.file_get_n_missing_blocks(filename);
+    }
+    catch (PreonExcept &e) {
+        lock.unlock();
+        throw e;
+    }
+    lock.unlock();
+
+    return result;
+}
+
+size_t Job::get_block_size() {
+    size_t result;
+
+    lock.lock();
+    result = manifest.get_block_size();
+    lock.unlock();
+
+    return result;
+}
+
+void Job::add_have_listener(int fd) {
+    lock.lock();
+    have_fds.insert(fd);
+    lock.unlock();
+}
+
+void Job::remove_have_listener(int fd) {
+    lock.lock();
+    have_fds.erase(fd);
+    lock.unlock();
+}
+
 void Job::get_files(std::vector<File> &files) {
     files.clear();
 
@@ -151,6 +235,34 @@ void Job::reset_file(const std::string &filename) {
     lock.unlock();
 }
 
+void Job::adopt_file(const std::string &filename, const std::string &src) {
+    // cloned next to it and renamed over it, it may be partly downloaded
+    std::string path = dir + "/" + filename;
+    std::string tmp_path = path + ".adopt";
+    unlink(tmp_path.c_str());
+    clone_file(tmp_path, src);
+
+    lock.lock();
+    try {
+        if (rename(tmp_path.c_str(), path.c_str()) == -1)
+            throw PE_SYS("rename");
+
+        File file = manifest.get_file(filename);
+        status.set_file(file, DONE);
+        status.write();
+
+        int64_t n_blocks = size_to_nblks(file.size, manifest.get_block_size());
+        for (int64_t block_id = 0; block_id < n_blocks; block_id++)
+            unsafe_notify_have(filename, block_id);
+    }
+    catch (PreonExcept &e) {
+        lock.unlock();
+        unlink(tmp_path.c_str());
+        throw e;
+    }
+    lock.unlock();
+}
+
 void Job::update_dynamic_metadata(const std::vector<File> &dynamic_metadata) {
     lock.lock();
 
@@ -228,6 +340,100 @@ bool Job::get_execution_finished() {
     return result;
 }
 
+int Job::get_priority() {
+    int result;
+
+    lock.lock();
+    result = priority;
+    lock.unlock();
+
+    return result;
+}
+
+void Job::set_priority(int _priority) {
+    lock.lock();
+    priority = _priority;
+    lock.unlock();
+}
+
+Resources Job::get_resources() {
+    Resources result;
+
+    lock.lock();
+    result = resources;
+    lock.unlock();
+
+    return result;
+}
+
+void Job::set_resources(const Resources &_resources) {
+    lock.lock();
+    resources = _resources;
+    lock.unlock();
+}
+
+void Job::set_master_addr(const PreonAddr &addr) {
+    lock.lock();
+    master_addr = addr;
+    master_addr_known = true;
+    lock.unlock();
+}
+
+bool Job::get_master_addr(PreonAddr &addr) {
+    bool result;
+
+    lock.lock();
+    result = master_addr_known;
+    if (result)
+        addr = master_addr;
+    lock.unlock();
+
+    return result;
+}
+
+void Job::set_result_peers(const PreonAddrList &addrs) {
+    lock.lock();
+    result_peers = addrs;
+    lock.unlock();
+}
+
+PreonAddrList Job::get_result_peers() {
+    PreonAddrList result;
+
+    lock.lock();
+    result = result_peers;
+    lock.unlock();
+
+    return result;
+}
+
+bool Job::mark_worker_informed() {
+    bool result;
+
+    lock.lock();
+    result = !worker_informed;
+    worker_informed = true;
+    lock.unlock();
+
+    return result;
+}
+
+void Job::clear_worker_informed() {
+    lock.lock();
+    worker_informed = false;
+    lock.unlock();
+}
+
+bool Job::get_worker_informed() {
+    bool result;
+
+    lock.lock();
+    result = worker_informed;
+    lock.unlock();
+
+    return result;
+}
+
 bool Job::unsafe_is_fishined(const std::string &filename) {
     try {
         File file = manifest.get_file(filename);
@@ -248,14 +454,14 @@ bool Job::unsafe_is_fishined(const std::string &filename) {
     return false;
 }
 
-void Job::unsafe_write_block(const std::string &filename, int block_id, const std::vector<uint8_t> &data) {
-    int n_blocks = status.file_get_n_blocks(filename);
+void Job::unsafe_write_block(const std::string &filename, int64_t block_id, const std::vector<uint8_t> &data) {
+    int64_t n_blocks = status.file_get_n_blocks(filename);
     if (block_id < 0 || block_id >= n_blocks)
         throw PE("Invalid block size");
     File file = manifest.get_file(filename);
 
-    size_t pos = block_id * PREON_BLOCK_SIZE;
-    size_t block_size = std::min(PREON_BLOCK_SIZE, file.size - pos);
+    uint64_t pos = block_id * manifest.get_block_size();
+    size_t block_size = std::min((uint64_t)manifest.get_block_size(), file.size - pos);
 
     if (block_size != data.size())
         throw PE("Block had invalid size");
@@ -265,7 +471,7 @@ void Job::unsafe_write_block(const std::string &filename, int block_id, const st
     if (fd == -1)
         throw PE_SYS("open");
 
-    if (lseek(fd, pos, SEEK_SET) == -1) {
+    if (lseek(fd, (off_t)pos, SEEK_SET) == -1) {
         close(fd);
         throw PE_SYS("seek");
     }
@@ -287,14 +493,30 @@ void Job::unsafe_write_block(const std::string &filename, int block_id, const st
     status.write();
 }
 
-bool Job::unsafe_read_block(const std::string &filename, int block_id, std::vector<uint8_t> &data) {
+// Never blocks on a slow listener; a listener that can't take the whole
+// message is disconnected, as a partial line would corrupt its stream.
+void Job::unsafe_notify_have(const std::string &filename, int64_t block_id) {
+    std::string msg = "HAVE " + id + " " + filename + " " + STR(block_id) + "\n";
+
+    for (auto it = have_fds.begin(); it != have_fds.end();) {
+        ssize_t ret = send(*it, msg.c_str(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret != (ssize_t)msg.size()) {
+            shutdown(*it, SHUT_RDWR);
+            it = have_fds.erase(it);
+        }
+        else
+            it++;
+    }
+}
+
+bool Job::unsafe_read_block(const std::string &filename, int64_t block_id, std::vector<uint8_t> &data) {
     if (!status.file_has_block(filename, block_id))
         return false;
 
     File file = manifest.get_file(filename);
 
-    size_t pos = block_id * PREON_BLOCK_SIZE;
-    size_t block_size = std::min(PREON_BLOCK_SIZE, file.size - pos);
+    uint64_t pos = block_id * manifest.get_block_size();
+    size_t block_size = std::min((uint64_t)manifest.get_block_size(), file.size - pos);
 
     data.assign(block_size, 0);
 
@@ -303,7 +525,7 @@ bool Job::unsafe_read_block(const std::string &filename, int block_id, std::vect
     if (fd == -1)
         throw PE_SYS("open");
 
-    if (lseek(fd, pos, SEEK_SET) == -1) {
+    if (lseek(fd, (off_t)pos, SEEK_SET) == -1) {
         close(fd);
         throw PE_SYS("seek");
     }
@@ -4,6 +4,7 @@
 #include "blocks.h"
 #include "preon_types.h"
 #include "manifest.h"
+#include "peer_set.h"
 #include "status.h"
 
 #include <string>
@@ -11,6 +12,7 @@
 #include <map>
 #include <cstdint>
 #include <mutex>
+#include <set>
 
 class Job {
     public:
@@ -26,15 +28,23 @@ class Job {
         bool is_fishined(const std::string &filename);
         bool is_master();
 
-        void write_block(const std::string &filename, int block_id,
+        void write_block(const std::string &filename, int64_t block_id,
                 const std::vector<uint8_t> &data);
-        bool read_block(const std::string &filename, int block_id,
+        bool read_block(const std::string &filename, int64_t block_id,
                 std::vector<uint8_t> &data);
 
-        int claim_empty_block(const std::string &filename);
+        int64_t claim_rarest_block(const std::string &filename,
+                const std::vector<int> &availability);
+        void release_block(const std::string &filename, int64_t block_id);
+        bool get_bitfield(const std::string &filename, std::string &bitfield);
+        int64_t get_n_missing_blocks(const std::string &filename);
+        size_t get_block_size();
 
         void get_files(std::vector<File> &files);
         void reset_file(const std::string &filename);
+        // Takes a file from the content store instead of downloading it, as
+        // a clone; verify it like a downloaded file
+        void adopt_file(const std::string &filename, const std::string &src);
         void hash_dynamic_files();
         void update_dynamic_metadata(const std::vector<File> &dynamic_metadata);
 
@@ -42,6 +52,40 @@ class Job {
         void execution_finished();
         bool get_execution_finished();
 
+        // From the manifest once it is read, until then what the master
+        // told us in INFORM_JOB
+        int get_priority();
+        void set_priority(int priority);
+
+        // Same as the priority: from the manifest, until then from the offer
+        Resources get_resources();
+        void set_resources(const Resources &resources);
+
+        // master only: the job is handed out to a worker, pushed (INFORM_JOB)
+        // or pulled (STEAL_JOBS), so it isn't handed out twice. Marking
+        // returns false if it already was; clear it if the hand out failed.
+        bool mark_worker_informed();
+        void clear_worker_informed();
+        bool get_worker_informed();
+
+        // worker only: the master which handed us the job, if we know it,
+        // gets our heartbeats
+        void set_master_addr(const PreonAddr &addr);
+        bool get_master_addr(PreonAddr &addr);
+
+        // master only: the workers whose results we took, the dynamic files
+        // are only downloaded from them
+        void set_result_peers(const PreonAddrList &addrs);
+        PreonAddrList get_result_peers();
+
+        // swarm of this job as far as we know, has its own locking
+        PeerSet &get_peers() {return peers;}
+
+        // Connections (INTERESTED) on which every block we finish is pushed
+        // as "HAVE job file block". The caller keeps owning the fd.
+        void add_have_listener(int fd);
+        void remove_have_listener(int fd);
+
     private:
         std::mutex lock;
 
@@ -50,14 +94,24 @@ class Job {
 
         Manifest manifest;
         Status   status;
+        PeerSet  peers;
+
+        std::set<int> have_fds;
+        bool worker_informed;
+        int priority;
+        Resources resources;
+        bool master_addr_known;
+        PreonAddr master_addr;
+        PreonAddrList result_peers;
 
         bool unsafe_is_fishined(const std::string &filename);
         void unsafe_write_block(const std::string &filename,
-                int block_id, const std::vector<uint8_t> &data);
+                int64_t block_id, const std::vector<uint8_t> &data);
         bool unsafe_read_block(const std::string &filename,
-                int block_id, std::vector<uint8_t> &data);
+                int64_t block_id, std::vector<uint8_t> &data);
 
         void unsafe_hash_dynamic_files();
+        void unsafe_notify_have(const std::string &filename, int64_t block_id);
 };
 
 
@@ -0,0 +1,92 @@
+#include "consts.h"
+#include "error.h"
+#include "job_monitor.h"
+#include "network_client.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+JobMonitor::JobMonitor(ProgramState &state) :
+    m_state(state),
+    m_stop(false)
+{
+    m_thread = std::thread(&JobMonitor::monitor_thread, this);
+}
+
+JobMonitor::~JobMonitor() {
+    m_lock.lock();
+    m_stop = true;
+    m_lock.unlock();
+    m_cv.notify_one();
+
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void JobMonitor::monitor_thread() {
+    for (;;) {
+        std::unique_lock<std::mutex> lock(m_lock);
+        if (m_cv.wait_for(lock, std::chrono::seconds(HEARTBEAT_INTERVAL),
+                    [this]() {return m_stop;}))
+            return;
+        lock.unlock();
+
+        send_heartbeats();
+        redispatch_stragglers();
+    }
+}
+
+// A single connection per master, for all of its jobs
+void JobMonitor::send_heartbeats() {
+    std::set<std::string> job_ids;
+    m_state.get_job_ids(job_ids);
+
+    std::map<PreonAddr, std::vector<std::pair<std::string, std::string>>> masters;
+    for (const std::string &job_id: job_ids) {
+        Job *job = m_state.get_job(job_id);
+        PreonAddr master;
+        if (job == nullptr || job->is_master() || !job->get_master_addr(master))
+            continue;
+
+        std::string stage = m_state.get_job_stage(job_id);
+        if (stage == "finished" && m_reported_finished.count(job_id) != 0)
+            continue;
+
+        masters[master].push_back({job_id, stage});
+    }
+
+    unsigned short port = m_state.get_config()->get_listen_port();
+    for (const auto &master: masters) {
+        try {
+            NetworkClient client(master.first, nullptr);
+            if (!client.heartbeat(port, master.second))
+                continue;
+
+            for (const auto &job: master.second) {
+                if (job.second == "finished")
+                    m_reported_finished.insert(job.first);
+            }
+        }
+        catch (PreonExcept &e) {
+            debug(STR("heartbeat to ") + master.first.ip_addr + ":" + STR(master.first.port)
+                    + " failed: " + e.what());
+        }
+    }
+}
+
+void JobMonitor::redispatch_stragglers() {
+    std::vector<std::string> job_ids;
+    m_state.get_straggler_detector().find_stragglers(job_ids);
+
+    for (const std::string &job_id: job_ids) {
+        Job *job = m_state.get_job(job_id);
+        if (job == nullptr)
+            continue;
+
+        job->clear_worker_informed();
+        m_state.get_retry_scheduler().wake(job_id);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef __job_monitor_h__
+#define __job_monitor_h__
+
+#include "program_state.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+// Every HEARTBEAT_INTERVAL, tells the masters of the jobs we work on how
+// far we got with them (HEARTBEAT), and has our own jobs which straggle
+// (see StragglerDetector) dispatched again: they are marked as needing a
+// worker, and their parked job worker is woken to push them to an idle
+// peer or announce them for stealing. A job we finished is reported as
+// "finished" once, so its master doesn't take it for silent while it
+// collects the results.
+class JobMonitor {
+    public:
+        JobMonitor(ProgramState &state);
+        ~JobMonitor();
+
+        JobMonitor(const JobMonitor &) = delete;
+        JobMonitor &operator=(const JobMonitor &) = delete;
+
+    private:
+        ProgramState               &m_state;
+
+        std::mutex                  m_lock;
+        std::condition_variable     m_cv;
+        bool                        m_stop;
+        std::thread                 m_thread;
+
+        // only touched by the monitor thread
+        std::set<std::string>       m_reported_finished;
+
+        void monitor_thread();
+        void send_heartbeats();
+        void redispatch_stragglers();
+};
+
+#endif //#ifndef __job_monitor_h__
@@ -0,0 +1,132 @@
+#include "consts.h"
+#include "error.h"
+#include "job_queue.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace {
+
+double percentile(std::vector<double> sorted, double p) {
+    std::sort(sorted.begin(), sorted.end());
+    size_t index = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+}
+
+const char *stage_name(JobStage stage) {
+    switch (stage) {
+        case JobStage::fetch:   return "fetch";
+        case JobStage::verify:  return "verify";
+        case JobStage::execute: return "execute";
+        case JobStage::publish: return "publish";
+        case JobStage::done:    return "done";
+    }
+
+    return "unknown";
+}
+
+void JobQueue::push(const std::string &job_id, int priority) {
+    m_levels[priority].push_back({job_id, Clock::now()});
+    m_size++;
+}
+
+std::string JobQueue::pop() {
+    if (m_size == 0)
+        throw PE("Job queue is empty");
+
+    Clock::time_point now = Clock::now();
+    auto best = m_levels.find(best_level(now)->first);
+
+    return take(best, best->second.begin(), now);
+}
+
+void JobQueue::pop(const std::string &job_id) {
+    for (auto level = m_levels.begin(); level != m_levels.end(); level++) {
+        for (auto entry = level->second.begin(); entry != level->second.end(); entry++) {
+            if (entry->job_id == job_id) {
+                take(level, entry, Clock::now());
+                return;
+            }
+        }
+    }
+
+    throw PE("Job not in queue");
+}
+
+std::string JobQueue::peek() const {
+    if (m_size == 0)
+        throw PE("Job queue is empty");
+
+    return best_level(Clock::now())->second.front().job_id;
+}
+
+// Only the head of a level can win, it waited longest on that level
+JobQueue::Levels::const_iterator JobQueue::best_level(Clock::time_point now) const {
+    auto best = m_levels.end();
+    double best_priority = 0.0;
+    for (auto it = m_levels.begin(); it != m_levels.end(); it++) {
+        if (it->second.empty())
+            continue;
+
+        const Entry &head = it->second.front();
+        double waited = std::chrono::duration<double>(now - head.queued).count();
+        double priority = it->first + waited / PRIORITY_AGING_TIME;
+
+        if (best == m_levels.end() || priority > best_priority
+                || (priority >= best_priority && head.queued < best->second.front().queued)) {
+            best = it;
+            best_priority = priority;
+        }
+    }
+
+    return best;
+}
+
+std::string JobQueue::take(Levels::iterator level, std::deque<Entry>::iterator entry,
+        Clock::time_point now) {
+    std::string job_id = entry->job_id;
+    double waited = std::chrono::duration<double>(now - entry->queued).count();
+    level->second.erase(entry);
+    m_size--;
+
+    Waits &waits = m_waits[level->first];
+    if (waits.samples.size() < QUEUE_WAIT_SAMPLES)
+        waits.samples.push_back(waited);
+    else
+        waits.samples[waits.next] = waited;
+    waits.next = (waits.next + 1) % QUEUE_WAIT_SAMPLES;
+    waits.n_claimed++;
+
+    return job_id;
+}
+
+void JobQueue::get_job_ids(std::set<std::string> &job_ids) const {
+    for (const auto &level: m_levels) {
+        for (const Entry &entry: level.second)
+            job_ids.insert(entry.job_id);
+    }
+}
+
+std::string JobQueue::report() const {
+    std::stringstream ss;
+
+    ss << "queue_length " << m_size << "\n";
+    for (const auto &level: m_levels) {
+        if (!level.second.empty())
+            ss << "queue_priority_" << level.first << "_length " << level.second.size() << "\n";
+    }
+
+    for (const auto &w: m_waits) {
+        std::string name = "queue_priority_" + STR(w.first);
+        const Waits &waits = w.second;
+
+        ss << name << "_claimed " << waits.n_claimed << "\n"
+           << name << "_wait_p50_s " << percentile(waits.samples, 50.0) << "\n"
+           << name << "_wait_p90_s " << percentile(waits.samples, 90.0) << "\n"
+           << name << "_wait_p99_s " << percentile(waits.samples, 99.0) << "\n";
+    }
+
+    return ss.str();
+}
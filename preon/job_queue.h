@@ -0,0 +1,76 @@
+#ifndef __job_queue_h__
+#define __job_queue_h__
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// The lifecycle of a job is a pipeline. Every stage has its own pool of
+// worker threads and its own queue, so a job's inputs download while the
+// previous job executes.
+enum class JobStage {
+    fetch,      // manifest, inputs or (master) results; may park the job
+    verify,     // hash what was downloaded
+    execute,    // workers only, the pool is sized to the cores
+    publish,    // hash the outputs and announce them
+    done,       // not a stage, the job left the pipeline
+};
+const size_t N_JOB_STAGES = 4;
+
+const char *stage_name(JobStage stage);
+
+// Jobs waiting for a worker, FIFO within a priority level. The job that is
+// claimed is the head with the highest priority after aging: every
+// PRIORITY_AGING_TIME a job waits counts as one level more, so a backlog of
+// high priority jobs can't starve the rest. Ties go to the job waiting
+// longest. Not thread safe, ProgramState locks it.
+class JobQueue {
+    public:
+        JobQueue() {};
+
+        void push(const std::string &job_id, int priority);
+        std::string pop();
+        // the job pop() would return now
+        std::string peek() const;
+        // Takes a job peek() returned, even if aging made another one the
+        // best since
+        void pop(const std::string &job_id);
+        bool empty() const {return m_size == 0;}
+        size_t size() const {return m_size;}
+
+        void get_job_ids(std::set<std::string> &job_ids) const;
+
+        // queue length and wait time percentiles per priority level
+        std::string report() const;
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Entry {
+            std::string         job_id;
+            Clock::time_point   queued;
+        };
+
+        // recent wait times (s) of claimed jobs, a ring buffer
+        struct Waits {
+            std::vector<double> samples;
+            size_t              next = 0;
+            uint64_t            n_claimed = 0;
+        };
+
+        typedef std::map<int, std::deque<Entry>> Levels;
+
+        Levels::const_iterator best_level(Clock::time_point now) const;
+        std::string take(Levels::iterator level, std::deque<Entry>::iterator entry,
+                Clock::time_point now);
+
+        Levels                              m_levels;
+        std::map<int, Waits>                m_waits;
+        size_t                              m_size = 0;
+};
+
+#endif //#ifndef __job_queue_h__
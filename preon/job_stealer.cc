@@ -0,0 +1,146 @@
+#include "consts.h"
+#include "error.h"
+#include "job_stealer.h"
+#include "network_client.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+
+JobStealer::JobStealer(ProgramState &state) :
+    m_state(state),
+    m_tracker(state.get_config()->get_trackers(), state.get_dht()),
+    m_stop(false)
+{
+    m_event_fd = eventfd(0, EFD_NONBLOCK);
+    if (m_event_fd == -1)
+        throw PE_SYS("eventfd");
+
+    m_thread = std::thread(&JobStealer::steal_thread, this);
+}
+
+JobStealer::~JobStealer() {
+    m_lock.lock();
+    m_stop = true;
+    m_lock.unlock();
+    wake();
+
+    if (m_thread.joinable())
+        m_thread.join();
+    close(m_event_fd);
+}
+
+void JobStealer::wake() {
+    uint64_t one = 1;
+    if (write(m_event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        warn(STR("job stealer: write(): ") + strerror(errno));
+}
+
+void JobStealer::steal_thread() {
+    for (;;) {
+        m_lock.lock();
+        bool stop = m_stop;
+        m_lock.unlock();
+        if (stop)
+            return;
+
+        try {
+            steal_round();
+        }
+        catch (PreonExcept &e) {
+            warn(STR("Stealing jobs failed: ") + e.what());
+        }
+
+        wait_round();
+    }
+}
+
+// Sleeps until a master announces queued jobs, wake() or STEAL_INTERVAL
+void JobStealer::wait_round() {
+    if (!m_sub) {
+        try {
+            m_sub = m_tracker.subscribe_job(QUEUED_KEY);
+        }
+        catch (PreonExcept &e) {
+            debug(STR("job stealer: subscription failed: ") + e.what());
+        }
+    }
+
+    std::vector<struct pollfd> pfds = {{m_event_fd, POLLIN, 0}};
+    if (m_sub) {
+        for (int fd: m_sub->get_fds())
+            pfds.push_back({fd, POLLIN, 0});
+    }
+
+    if (poll(pfds.data(), pfds.size(), STEAL_INTERVAL * 1000) == -1) {
+        if (errno != EINTR)
+            warn(STR("job stealer: poll(): ") + strerror(errno));
+        return;
+    }
+
+    uint64_t value;
+    if (pfds[0].revents != 0 && read(m_event_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+        warn(STR("job stealer: read(): ") + strerror(errno));
+
+    // a LEAVE (a master withdrawing) starts a round as well, that's cheap
+    if (m_sub) {
+        try {
+            TrackerEvent event;
+            while (m_sub->wait_event(event, 0));
+        }
+        catch (PreonExcept &e) {
+            warn(STR("Lost tracker subscription: ") + e.what());
+            m_sub.reset();
+        }
+    }
+}
+
+void JobStealer::steal_round() {
+    Resources room = m_state.get_free_resources();
+    if (room.cores == 0)
+        return;
+
+    unsigned short port = m_state.get_config()->get_listen_port();
+    PreonAddrList masters = m_tracker.query_job(QUEUED_KEY);
+    std::random_shuffle(masters.begin(), masters.end());
+
+    std::vector<std::string> stolen;
+    for (const PreonAddr &addr: masters) {
+        if (room.cores == 0)
+            break;
+
+        std::vector<JobOffer> jobs;
+        try {
+            NetworkClient client(addr, nullptr);
+            if (!client.steal_jobs(room, port, jobs))
+                continue;
+        }
+        catch (PreonExcept &e) {
+            debug(e.what());
+            continue;
+        }
+
+        for (const JobOffer &job: jobs) {
+            // the master counts it as handed out, so it is ours either way,
+            // even if an INFORM_JOBS took the room meanwhile
+            if (!m_state.accept_job(job, false)) {
+                warn("Failed to accept stolen job '" + job.job_id + "'");
+                continue;
+            }
+
+            m_state.get_job(job.job_id)->set_master_addr(addr);
+            stolen.push_back(job.job_id);
+            info("stole job '" + job.job_id + "' from " + addr.ip_addr + ":" + STR(addr.port));
+            room.cores -= std::min(room.cores, job.resources.cores);
+            room.memory -= std::min(room.memory, job.resources.memory);
+            room.scratch -= std::min(room.scratch, job.resources.scratch);
+        }
+    }
+
+    if (!stolen.empty())
+        m_tracker.inform_jobs(port, stolen);
+}
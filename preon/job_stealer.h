@@ -0,0 +1,42 @@
+#ifndef __job_stealer_h__
+#define __job_stealer_h__
+
+#include "program_state.h"
+#include "tracker.h"
+
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Pull side of job dispatch. Masters with jobs no idle worker accepted
+// announce themselves under QUEUED_KEY; while we have free workers, we ask
+// them for jobs (STEAL_JOBS) instead of waiting to be pushed one. A round is
+// started by a master announcing (a JOIN on the subscription), by wake()
+// (a worker ran out of jobs) and every STEAL_INTERVAL, which is all there
+// is in dht mode.
+class JobStealer {
+    public:
+        JobStealer(ProgramState &state);
+        ~JobStealer();
+
+        JobStealer(const JobStealer &) = delete;
+        JobStealer &operator=(const JobStealer &) = delete;
+
+        void wake();
+
+    private:
+        ProgramState                           &m_state;
+        Tracker                                 m_tracker;
+        std::unique_ptr<TrackerSubscription>    m_sub;  // only used by the thread
+
+        std::mutex                              m_lock;
+        int                                     m_event_fd;
+        bool                                    m_stop;
+        std::thread                             m_thread;
+
+        void steal_thread();
+        void wait_round();
+        void steal_round();
+};
+
+#endif //#ifndef __job_stealer_h__
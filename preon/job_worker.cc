@@ -6,27 +6,234 @@
 #include "utils.h"
 #include "tracker.h"
 
+#include <algorithm>
+#include <chrono>
 #include <climits>
 #include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <mutex>
 #include <set>
+#include <sstream>
+#include <thread>
+#include <poll.h>
+#include <sched.h>
 #include <unistd.h>
-#include <sys/stat.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/wait.h>
 
+namespace {
+
+std::unique_ptr<TrackerSubscription> subscribe(Tracker &tracker, const std::string &job_id) {
+    try {
+        return tracker.subscribe_job(job_id);
+    }
+    catch (PreonExcept &e) {
+        warn(STR("Tracker subscription failed, falling back to polling: ") + e.what());
+    }
+
+    return nullptr;
+}
+
+bool same_files(std::vector<File> a, std::vector<File> b) {
+    if (a.size() != b.size())
+        return false;
+
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].name != b[i].name || a[i].hash != b[i].hash || a[i].size != b[i].size)
+            return false;
+    }
+
+    return true;
+}
+
+std::string join(const std::vector<int> &values) {
+    std::string result;
+    for (int value: values)
+        result += (result.empty() ? "" : ",") + STR(value);
+
+    return result;
+}
+
+// Ours, plus where the job is placed, so its thread pools size themselves
+// to its cpus instead of to the host
+void job_environment(const std::vector<int> &cpus, const std::vector<int> &nodes,
+        std::vector<std::string> &env) {
+    std::map<std::string, std::string> placement = {
+        {"OMP_NUM_THREADS", STR(cpus.size())},
+        {"PREON_CPUS", join(cpus)},
+        {"PREON_NUMA_NODES", join(nodes)},
+    };
+
+    env.clear();
+    for (char **var = environ; *var != nullptr; var++) {
+        std::string str = *var;
+        if (placement.find(str.substr(0, str.find('='))) == placement.end())
+            env.push_back(str);
+    }
+
+    if (cpus.empty())
+        return;
+    for (const auto &var: placement)
+        env.push_back(var.first + "=" + var.second);
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// peers whose bitfield has block_id, best scoring first
+PreonAddrList block_holders(const PeerBitfields &bitfields, int64_t block_id,
+        PeerScoreboard &scoreboard) {
+    PreonAddrList list;
+    for (const auto &peer: bitfields) {
+        if (peer.second[block_id] == '1')
+            list.push_back(peer.first);
+    }
 
-JobWorker::JobWorker(const std::string &_job_id, const ProgramState &state) {
+    return scoreboard.order(list);
+}
+
+// Shared by the redundant requests for a single block in the endgame
+struct EndgameRace {
+    std::mutex lock;
+    bool done = false;
+    std::set<int> fds;              // connections still downloading
+    std::vector<uint8_t> block;     // first complete copy
+    PreonAddrList unreachable;
+    PreonAddrList stale;            // peers which didn't have the block
+};
+
+void endgame_request(EndgameRace &race, ProgramState &state, PreonAddr addr,
+        std::string job_id, std::string file, int64_t block_id, size_t block_size) {
+    PeerScoreboard &scoreboard = state.get_scoreboard();
+
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<NetworkClient> client;
+    try {
+        client.reset(new NetworkClient(addr, &state));
+        scoreboard.record_connect(addr, seconds_since(start));
+    }
+    catch (PreonExcept &e) {
+        debug(e.what());
+        scoreboard.record_failure(addr);
+        race.lock.lock();
+        race.unreachable.push_back(addr);
+        race.lock.unlock();
+        return;
+    }
+
+    int fd = client->get_fd();
+    race.lock.lock();
+    bool started = !race.done;
+    if (started)
+        race.fds.insert(fd);
+    race.lock.unlock();
+
+    if (started) {
+        try {
+            start = std::chrono::steady_clock::now();
+            std::vector<uint8_t> block;
+            block.reserve(block_size);
+            bool found = client->get_block(job_id, file, block_id, block);
+
+            race.lock.lock();
+            if (!found)
+                race.stale.push_back(addr);
+            else if (!race.done) {
+                scoreboard.record_transfer(addr, block.size(), seconds_since(start));
+                race.done = true;
+                race.block.swap(block);
+
+                // cancel the others, their recv fails
+                for (int other: race.fds) {
+                    if (other != fd)
+                        shutdown(other, SHUT_RDWR);
+                }
+            }
+            race.lock.unlock();
+        }
+        catch (PreonExcept &e) {
+            debug(e.what());
+
+            // being cancelled is not the peer's fault
+            race.lock.lock();
+            if (!race.done)
+                scoreboard.record_failure(addr);
+            race.lock.unlock();
+        }
+    }
+
+    // before the fd is closed, so it is never shut down after being reused
+    race.lock.lock();
+    race.fds.erase(fd);
+    race.lock.unlock();
+}
+
+
+}
+
+
+JobWorker::JobWorker(const std::string &_job_id, ProgramState &_state) {
     job_id = _job_id;
 
-    config = state.get_config();
-    job = state.get_job(job_id);
+    state = &_state;
+    config = state->get_config();
+    job = state->get_job(job_id);
+    dht = state->get_dht();
+    scoreboard = &state->get_scoreboard();
+    next_gossip = 0;
+}
+
+// Returns false if the job can't make progress now, it is then parked at the
+// retry scheduler and work() is called again by a later worker, which picks
+// up where this one left off.
+bool JobWorker::run(JobStage &stage) {
+    switch (stage) {
+        case JobStage::fetch:
+            if (!fetch())
+                return false;
+            stage = JobStage::verify;
+            break;
+
+        // files which failed are reset, so fetching them again only gets those
+        case JobStage::verify:
+            if (!verify_files())
+                stage = JobStage::fetch;
+            else if (!job->is_master() && !job->get_execution_finished())
+                stage = JobStage::execute;
+            else
+                stage = JobStage::publish;
+            break;
+
+        case JobStage::execute:
+            execute_job();
+            stage = JobStage::publish;
+            break;
+
+        case JobStage::publish:
+            publish();
+            stage = JobStage::done;
+            break;
+
+        case JobStage::done:
+            throw PE("Job '" + job_id + "' is done already");
+    }
+
+    return true;
 }
 
-void JobWorker::work() {
+// Everything up to having the files: the inputs for a worker, the results
+// for a master
+bool JobWorker::fetch() {
     info("job worker starting for: " + job_id);
 
-    Tracker t(config->get_tracker_url(), config->get_tracker_port());
+    Tracker t(config->get_trackers(), dht);
 
     // 1) check if manifest exists
     std::string manifest_filename = job->get_job_dir() + "/" + PREON_MANIFEST_FILE;
@@ -34,7 +241,8 @@ void JobWorker::work() {
     int ret = lstat(manifest_filename.c_str(), &stat_buf);
     if (ret == -1 && errno == ENOENT) {
         std::string manifest;
-        download_manifest(manifest, t);
+        if (!download_manifest(manifest, t))
+            return false;
         write_file(manifest_filename, manifest);
     }
     else if (ret == -1)
@@ -42,89 +250,303 @@ void JobWorker::work() {
     job->read_manifest();
 
     // 1.25) if master, inform a idle worker that we have a job for it
-    if (job->is_master() && !job->get_execution_finished())
-        inform_idle_worker();
+    if (job->is_master() && !job->get_execution_finished() && !job->get_worker_informed()) {
+        if (!inform_idle_worker())
+            return false;
+    }
 
     // 1.5) make the master wait for the dynamic_file meta data
     if (job->is_master() && !job->get_execution_finished()) {
-        download_dynamic_files_metadata();
+        if (!download_dynamic_files_metadata())
+            return false;
     }
 
-    // 2) Download files and verify
-    do {
-        download_files();
-    } while (!verify_files());
+    // 1.75) a worker only fetches ahead of execution within the prefetch budget
+    if (!job->is_master() && !job->get_execution_finished()) {
+        std::vector<File> files;
+        job->get_files(files);
+
+        uint64_t bytes = 0;
+        for (const File &file: files) {
+            if (!file.dynamic)
+                bytes += file.size;
+        }
 
-    // 3) preform execution job (if we are a worker and we have not
-    // finished the computation)
-    if (!job->is_master() && !job->get_execution_finished())
-        execute_job();
+        if (!state->reserve_prefetch(job_id, bytes)) {
+            info("Prefetch budget is used up, '" + job_id + "' waits for a job to start executing");
+            return false;
+        }
+    }
 
-    // 4) done
+    // 2) Download files, they are verified in the next stage
+    return download_files();
+}
+
+void JobWorker::publish() {
     job->execution_finished();
+
+    // re-announce, which wakes up a master subscribed to this job
+    if (!job->is_master()) {
+        Tracker t(config->get_trackers(), dht);
+        t.inform_job(config->get_listen_port(), job_id);
+    }
+
     info("job worker finished: " + job_id);
 }
 
-void JobWorker::download_manifest(std::string &manifest, Tracker &t) {
+bool JobWorker::download_manifest(std::string &manifest, Tracker &t) {
     manifest.clear();
 
-    while (manifest.empty()) {
-        PreonAddrList list = t.query_job(job_id);
+    PreonAddrList list = t.query_job(job_id);
+    job->get_peers().add(list);
 
-        for (const PreonAddr &addr: list) {
-            try {
-                NetworkClient conn(addr, NULL);
-                if (conn.get_manifest(job_id, manifest))
-                    return; // successfully obtained a manifest file
-            }
-            catch (PreonExcept &e) {
-                debug(e.what());
-                continue;
+    for (const PreonAddr &addr: scoreboard->order(list)) {
+        try {
+            NetworkClient conn(addr, state);
+            if (conn.get_manifest(job_id, manifest))
+                return true; // successfully obtained a manifest file
+        }
+        catch (PreonExcept &e) {
+            debug(e.what());
+            continue;
+        }
+    }
+
+    // a peer joining the job wakes us up
+    return retry_later("Attempt to fetch manifest failed", subscribe(t, job_id));
+}
+
+// Rarest first: the blocks the fewest peers have are downloaded first, and
+// only from peers whose bitfield says they have it. The bitfields are kept
+// up to date by the HAVEs the peers push.
+bool JobWorker::download_file(const File &file) {
+    Tracker t(config->get_trackers(), dht);
+
+    int64_t n_blocks = size_to_nblks(file.size, job->get_block_size());
+    PeerBitfields bitfields;
+    HaveConnections haves;
+    time_t next_update = 0;
+    bool refreshed = false;
+    bool progress = false;
+
+    for (;;) {
+        if (next_update < time(nullptr)) {
+            update_bitfields(file, t, bitfields, haves);
+            next_update = time(nullptr) + BITFIELD_REFRESH_TIME;
+        }
+        recv_haves(file, bitfields, haves);
+
+        std::vector<int> availability(n_blocks, 0);
+        for (const auto &peer: bitfields) {
+            for (int64_t i = 0; i < n_blocks; i++)
+                availability[i] += peer.second[i] == '1';
+        }
+
+        int64_t block_id = job->claim_rarest_block(file.name, availability);
+        if (block_id == -1)
+            return true;  // all blocks downloaded
+
+        // the last few blocks are requested from several peers at once, so
+        // a single slow peer can't hold up the job
+        bool endgame = job->get_n_missing_blocks(file.name) <= ENDGAME_BLOCKS;
+        if (availability[block_id] > 0 && (endgame
+                    ? fetch_block_endgame(file, block_id, bitfields)
+                    : fetch_block(file, block_id, bitfields))) {
+            refreshed = false;
+            progress = true;
+            continue;
+        }
+        job->release_block(file.name, block_id);
+
+        // none of the peers we know has (or could give us) any of the
+        // missing blocks, ask again and otherwise the tracker
+        next_update = 0;
+        if (!refreshed) {
+            refresh_peers(t);
+            refreshed = true;
+            continue;
+        }
+
+        // only consecutive rounds without a single block back off further
+        if (progress)
+            state->get_retry_scheduler().reset(job_id);
+
+        return retry_later("Blocks of " + file.name + " not available",
+                subscribe(t, job_id));
+    }
+}
+
+// Requests the block from up to ENDGAME_PEERS holders at once, takes the
+// first complete copy and cancels the other requests
+bool JobWorker::fetch_block_endgame(const File &file, int64_t block_id, PeerBitfields &bitfields) {
+    PreonAddrList list = block_holders(bitfields, block_id, *scoreboard);
+    if (list.size() < 2)
+        return fetch_block(file, block_id, bitfields);
+    if (list.size() > ENDGAME_PEERS)
+        list.resize(ENDGAME_PEERS);
+
+    EndgameRace race;
+    std::vector<std::thread> threads;
+    for (const PreonAddr &addr: list)
+        threads.push_back(std::thread(endgame_request, std::ref(race), std::ref(*state),
+                    addr, job_id, file.name, block_id, job->get_block_size()));
+    for (std::thread &thread: threads)
+        thread.join();
+
+    for (const PreonAddr &addr: race.unreachable) {
+        job->get_peers().remove(addr);
+        bitfields.erase(addr);
+    }
+    for (const PreonAddr &addr: race.stale)
+        bitfields[addr][block_id] = '0';
+
+    if (!race.done)
+        return false;
+
+    job->write_block(file.name, block_id, race.block);
+    return true;
+}
+
+// Peers we already have an INTERESTED connection with keep their bitfield,
+// new peers are subscribed to before their bitfield is fetched so no block
+// is missed in between.
+void JobWorker::update_bitfields(const File &file, Tracker &t, PeerBitfields &bitfields,
+        HaveConnections &haves) {
+    size_t n_blocks = size_to_nblks(file.size, job->get_block_size());
+
+    // results only from the workers whose dynamic metadata we took
+    PreonAddrList result_peers;
+    if (file.dynamic)
+        result_peers = job->get_result_peers();
+
+    PeerBitfields old_bitfields;
+    old_bitfields.swap(bitfields);
+    for (const PreonAddr &addr: find_peers(t)) {
+        if (!result_peers.empty()
+                && std::find(result_peers.begin(), result_peers.end(), addr) == result_peers.end())
+            continue;
+
+        auto have = haves.find(addr);
+        auto old = old_bitfields.find(addr);
+        if (have != haves.end() && old != old_bitfields.end()) {
+            bitfields.insert(*old);
+            continue;
+        }
+
+        try {
+            auto start = std::chrono::steady_clock::now();
+            std::unique_ptr<NetworkClient> sub(new NetworkClient(addr, nullptr));
+            scoreboard->record_connect(addr, seconds_since(start));
+            if (!sub->subscribe_have(job_id))
+                continue;   // the peer doesn't know the job (yet)
+
+            NetworkClient client(addr, state);
+            std::string bitfield;
+            if (client.get_bitfield(job_id, file.name, bitfield) && bitfield.size() == n_blocks) {
+                bitfields[addr] = bitfield;
+                haves[addr] = std::move(sub);
             }
         }
+        catch (PreonExcept &e) {
+            debug(e.what());
+            scoreboard->record_failure(addr);
+            job->get_peers().remove(addr);
+            haves.erase(addr);
+        }
+    }
 
-        info("Attempt to fetch manifest for: '" + job_id + "' failed. Waiting "
-                + STR(RETRY_TIME / 1000000) + " seconds");
-        usleep(RETRY_TIME);
+    // peers which left the set
+    for (auto it = haves.begin(); it != haves.end();) {
+        if (bitfields.find(it->first) == bitfields.end())
+            it = haves.erase(it);
+        else
+            it++;
     }
 }
 
-void JobWorker::download_file(const File &file) {
-    Tracker t(config->get_tracker_url(), config->get_tracker_port());
-
-    int block_id;
-    while ((block_id = job->claim_empty_block(file.name)) != -1) {
-        for (;;) {
-            PreonAddrList list = t.query_job(job_id);
-            while (!list.empty()) {
-                size_t pos = rand() % list.size();
-                PreonAddr addr = list[pos];
-                list.erase(list.begin() + pos);
-
-                try {
-                    NetworkClient client(addr, nullptr);
-                    std::vector<uint8_t> block;
-                    block.reserve(PREON_BLOCK_SIZE);
-                    if (client.get_block(job_id, file.name, block_id, block)) {
-                        job->write_block(file.name, block_id, block);
-                        goto block_done;
-                    }
-                }
-                catch(PreonExcept &e) {
-                    debug(e.what());
-                }
+// Applies the HAVEs which arrived so far, doesn't wait for new ones
+void JobWorker::recv_haves(const File &file, PeerBitfields &bitfields, HaveConnections &haves) {
+    if (haves.empty())
+        return;
+
+    std::vector<struct pollfd> pfds;
+    std::vector<PreonAddr> addrs;
+    for (const auto &have: haves) {
+        pfds.push_back({have.second->get_fd(), POLLIN, 0});
+        addrs.push_back(have.first);
+    }
+
+    if (poll(pfds.data(), pfds.size(), 0) <= 0)
+        return;
+
+    for (size_t i = 0; i < pfds.size(); i++) {
+        if (pfds[i].revents == 0)
+            continue;
+
+        NetworkClient &client = *haves[addrs[i]];
+        auto bitfield = bitfields.find(addrs[i]);
+        try {
+            // a HAVE is sent as a single message, so a readable connection
+            // has at least one complete line
+            struct pollfd pfd = pfds[i];
+            do {
+                std::string name;
+                int64_t block_id;
+                if (!client.recv_have(name, block_id))
+                    throw PE("Peer closed INTERESTED connection");
+
+                if (name == file.name && bitfield != bitfields.end()
+                        && block_id >= 0 && (uint64_t)block_id < bitfield->second.size())
+                    bitfield->second[block_id] = '1';
+            } while (poll(&pfd, 1, 0) > 0);
+        }
+        catch (PreonExcept &e) {
+            debug(e.what());
+            haves.erase(addrs[i]);
+        }
+    }
+}
+
+// Tries the peers that have block_id, best scoring first
+bool JobWorker::fetch_block(const File &file, int64_t block_id, PeerBitfields &bitfields) {
+    for (const PreonAddr &addr: block_holders(bitfields, block_id, *scoreboard)) {
+        auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<NetworkClient> client;
+        try {
+            client.reset(new NetworkClient(addr, state));
+            scoreboard->record_connect(addr, seconds_since(start));
+        }
+        catch(PreonExcept &e) {
+            debug(e.what());
+            scoreboard->record_failure(addr);
+            job->get_peers().remove(addr);
+            bitfields.erase(addr);
+            continue;
+        }
+
+        try {
+            start = std::chrono::steady_clock::now();
+            std::vector<uint8_t> block;
+            block.reserve(job->get_block_size());
+            if (client->get_block(job_id, file.name, block_id, block)) {
+                scoreboard->record_transfer(addr, block.size(), seconds_since(start));
+                job->write_block(file.name, block_id, block);
+                return true;
             }
 
-            info("block: " + job_id + ":" + file.name + ":" + STR(block_id) +
-                    " not available. Retry in " + STR(RETRY_TIME / 1000000) + "s");
-            usleep(RETRY_TIME);
+            // its bitfield was out of date
+            bitfields[addr][block_id] = '0';
+        }
+        catch(PreonExcept &e) {
+            debug(e.what());
+            scoreboard->record_failure(addr);
         }
-block_done:
-        ;
     }
+
+    return false;
 }
 
-void JobWorker::download_files() {
+bool JobWorker::download_files() {
     std::vector<File> files;
     job->get_files(files);
     for (const File &file: files) {
@@ -134,9 +556,28 @@ void JobWorker::download_files() {
         if (job->is_fishined(file.name))
             continue;
 
-        download_file(file);
+        // an input another of our jobs has already is cloned
+        ContentStore &store = state->get_content_store();
+        std::string stored = file.dynamic ? "" : store.find(file);
+        if (!stored.empty()) {
+            try {
+                job->adopt_file(file.name, stored);
+                store.reference(file, job->get_job_dir());
+                store.count_hit(file);
+                info("Cloned '" + job->get_job_dir() + "/" + file.name + "' from the content store");
+                continue;
+            }
+            catch (PreonExcept &e) {
+                warn(e.what());
+            }
+        }
+
+        if (!download_file(file))
+            return false;
         info("Done downloading: '" + job->get_job_dir() + "/" + file.name + "'");
     }
+
+    return true;
 }
 
 bool JobWorker::verify_files() {
@@ -158,8 +599,11 @@ bool JobWorker::verify_files() {
         if (calc_hash(filename) != f.hash) {
             success = false;
             warn(filename + " failed to verify");
+            state->get_content_store().remove(f);
             job->reset_file(f.name);
         }
+        else if (!f.dynamic)
+            state->get_content_store().add(filename, f, dir);
     }
 
     if (success)
@@ -190,15 +634,34 @@ void JobWorker::execute_job() {
 
     char *argv[2] = { buf, NULL };
 
+    // the job runs on the cpus the execute stage placed it on
+    std::vector<int> cpus, nodes;
+    state->get_placement(job_id, cpus, nodes);
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (int cpu: cpus)
+        CPU_SET(cpu, &cpu_set);
+
+    // built before forking, the child only execs
+    std::vector<std::string> env;
+    job_environment(cpus, nodes, env);
+    std::vector<char *> envp;
+    for (std::string &var: env)
+        envp.push_back(&var[0]);
+    envp.push_back(nullptr);
+
     pid_t pid = fork();
     if (pid == -1)
         throw PE_SYS("fork");
 
     if (pid == 0) {
+        // not pinned is no reason to fail the job
+        if (!cpus.empty())
+            sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
         if (chdir(working_dir.c_str()) == -1)
             throw PE_SYS("chdir");
-        if (execv(pathname, argv) == -1)
-            throw PE_SYS("execv");
+        if (execve(pathname, argv, envp.data()) == -1)
+            throw PE_SYS("execve");
     }
     else {
         int status;
@@ -207,51 +670,208 @@ void JobWorker::execute_job() {
     }
 }
 
-void JobWorker::download_dynamic_files_metadata() {
-    Tracker t(config->get_tracker_url(), config->get_tracker_port());
+bool JobWorker::download_dynamic_files_metadata() {
+    Tracker t(config->get_trackers(), dht);
 
-    for (;;) {
-        PreonAddrList addr_list = t.query_job(job_id);
-        for (const PreonAddr &addr: addr_list) {
-            try {
-                NetworkClient conn(addr, nullptr);
+    // subscribe before querying, so a worker finishing in between is not missed
+    std::unique_ptr<TrackerSubscription> sub = subscribe(t, job_id);
 
-                std::vector<File> dynamic_files;
-                if (conn.get_dynamic_metadata(job_id, dynamic_files)) {
-                    job->update_dynamic_metadata(dynamic_files);
-                    return;
-                }
-            }
-            catch (PreonExcept &e) {
-                debug(STR("while downloading meta data: ") + e.what());
+    PreonAddrList addr_list = t.query_job(job_id);
+    job->get_peers().add(addr_list);
+
+    // with a duplicate out, the first results win; the other worker's only
+    // count if they are the same
+    std::vector<File> results;
+    PreonAddrList result_peers;
+    for (const PreonAddr &addr: addr_list) {
+        try {
+            NetworkClient conn(addr, state);
+
+            std::vector<File> dynamic_files;
+            if (!conn.get_dynamic_metadata(job_id, dynamic_files))
+                continue;
+
+            if (result_peers.empty())
+                results = dynamic_files;
+            else if (!same_files(results, dynamic_files))
+                continue;
+            result_peers.push_back(addr);
+        }
+        catch (PreonExcept &e) {
+            debug(STR("while downloading meta data: ") + e.what());
+        }
+    }
+
+    if (!result_peers.empty()) {
+        job->update_dynamic_metadata(results);
+        job->set_result_peers(result_peers);
+        state->get_straggler_detector().finished(job_id);
+        return true;
+    }
+
+    return retry_later("Dynamic meta data not available", std::move(sub));
+}
+
+bool JobWorker::inform_idle_worker() {
+    Tracker tracker(config->get_trackers(), dht);
+
+    // subscribe before querying, so a worker becoming idle in between is not missed
+    std::unique_ptr<TrackerSubscription> sub = subscribe(tracker, "idle");
+
+    PreonAddrList addr_list = order_by_locality(tracker.query_job("idle"));
+    for (const PreonAddr &addr: addr_list) {
+        // a peer may have stolen it in the meantime
+        if (!job->mark_worker_informed())
+            return true;
+
+        // this job first, filled up with the others still waiting for a
+        // worker, so one round trip can dispatch all the peer has room for
+        std::vector<JobOffer> offered = {{job_id, job->get_priority(), job->get_resources()}};
+        std::vector<JobOffer> others;
+        Resources any = {std::numeric_limits<unsigned>::max(),
+                std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max()};
+        state->hand_out_jobs(JOB_BATCH_MAX - 1, any, addr, others);
+        offered.insert(offered.end(), others.begin(), others.end());
+
+        std::vector<std::string> accepted;
+        try {
+            NetworkClient client(addr, nullptr);
+            client.inform_jobs(offered, config->get_listen_port(), accepted);
+        }
+        catch (PreonExcept &e) {
+            debug(e.what());
+        }
+
+        bool informed = false;
+        for (const JobOffer &job_offered: offered) {
+            Job *j = state->get_job(job_offered.job_id);
+            if (std::find(accepted.begin(), accepted.end(), job_offered.job_id) == accepted.end()) {
+                j->clear_worker_informed();
+                continue;
             }
+
+            state->get_straggler_detector().dispatched(job_offered.job_id, j->get_exec_cmd(), addr);
+            if (j == job)
+                informed = true;
+            else    // its parked job worker can go on waiting for the results
+                state->get_retry_scheduler().wake(job_offered.job_id);
         }
 
-        info("Dynamic meta data not available, trying again in " + STR(RETRY_TIME / 1000000) + "s");
-        usleep(RETRY_TIME);
+        if (informed) {
+            if (!state->has_jobs_to_hand_out())
+                tracker.remove_job(config->get_listen_port(), QUEUED_KEY);
+            return true;
+        }
     }
+
+    // the idle subscription wakes us for the push, while peers with free
+    // workers pull the job from us (STEAL_JOBS) as soon as they see this
+    tracker.inform_job(config->get_listen_port(), QUEUED_KEY);
+    return retry_later("No worker available", std::move(sub));
 }
 
-void JobWorker::inform_idle_worker() {
-    Tracker tracker(config->get_tracker_url(), config->get_tracker_port());
+// Idle peers whose cache summary has most of the job's input bytes come
+// first, they needn't download those. Only the first LOCALITY_PROBE_MAX are
+// asked, the rest keep their order after them.
+PreonAddrList JobWorker::order_by_locality(const PreonAddrList &addrs) {
+    std::vector<File> files;
+    job->get_files(files);
 
-    for (;;) {
-        PreonAddrList addr_list = tracker.query_job("idle");
+    std::vector<std::pair<uint64_t, PreonAddr>> probed;
+    for (size_t i = 0; i < addrs.size() && i < LOCALITY_PROBE_MAX; i++) {
+        const PreonAddr &addr = addrs[i];
 
-        for (const PreonAddr &addr: addr_list) {
+        BloomFilter filter;
+        if (!state->get_cache_summaries().get(addr, filter)) {
             try {
                 NetworkClient client(addr, nullptr);
-
-                if (client.inform_job(job_id))
-                    return;
+                if (!client.get_cache_summary(filter))
+                    continue;
             }
             catch (PreonExcept &e) {
                 debug(e.what());
+                continue;
             }
+            state->get_cache_summaries().set(addr, filter);
         }
 
-        info("No worker available, retry in " + STR(RETRY_TIME / 1000000) + "s");
-        usleep(RETRY_TIME);
+        uint64_t cached = 0;
+        for (const File &file: files) {
+            if (!file.dynamic && filter.contains(file.hash))
+                cached += file.size;
+        }
+        probed.push_back({cached, addr});
+    }
+
+    std::stable_sort(probed.begin(), probed.end(), [](const std::pair<uint64_t, PreonAddr> &a,
+                const std::pair<uint64_t, PreonAddr> &b) {
+        return a.first > b.first;
+    });
+
+    PreonAddrList ordered;
+    for (const auto &p: probed)
+        ordered.push_back(p.second);
+    for (const PreonAddr &addr: addrs) {
+        if (std::find(ordered.begin(), ordered.end(), addr) == ordered.end())
+            ordered.push_back(addr);
     }
+
+    if (!probed.empty() && probed.front().first > 0)
+        debug("Idle peer " + ordered.front().ip_addr + ":" + STR(ordered.front().port)
+                + " has " + STR(probed.front().first) + " bytes of '" + job_id + "' cached");
+
+    return ordered;
 }
 
+// Parks the job at the retry scheduler, sub (if any) wakes it up early.
+// Always returns false, so callers can return its result.
+bool JobWorker::retry_later(const std::string &reason,
+        std::unique_ptr<TrackerSubscription> sub) {
+    double backoff = state->defer_job(job_id, std::move(sub));
+
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1) << backoff;
+    info(reason + " for '" + job_id + "', retrying in at most " + ss.str() + "s");
+
+    return false;
+}
+
+
+// Peers to download from. The tracker is only asked when we don't know any
+// peer; after that the set grows by peer exchange every PEX_INTERVAL seconds.
+PreonAddrList JobWorker::find_peers(Tracker &t) {
+    PeerSet &peers = job->get_peers();
+    if (peers.empty())
+        refresh_peers(t);
+    else if (next_gossip < time(nullptr))
+        gossip_peers();
+
+    return peers.get();
+}
+
+void JobWorker::refresh_peers(Tracker &t) {
+    job->get_peers().add(t.query_job(job_id));
+    gossip_peers();
+}
+
+// Asks a random known peer which peers it knows for this job
+void JobWorker::gossip_peers() {
+    next_gossip = time(nullptr) + PEX_INTERVAL;
+
+    PreonAddrList list = job->get_peers().get();
+    if (list.empty())
+        return;
+
+    PreonAddr addr = list[rand() % list.size()];
+    try {
+        NetworkClient client(addr, nullptr);
+
+        PreonAddrList learned;
+        if (client.get_peers(job_id, config->get_listen_port(), learned))
+            job->get_peers().add(learned);
+    }
+    catch (PreonExcept &e) {
+        debug(STR("peer exchange failed: ") + e.what());
+        job->get_peers().remove(addr);
+    }
+}
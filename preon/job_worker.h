@@ -1,29 +1,58 @@
 #ifndef __job_worker_h__
 #define __job_worker_h__
 
+#include "network_client.h"
 #include "program_state.h"
 #include "tracker.h"
 
+#include <ctime>
+#include <map>
+#include <memory>
 #include <string>
 
+// per peer which blocks of a file it has, see Status::file_get_bitfield()
+typedef std::map<PreonAddr, std::string> PeerBitfields;
+
+// INTERESTED connections on which peers push their new blocks (HAVE)
+typedef std::map<PreonAddr, std::unique_ptr<NetworkClient>> HaveConnections;
+
 class JobWorker {
     public:
-        JobWorker(const std::string &_job_id, const ProgramState &state);
+        JobWorker(const std::string &_job_id, ProgramState &state);
 
-        void work();
+        // Runs one stage of the job and sets stage to the next one. Returns
+        // false if the job was parked instead; it comes back at fetch.
+        bool run(JobStage &stage);
 
     private:
-        void download_manifest(std::string &manifest, Tracker &t);
-        void download_file(const File &file);
-        void download_files();
+        bool fetch();
+        void publish();
+        bool download_manifest(std::string &manifest, Tracker &t);
+        bool download_file(const File &file);
+        void update_bitfields(const File &file, Tracker &t, PeerBitfields &bitfields,
+                HaveConnections &haves);
+        void recv_haves(const File &file, PeerBitfields &bitfields, HaveConnections &haves);
+        bool fetch_block(const File &file, int64_t block_id, PeerBitfields &bitfields);
+        bool fetch_block_endgame(const File &file, int64_t block_id, PeerBitfields &bitfields);
+        bool download_files();
         bool verify_files();
         void execute_job();
-        void download_dynamic_files_metadata();
-        void inform_idle_worker();
+        bool download_dynamic_files_metadata();
+        bool inform_idle_worker();
+        PreonAddrList order_by_locality(const PreonAddrList &addrs);
+        bool retry_later(const std::string &reason, std::unique_ptr<TrackerSubscription> sub);
+
+        PreonAddrList find_peers(Tracker &t);
+        void refresh_peers(Tracker &t);
+        void gossip_peers();
 
         std::string job_id;
+        ProgramState *state;
         Config *config;
         Job *job;
+        Dht *dht;
+        PeerScoreboard *scoreboard;
+        time_t next_gossip;
 };
 
 #endif //ifndef __job_worker_h__
@@ -1,4 +1,6 @@
 #include "job_worker.h"
+#include "job_stealer.h"
+#include "job_monitor.h"
 #include "job.h"
 #include "program_state.h"
 #include "network_listener.h"
@@ -9,15 +11,19 @@
 #include "utils.h"
 #include "preon_types.h"
 #include "tracker.h"
+#include "dht.h"
 #include "parse_args.h"
 
 #include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <iostream>
 #include <string>
 #include <cstring>
 #include <cstdlib>
 #include <vector>
+#include <memory>
 #include <thread>
 #include <sstream>
 #include <fcntl.h>
@@ -33,15 +39,20 @@ namespace {
 
 void except_create_job(const std::string &tmp_dir, Config &config,
         const std::vector<std::string> &static_files,
-        const std::string &exec_cmd, const std::vector<std::string> &dynamic_files) {
+        const std::string &exec_cmd, const std::vector<std::string> &dynamic_files,
+        size_t block_size, int priority, const Resources &resources) {
     create_dir(tmp_dir, true);
 
     std::string manifest_file = tmp_dir + "/" + PREON_MANIFEST_FILE;
     Manifest manifest(manifest_file);
+    manifest.set_block_size(block_size);
+    manifest.set_priority(priority);
+    manifest.set_resources(resources);
 
     std::string status_file = tmp_dir + "/" + PREON_STATUS_FILE;
     Status status(status_file);
     status.set_master(true);
+    status.set_block_size(block_size);
 
     for (const std::string &file: static_files) {
         char buf[PATH_MAX + 1];
@@ -94,10 +105,12 @@ void except_create_job(const std::string &tmp_dir, Config &config,
 }
 
 void create_job(Config &config, const std::vector<std::string> &static_files,
-        const std::string &exec_cmd, const std::vector<std::string> &dynamic_files) {
+        const std::string &exec_cmd, const std::vector<std::string> &dynamic_files,
+        size_t block_size, int priority, const Resources &resources) {
     std::string tmp_dir = config.get_download_folder() + "/" + random_string(10);
     try {
-        except_create_job(tmp_dir, config, static_files, exec_cmd, dynamic_files);
+        except_create_job(tmp_dir, config, static_files, exec_cmd, dynamic_files,
+                block_size, priority, resources);
     }
     catch (PreonExcept &e) {
         error(STR("Failed to create job: ") + e.what());
@@ -141,11 +154,16 @@ void scan_jobs(std::set<std::string> &job_ids, const std::string &job_root) {
     closedir(dir);
 }
 
-void create_lock() {
+// one per listen port, so several peers can run on a host
+std::string lock_file;
+
+void create_lock(unsigned short port) {
+    lock_file = PREON_LOCK_PREFIX + STR(port) + ".lock";
+
     mode_t mode = S_IRWXU | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-    int fd = open(PREON_LOCK_FILE.c_str(),  O_CREAT | O_EXCL, mode);
+    int fd = open(lock_file.c_str(),  O_CREAT | O_EXCL, mode);
     if (fd == -1 && errno == EEXIST) {
-        info("Preon already running. (If this is not the case remove '" + PREON_LOCK_FILE + "'");
+        info("Preon already running. (If this is not the case remove '" + lock_file + "'");
         exit(EXIT_SUCCESS);
     }
     else if (fd == -1) {
@@ -155,7 +173,7 @@ void create_lock() {
 }
 
 void remove_lock() {
-    remove(PREON_LOCK_FILE.c_str());
+    remove(lock_file.c_str());
 }
 
 void sig_handler(int signo) {
@@ -163,66 +181,167 @@ void sig_handler(int signo) {
     exit(EXIT_SUCCESS);
 }
 
+// The network threads run on the reserved cpu, out of the way of the jobs.
+// Threads inherit it from the one creating them.
+void pin_to_reserved_cpu(ProgramState &state) {
+    int cpu = state.get_reserved_cpu();
+    if (cpu == -1)
+        return;
+
+    try {
+        set_thread_cpus({cpu});
+    }
+    catch (PreonExcept &e) {
+        warn(STR("Failed to pin to the reserved cpu: ") + e.what());
+    }
+}
+
 void conn_worker_thread(ProgramState &state, int fd) {
     NetworkClient client(fd, &state);
 
-    // handle incoming connections
-    client.wait();
+    // handle incoming connections, a peer going away mid request is no
+    // reason to stop serving the others
+    try {
+        client.wait();
+    }
+    catch (PreonExcept &e) {
+        debug(STR("connection closed: ") + e.what());
+    }
 }
 
-void worker_thread(ProgramState &state) {
+// A worker of the pool of one stage. The fetch workers are where jobs enter
+// the pipeline, so they report idle and start the stealer.
+void worker_thread(ProgramState &state, JobStage stage, JobStealer *stealer) {
+    Config *config = state.get_config();
+    Tracker t(config->get_trackers(), state.get_dht());
+
     // random delay to prevent a lot of workers
     // from starting at the same time
-    usleep(RANDOM_DELAY * ((double)rand() / RAND_MAX));
-
-    Config *config = state.get_config();
-    Tracker t(config->get_tracker_url(), config->get_tracker_port());
+    if (stage == JobStage::fetch) {
+        pin_to_reserved_cpu(state);
+        usleep(RANDOM_DELAY * ((double)rand() / RAND_MAX));
+    }
 
     time_t next_idle_report = 0;
     for (;;) {
-        std::string job_id = state.claim_unfinished_job_id();
+        // sleeps until a job is queued, waking up only to report idle again
+        int timeout = IDLE_REPORT_TIME;
+        if (stage == JobStage::fetch)
+            timeout = std::max(0, (int)(next_idle_report - time(nullptr)));
+
+        std::string job_id = state.claim_job_id(stage, timeout);
         if (job_id == "idle") {
-            if (next_idle_report < time(nullptr)) {
+            if (stage == JobStage::fetch && state.get_n_free_workers() > 0) {
                 t.inform_job(config->get_listen_port(), "idle"); // TODO this will cause a lot of messages to the tracker. Better save the next_idle in program state
                 next_idle_report = time(nullptr) + IDLE_REPORT_TIME;
             }
-            usleep(WORKER_THREAD_TIMEOUT);
+            continue;
         }
-        else {
-            if (state.get_n_idle_workers() == 0)
-                t.remove_job(config->get_listen_port(), "idle");
-            JobWorker jw(job_id, state);
-            jw.work();
-            state.mark_finished_job_id(job_id);
+
+        if (stage == JobStage::fetch && state.get_n_free_workers() == 0)
+            t.remove_job(config->get_listen_port(), "idle");
+
+        // a job which can't make progress was parked by the worker
+        JobWorker jw(job_id, state);
+        JobStage next = stage;
+        bool parked = !jw.run(next);
+        if (!parked && next != JobStage::done) {
+            state.advance_job_id(job_id, next);
+            continue;
         }
+        if (!parked)
+            state.mark_finished_job_id(job_id);
+
+        // the job left the pipeline, pull work right away instead of
+        // waiting to be pushed some
+        if (stealer != nullptr && state.get_n_free_workers() > 0)
+            stealer->wake();
     }
 }
 
+void fs_watch_add_job(ProgramState &state, Tracker &tracker, const std::string &job_id) {
+    Config *config = state.get_config();
+    if (!state.add_job(config->get_download_folder(), job_id))
+        return;
+
+    info("fs_watch: new job: '" + job_id + "'");
+    tracker.inform_job(config->get_listen_port(), job_id);
+}
+
+int fs_watch_init(const std::string &download_folder) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1) {
+        warn(STR("inotify_init1(): ") + strerror(errno));
+        return -1;
+    }
+
+    // jobs appear by mkdir (INFORM_JOB) or rename (preon -c)
+    if (inotify_add_watch(fd, download_folder.c_str(), IN_CREATE | IN_MOVED_TO | IN_ONLYDIR) == -1) {
+        warn(STR("inotify_add_watch(): ") + strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Picks up job directories added to the download folder as inotify reports
+// them. The full scan is only a fallback, for events lost when the queue
+// overflowed, or every FS_POLL_INTERVAL if inotify isn't available. Also
+// collects the content store's files of removed jobs.
 void fs_watch_thread(ProgramState &state) {
     Config *config = state.get_config();
-    Tracker tracker(config->get_tracker_url(), config->get_tracker_port());
+    Tracker tracker(config->get_trackers(), state.get_dht());
 
     std::string download_folder = config->get_download_folder();
-    for (;;) {
-        std::set<std::string> job_ids_fs;
-        scan_jobs(job_ids_fs, download_folder);
+    int fd = fs_watch_init(download_folder);    // before the first scan
 
-        std::set<std::string> job_ids;
-        state.get_job_ids(job_ids);
+    time_t next_scan = 0;
+    time_t next_gc = 0;
+    for (;;) {
+        if (next_scan <= time(nullptr)) {
+            std::set<std::string> job_ids_fs;
+            scan_jobs(job_ids_fs, download_folder);
+            for (const std::string &job_id: job_ids_fs)
+                fs_watch_add_job(state, tracker, job_id);
 
-        std::set<std::string> job_ids_new;
-        std::set_difference(job_ids_fs.begin(), job_ids_fs.end(),
-                job_ids.begin(), job_ids.end(),
-                std::inserter(job_ids_new, job_ids_new.begin()));
+            next_scan = time(nullptr) + (fd == -1 ? FS_POLL_INTERVAL : FS_SCAN_INTERVAL);
+        }
 
-        for (const std::string &job_id: job_ids_new) {
-            info("fs_watch: new job: '" + job_id + "'");
+        if (next_gc <= time(nullptr)) {
+            state.get_content_store().collect_garbage();
+            next_gc = time(nullptr) + CONTENT_STORE_GC_INTERVAL;
+        }
 
-            state.add_job(download_folder, job_id);
-            tracker.inform_job(config->get_listen_port(), job_id);
+        int timeout = std::max(0, (int)(next_scan - time(nullptr))) * 1000;
+        if (fd == -1) {
+            usleep(timeout * 1000);
+            continue;
         }
 
-        usleep(FS_WATCH_TIMEOUT);
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ret = poll(&pfd, 1, timeout);
+        if (ret == -1 && errno != EINTR)
+            throw PE_SYS("poll");
+        else if (ret <= 0)
+            continue;
+
+        alignas(struct inotify_event) char buf[4096];
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len == -1 && errno != EINTR)
+            throw PE_SYS("read");
+
+        for (ssize_t i = 0; i < len;) {
+            const struct inotify_event *event = (const struct inotify_event *)(buf + i);
+            i += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                warn("fs_watch: inotify queue overflowed, rescanning");
+                next_scan = 0;
+            }
+            else if ((event->mask & IN_ISDIR) && event->len > 0 && is_job_hash(event->name))
+                fs_watch_add_job(state, tracker, event->name);
+        }
     }
 }
 
@@ -240,7 +359,9 @@ int main(int argc, char *argv[]) {
     Args args;
     parse_args(argc, argv, args);
     if (args.create_job)
-        create_job(config, args.static_files, args.exec_cmd, args.dynamic_files);
+        create_job(config, args.static_files, args.exec_cmd, args.dynamic_files,
+                args.block_size_set ? args.block_size : PREON_BLOCK_SIZE,
+                args.priority_set ? args.priority : DEFAULT_PRIORITY, args.resources);
     else if (args.work_job)
         work_job(config, args.job_id);
 
@@ -249,32 +370,54 @@ int main(int argc, char *argv[]) {
 
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
-    create_lock();
+    create_lock(config.get_listen_port());
     atexit(remove_lock);
 
     ProgramState state;
     state.set_config(&config);
+    for (const RateLimit &limit: config.get_rate_limits())
+        state.get_rate_limiter().set_limit(limit.scope, limit.dir, limit.rate);
+    state.get_content_store().init(config.get_download_folder() + "/" + PREON_CONTENT_STORE);
+
+    // the dht joins the network in a background thread, so requests of the
+    // bootstrap nodes (which may include ourselves) reach the listener below
+    std::unique_ptr<Dht> dht;
+    if (config.get_dht()) {
+        dht = std::make_unique<Dht>(config.get_listen_port());
+        state.set_dht(dht.get());
+        dht->start(config.get_dht_bootstrap());
+    }
 
-    Tracker tracker(config.get_tracker_url(), config.get_tracker_port());
+    Tracker tracker(config.get_trackers(), dht.get());
 
     // Scan filesystem for all jobs and make datastructure to track job/download progress
     std::set<std::string> job_ids;
     scan_jobs(job_ids, config.get_download_folder());
-    for (const std::string &job_id: job_ids) {
+    for (const std::string &job_id: job_ids)
         state.add_job(config.get_download_folder(), job_id);
-        tracker.inform_job(config.get_listen_port(), job_id);
-    }
+    tracker.inform_jobs(config.get_listen_port(),
+            std::vector<std::string>(job_ids.begin(), job_ids.end()));
 
-    // start the worker threads
-    unsigned n_workers = config.get_n_workers();
+    std::unique_ptr<JobStealer> stealer;
+    if (config.get_steal_jobs())
+        stealer = std::make_unique<JobStealer>(state);
+
+    // heartbeats to our masters, duplicates of our jobs which straggle
+    JobMonitor monitor(state);
+
+    // start the worker pools, a pool per stage
     std::vector<std::thread> threads;
-    for (unsigned i = 0; i < n_workers; i++)
-        threads.push_back(std::thread(worker_thread, std::ref(state)));
+    for (size_t i = 0; i < N_JOB_STAGES; i++) {
+        JobStage stage = (JobStage)i;
+        for (unsigned j = 0; j < config.get_n_stage_workers(stage); j++)
+            threads.push_back(std::thread(worker_thread, std::ref(state), stage, stealer.get()));
+    }
 
     // start a fs watcher to detect new jobs being added locally
     threads.push_back(std::thread(fs_watch_thread, std::ref(state)));
 
-    // network listener
+    // network listener, the connection threads inherit the reserved cpu
+    pin_to_reserved_cpu(state);
     NetworkListener listener(config.get_listen_port());
     for (;;) {
         int fd = listener.wait();
@@ -12,10 +12,15 @@ enum class State {
     exec,
     dynamic,
     deps,
+    block_size,
+    priority,
+    resources,
 };
 
 Manifest::Manifest(const std::string &filename) :
-    m_filename(filename) {}
+    m_filename(filename),
+    m_block_size(PREON_BLOCK_SIZE),
+    m_priority(DEFAULT_PRIORITY) {}
 
 std::string Manifest::get_text() {
     return m_text;
@@ -42,6 +47,41 @@ void Manifest::get_files(std::vector<File> &files) {
         files.push_back(pair.second);
 }
 
+size_t Manifest::get_block_size() {
+    return m_block_size;
+}
+
+void Manifest::set_block_size(size_t block_size) {
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE)
+        throw PE("Block size must be between " + STR(MIN_BLOCK_SIZE) +
+                " and " + STR(MAX_BLOCK_SIZE) + " bytes");
+
+    m_block_size = block_size;
+}
+
+int Manifest::get_priority() {
+    return m_priority;
+}
+
+void Manifest::set_priority(int priority) {
+    if (priority < MIN_PRIORITY || priority > MAX_PRIORITY)
+        throw PE("Priority must be between " + STR(MIN_PRIORITY) +
+                " and " + STR(MAX_PRIORITY));
+
+    m_priority = priority;
+}
+
+Resources Manifest::get_resources() {
+    return m_resources;
+}
+
+void Manifest::set_resources(const Resources &resources) {
+    if (resources.cores == 0)
+        throw PE("A job needs at least 1 core");
+
+    m_resources = resources;
+}
+
 std::string Manifest::get_exec_cmd() {
     return m_exec_cmd;
 }
@@ -77,6 +117,12 @@ void Manifest::read() {
                 state = State::dynamic;
             else if (line == "[deps]")
                 state = State::deps;
+            else if (line == "[block_size]")
+                state = State::block_size;
+            else if (line == "[priority]")
+                state = State::priority;
+            else if (line == "[resources]")
+                state = State::resources;
             else
                 throw PE("Invalid header line in " + PREON_MANIFEST_FILE +
                         " [line " + STR(nline) + "]");
@@ -94,7 +140,7 @@ void Manifest::read() {
             file.hash = strings[strings.size() - 1];
 
             try {
-                file.size = std::stol(strings[strings.size() - 2]);
+                file.size = std::stoull(strings[strings.size() - 2]);
             }
             catch (...) {
                 throw PE("Invalid size in " + PREON_MANIFEST_FILE +
@@ -123,6 +169,58 @@ void Manifest::read() {
         else if (state == State::deps) {
             warn("Dependencies not supported");
         }
+        else if (state == State::block_size) {
+            size_t block_size;
+            try {
+                block_size = std::stoull(line);
+            }
+            catch (...) {
+                throw PE("Invalid block size in " + PREON_MANIFEST_FILE +
+                        " [line " + STR(nline) + "]");
+            }
+
+            set_block_size(block_size);
+        }
+        else if (state == State::priority) {
+            int priority;
+            try {
+                priority = std::stoi(line);
+            }
+            catch (...) {
+                throw PE("Invalid priority in " + PREON_MANIFEST_FILE +
+                        " [line " + STR(nline) + "]");
+            }
+
+            set_priority(priority);
+        }
+        else if (state == State::resources) {
+            std::vector<std::string> strings;
+            split(line, strings, ' ');
+
+            uint64_t value;
+            try {
+                if (strings.size() != 2)
+                    throw PE("");
+                value = std::stoull(strings[1]);
+            }
+            catch (...) {
+                throw PE("Invalid resource line in " + PREON_MANIFEST_FILE +
+                        " [line " + STR(nline) + "]");
+            }
+
+            Resources resources = m_resources;
+            if (strings[0] == "cores")
+                resources.cores = (unsigned)value;
+            else if (strings[0] == "memory")
+                resources.memory = value;
+            else if (strings[0] == "scratch")
+                resources.scratch = value;
+            else
+                throw PE("Unknown resource '" + strings[0] + "' in " + PREON_MANIFEST_FILE +
+                        " [line " + STR(nline) + "]");
+
+            set_resources(resources);
+        }
         else {  // Impies state == State::none
             throw PE("Invalid line in " + PREON_MANIFEST_FILE +
                     " [line " + STR(nline) + "]");
@@ -149,6 +247,28 @@ void Manifest::write() {
         << INDENT  << m_exec_cmd << std::endl
         << std::endl;
 
+    if (m_block_size != PREON_BLOCK_SIZE) {
+        out << "[block_size]" << std::endl
+            << INDENT << m_block_size << std::endl
+            << std::endl;
+    }
+
+    if (m_priority != DEFAULT_PRIORITY) {
+        out << "[priority]" << std::endl
+            << INDENT << m_priority << std::endl
+            << std::endl;
+    }
+
+    if (m_resources != Resources()) {
+        out << "[resources]" << std::endl
+            << INDENT << "cores " << m_resources.cores << std::endl;
+        if (m_resources.memory != 0)
+            out << INDENT << "memory " << m_resources.memory << std::endl;
+        if (m_resources.scratch != 0)
+            out << INDENT << "scratch " << m_resources.scratch << std::endl;
+        out << std::endl;
+    }
+
     out << "[dynamic]\n";
     for (auto &file : m_files) {
         if (file.second.dynamic)
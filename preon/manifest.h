@@ -17,6 +17,19 @@ class Manifest {
         void add_file(const File &filename);
         void get_files(std::vector<File> &files);
 
+        // Defaults to PREON_BLOCK_SIZE, in which case it isn't written so
+        // the job ids of existing manifests don't change
+        size_t get_block_size();
+        void set_block_size(size_t block_size);
+
+        // Higher runs first, DEFAULT_PRIORITY isn't written either
+        int get_priority();
+        void set_priority(int priority);
+
+        // What executing the job takes, the defaults aren't written
+        Resources get_resources();
+        void set_resources(const Resources &resources);
+
         std::string get_exec_cmd();
         void set_exec_cmd(const std::string &exec_cmd);
 
@@ -29,6 +42,9 @@ class Manifest {
         std::string                 m_text;
         std::map<std::string, File> m_files;
         std::string                 m_exec_cmd;
+        size_t                      m_block_size;
+        int                         m_priority;
+        Resources                   m_resources;
 };
 
 #endif //#ifndef __manifest_h__
@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <iostream>
 #include <cerrno>
+#include <limits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -12,15 +14,31 @@
 #include <sstream>
 #include <vector>
 #include <sys/stat.h>
+#include <arpa/inet.h>
 
 #include "network_client.h"
 #include "sha256.h"
 #include "error.h"
 #include "utils.h"
 #include "tracker.h"
+#include "consts.h"
 
 namespace {
 
+std::string addr_to_ip(const struct sockaddr_storage &addr) {
+    char ip_addr[INET6_ADDRSTRLEN];
+    const void *src;
+    if (addr.ss_family == AF_INET)
+        src = &((const struct sockaddr_in *)&addr)->sin_addr;
+    else
+        src = &((const struct sockaddr_in6 *)&addr)->sin6_addr;
+
+    if (inet_ntop(addr.ss_family, src, ip_addr, sizeof(ip_addr)) == nullptr)
+        throw PE_SYS("inet_ntop");
+
+    return ip_addr;
+}
+
 std::string block_to_str(const std::vector<uint8_t> &block) {
     std::string str;
 
@@ -34,6 +52,51 @@ std::string block_to_str(const std::vector<uint8_t> &block) {
     return str;
 }
 
+// Size line in front of a block, 64 bit as blocks can be large
+uint64_t parse_size(const std::string &response) {
+    if (response.empty() || response[0] < '0' || response[0] > '9')
+        throw PE("Invalid response size");
+
+    try {
+        return std::stoull(response);
+    }
+    catch (...) {
+        throw PE("Invalid response size");
+    }
+}
+
+bool is_loopback(const std::string &ip) {
+    return ip.compare(0, 4, "127.") == 0 || ip == "::1" || ip.compare(0, 11, "::ffff:127.") == 0;
+}
+
+// "job_id priority cores memory scratch" in INFORM_JOB(S) and STEAL_JOBS,
+// older peers only send the job id and priority, or just the job id
+std::string offer_to_str(const JobOffer &offer) {
+    std::stringstream ss;
+    ss << offer.job_id << " " << offer.priority << " " << offer.resources.cores
+       << " " << offer.resources.memory << " " << offer.resources.scratch;
+    return ss.str();
+}
+
+bool parse_offer(std::stringstream &ss, JobOffer &offer) {
+    offer.priority = DEFAULT_PRIORITY;
+    offer.resources = Resources();
+
+    if (!(ss >> offer.job_id) || !is_job_hash(offer.job_id))
+        return false;
+
+    int priority;
+    if (ss >> priority)
+        offer.priority = std::max(MIN_PRIORITY, std::min(priority, MAX_PRIORITY));
+
+    unsigned cores;
+    uint64_t memory, scratch;
+    if (ss >> cores >> memory >> scratch)
+        offer.resources = {std::max(1u, cores), memory, scratch};
+
+    return true;
+}
+
 std::vector<uint8_t> str_to_block(const std::string &str) {
     std::vector<uint8_t> block;
 
@@ -106,7 +169,7 @@ bool NetworkClient::has_job(const std::string &job_id) {
 }
 
 bool NetworkClient::get_block(const std::string &job_id, const std::string &file,
-        int block_id, std::vector<uint8_t> &block) {
+        int64_t block_id, std::vector<uint8_t> &block) {
     std::stringstream ss;
     ss << "GET_BLOCK " << job_id << " " << file << " " << block_id << "\n";
     send_msg(ss.str());
@@ -116,10 +179,29 @@ bool NetworkClient::get_block(const std::string &job_id, const std::string &file
     if (response == "FALSE\n")
         return false;
 
-    size_t block_size = std::stoi(response);
+    size_t block_size = parse_size(response);
     block.clear();
-    recv_block(block, block_size);
+    recv_block(block, block_size, job_id);
+
+    return true;
+}
+
+bool NetworkClient::get_bitfield(const std::string &job_id, const std::string &file,
+        std::string &bitfield) {
+    std::stringstream ss;
+    ss << "GET_BITFIELD " << job_id << " " << file << "\n";
+    send_msg(ss.str());
+
+    std::string response;
+    recv_msg(response);
+    if (response == "FALSE\n")
+        return false;
 
+    size_t block_size = parse_size(response);
+    std::vector<uint8_t> block;
+    recv_block(block, block_size, job_id);
+
+    bitfield.assign(block.begin(), block.end());
     return true;
 }
 
@@ -134,9 +216,9 @@ bool NetworkClient::get_manifest(const std::string &job_id, std::string &manifes
     if (response == "FALSE\n")
         return false;
 
-    size_t block_size = std::stoi(response);
+    size_t block_size = parse_size(response);
     std::vector<uint8_t> block;
-    recv_block(block, block_size);
+    recv_block(block, block_size, job_id);
 
     // verify the response
     SHA256_CTX ctx;
@@ -164,9 +246,9 @@ bool NetworkClient::get_dynamic_metadata(const std::string &job_id,
     if (response == "FALSE\n")
         return false;
 
-    size_t block_size = std::stoi(response);
+    size_t block_size = parse_size(response);
     std::vector<uint8_t> block;
-    recv_block(block, block_size);
+    recv_block(block, block_size, job_id);
 
     std::stringstream block_ss(block_to_str(block));
     dynamic_metadata.clear();
@@ -186,16 +268,186 @@ bool NetworkClient::get_dynamic_metadata(const std::string &job_id,
     return true;
 }
 
-bool NetworkClient::inform_job(const std::string &job_id) {
+bool NetworkClient::get_cache_summary(BloomFilter &filter) {
+    send_msg("GET_CACHE_SUMMARY\n");
+
+    std::string response;
+    recv_msg(response);
+    if (response == "FALSE\n")
+        return false;
+
+    size_t block_size = parse_size(response);
+    // a filter of another size puts the keys at other bits
+    if (block_size != (BLOOM_FILTER_BITS + 7) / 8)
+        throw PE("Invalid cache summary size");
+
+    std::vector<uint8_t> block;
+    recv_block(block, block_size, "");
+    filter.set_bits(block);
+
+    return true;
+}
+
+bool NetworkClient::inform_job(const JobOffer &offer) {
+    send_msg("INFORM_JOB " + offer_to_str(offer) + "\n");
+
+    std::string response;
+    recv_msg(response);
+    return response == "TRUE\n";
+}
+
+bool NetworkClient::inform_jobs(const std::vector<JobOffer> &offered, unsigned short port,
+        std::vector<std::string> &accepted) {
+    std::stringstream jobs_ss;
+    for (const JobOffer &offer: offered)
+        jobs_ss << offer_to_str(offer) << "\n";
+    std::vector<uint8_t> block = str_to_block(jobs_ss.str());
+
+    send_msg("INFORM_JOBS " + std::to_string(block.size()) + " " + STR(port) + "\n");
+    send_block(block, "");
+
+    std::string response;
+    recv_msg(response);
+    if (response == "FALSE\n")
+        return false;
+
+    size_t block_size = parse_size(response);
+    recv_block(block, block_size, "");
+
+    std::stringstream block_ss(block_to_str(block));
+    accepted.clear();
+    std::string job_id;
+    while (block_ss >> job_id)
+        accepted.push_back(job_id);
+
+    return !accepted.empty();
+}
+
+bool NetworkClient::steal_jobs(const Resources &room, unsigned short port,
+        std::vector<JobOffer> &jobs) {
     std::stringstream ss;
-    ss << "INFORM_JOB " << job_id << "\n";
+    ss << "STEAL_JOBS " << room.cores << " " << port << " " << room.memory
+       << " " << room.scratch << "\n";
     send_msg(ss.str());
 
+    std::string response;
+    recv_msg(response);
+    if (response == "FALSE\n")
+        return false;
+
+    size_t block_size = parse_size(response);
+    std::vector<uint8_t> block;
+    recv_block(block, block_size, "");
+
+    std::stringstream block_ss(block_to_str(block));
+    jobs.clear();
+    std::string line;
+    while (std::getline(block_ss, line, '\n')) {
+        if (line == "")
+            continue;
+
+        std::stringstream line_ss(line);
+        JobOffer offer;
+        if (!parse_offer(line_ss, offer))
+            throw PE("Invalid job in STEAL_JOBS response");
+
+        jobs.push_back(offer);
+    }
+
+    return true;
+}
+
+bool NetworkClient::heartbeat(unsigned short port,
+        const std::vector<std::pair<std::string, std::string>> &jobs) {
+    std::stringstream jobs_ss;
+    for (const auto &job: jobs)
+        jobs_ss << job.first << " " << job.second << "\n";
+    std::vector<uint8_t> block = str_to_block(jobs_ss.str());
+
+    send_msg("HEARTBEAT " + STR(port) + " " + std::to_string(block.size()) + "\n");
+    send_block(block, "");
+
     std::string response;
     recv_msg(response);
     return response == "TRUE\n";
 }
 
+bool NetworkClient::get_peers(const std::string &job_id, unsigned short port,
+        PreonAddrList &peers) {
+    std::stringstream ss;
+    ss << "GET_PEERS " << job_id << " " << port << "\n";
+    send_msg(ss.str());
+
+    std::string response;
+    recv_msg(response);
+    if (response == "FALSE\n")
+        return false;
+
+    size_t block_size = parse_size(response);
+    std::vector<uint8_t> block;
+    recv_block(block, block_size, job_id);
+
+    std::stringstream block_ss(block_to_str(block));
+    peers.clear();
+    std::string line;
+    while (std::getline(block_ss, line, '\n')) {
+        if (line == "")
+            continue;
+
+        std::stringstream line_ss(line);
+        std::string ip_addr;
+        unsigned short peer_port;
+        if (!(line_ss >> ip_addr >> peer_port))
+            throw PE("Invalid peer in GET_PEERS response");
+
+        peers.push_back({ip_addr, peer_port});
+    }
+
+    return true;
+}
+
+bool NetworkClient::subscribe_have(const std::string &job_id) {
+    std::stringstream ss;
+    ss << "INTERESTED " << job_id << "\n";
+    send_msg(ss.str());
+
+    std::string response;
+    recv_msg(response);
+    return response == "TRUE\n";
+}
+
+// Blocks until a HAVE arrives, false if the peer closed the connection
+bool NetworkClient::recv_have(std::string &file, int64_t &block_id) {
+    std::string line;
+    if (!recv_msg(line))
+        return false;
+
+    std::stringstream ss(line);
+    std::string type, job_id;
+    if (!(ss >> type >> job_id >> file >> block_id) || type != "HAVE")
+        throw PE("Invalid HAVE message: " + line);
+
+    return true;
+}
+
+bool NetworkClient::request(const std::string &msg, std::string &payload) {
+    send_msg(msg);
+
+    std::string response;
+    if (!recv_msg(response))
+        throw PE("Connection closed before response");
+    if (response == "FALSE\n")
+        return false;
+
+    size_t block_size = parse_size(response);
+
+    std::vector<uint8_t> block;
+    recv_block(block, block_size, "");
+    payload.assign(block.begin(), block.end());
+
+    return true;
+}
+
 void NetworkClient::wait() {
     for (;;) {
         std::string header;
@@ -230,15 +482,15 @@ void NetworkClient::wait() {
             send_msg(std::to_string(manifest.size()) + "\n");
 
             std::vector<uint8_t> buf(manifest.begin(), manifest.end());
-            send_block(buf);
+            send_block(buf, job_id);
         }
         else if (type == "GET_BLOCK") {
             std::string job_id, file;
-            int block_id;
+            int64_t block_id = -1;
             ss >> job_id >> file >> block_id;
 
             Job *job = m_state->get_job(job_id);
-            if (job == nullptr) {
+            if (job == nullptr || block_id < 0) {
                 send_msg("FALSE\n");
                 continue;
             }
@@ -250,7 +502,48 @@ void NetworkClient::wait() {
             }
 
             send_msg(std::to_string(block.size()) + "\n");
-            send_block(block);
+            send_block(block, job_id);
+        }
+        else if (type == "GET_BITFIELD") {
+            std::string job_id, file;
+            ss >> job_id >> file;
+
+            Job *job = m_state->get_job(job_id);
+            std::string bitfield;
+            if (job == nullptr || !job->get_bitfield(file, bitfield)) {
+                send_msg("FALSE\n");
+                continue;
+            }
+
+            send_msg(std::to_string(bitfield.size()) + "\n");
+            send_block(str_to_block(bitfield), job_id);
+        }
+        else if (type == "INTERESTED") {
+            std::string job_id;
+            ss >> job_id;
+
+            Job *job = m_state->get_job(job_id);
+            if (job == nullptr) {
+                send_msg("FALSE\n");
+                continue;
+            }
+
+            send_msg("TRUE\n");
+            job->add_have_listener(m_fd);
+
+            // from now on only HAVEs are sent over this connection, wait
+            // for the peer to hang up
+            try {
+                std::string ignored;
+                while (recv_msg(ignored))
+                    ;
+            }
+            catch (PreonExcept &e) {
+                debug(e.what());
+            }
+
+            job->remove_have_listener(m_fd);
+            break;
         }
         else if (type == "GET_DYNAMIC_METADATA") {
             std::string job_id;
@@ -281,47 +574,248 @@ void NetworkClient::wait() {
             std::vector<uint8_t> block = str_to_block(ss.str());
 
             send_msg(std::to_string(block.size()) + "\n");
-            send_block(block);
+            send_block(block, job_id);
         }
-        else if (type == "INFORM_JOB") {
+        else if (type == "GET_PEERS") {
             std::string job_id;
-            ss >> job_id;
+            unsigned short port;
+            ss >> job_id >> port;
 
-            if (!is_job_hash(job_id)) {
+            Job *job = m_state->get_job(job_id);
+            if (job == nullptr) {
                 send_msg("FALSE\n");
                 continue;
             }
 
+            // the requester is part of the swarm as well, and may have what
+            // a parked download of this job waits for
+            PreonAddr requester = {get_remote_ip(), port};
+            PreonAddrList peers = job->get_peers().get();
+            if (job->get_peers().add(requester))
+                m_state->get_retry_scheduler().wake(job_id);
+
+            std::random_shuffle(peers.begin(), peers.end());
+
+            std::stringstream peers_ss;
+            size_t n_peers = 0;
+            for (const PreonAddr &peer: peers) {
+                if (peer == requester)
+                    continue;
+                if (n_peers++ == PEX_MAX_PEERS)
+                    break;
+
+                peers_ss << peer.ip_addr << " " << peer.port << "\n";
+            }
+
+            std::vector<uint8_t> block = str_to_block(peers_ss.str());
+
+            send_msg(std::to_string(block.size()) + "\n");
+            send_block(block, job_id);
+        }
+        else if (type == "INFORM_JOB") {
+            JobOffer offer;
+            if (!parse_offer(ss, offer)) {
+                send_msg("FALSE\n");
+                continue;
+            }
+            const std::string &job_id = offer.job_id;
+
             if (m_state->get_job(job_id)) {
                 send_msg("FALSE\n");
                 continue;
             }
 
-            if (m_state->get_n_idle_workers() == 0) {
+            // only if it fits
+            if (!m_state->accept_job(offer)) {
                 send_msg("FALSE\n");
                 continue;
             }
 
             Config *config = m_state->get_config();
-            std::string download_dir = config->get_download_folder();
-            std::string job_dir = download_dir + "/" + job_id;
+            Tracker tracker(config->get_trackers(), m_state->get_dht());
+            tracker.inform_job(config->get_listen_port(), job_id);
+
+            info("accepted new job: " + job_id);
 
-            if (mkdir(job_dir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1) {
-                if (errno != EEXIST)
-                    warn(STR("mkdir(): ") + strerror(errno));
+            send_msg("TRUE\n");
+        }
+        else if (type == "INFORM_JOBS") {
+            // a block of job offer lines follows, older masters leave out
+            // the port they listen on
+            size_t size = 0;
+            unsigned short master_port = 0;
+            ss >> size >> master_port;
+            if (size == 0 || size > JOB_BATCH_MAX * INFORM_JOB_MAX_BYTES) {
                 send_msg("FALSE\n");
                 continue;
             }
 
-            m_state->add_job(download_dir, job_id);
+            std::vector<uint8_t> block;
+            recv_block(block, size, "");
+
+            std::vector<JobOffer> offered;
+            std::stringstream block_ss(block_to_str(block));
+            std::string line;
+            while (std::getline(block_ss, line, '\n')) {
+                std::stringstream line_ss(line);
+                JobOffer offer;
+                if (!parse_offer(line_ss, offer) || m_state->get_job(offer.job_id))
+                    continue;
 
-            Tracker tracker(config->get_tracker_url(), config->get_tracker_port());
-            tracker.inform_job(config->get_listen_port(), job_id);
+                offered.push_back(offer);
+            }
 
-            info("accepted new job: " + job_id);
+            std::vector<std::string> accepted;
+            m_state->accept_jobs(offered, accepted);
+            if (accepted.empty()) {
+                send_msg("FALSE\n");
+                continue;
+            }
+
+            // they are ours now, the workers announce them again when done
+            if (master_port != 0) {
+                for (const std::string &job_id: accepted)
+                    m_state->get_job(job_id)->set_master_addr({get_remote_ip(), master_port});
+            }
+
+            Config *config = m_state->get_config();
+            try {
+                Tracker tracker(config->get_trackers(), m_state->get_dht());
+                tracker.inform_jobs(config->get_listen_port(), accepted);
+            }
+            catch (PreonExcept &e) {
+                warn(STR("Announcing accepted jobs failed: ") + e.what());
+            }
+
+            std::stringstream accepted_ss;
+            for (const std::string &job_id: accepted)
+                accepted_ss << job_id << "\n";
+            info("accepted " + STR(accepted.size()) + " of " + STR(offered.size()) + " new jobs");
+
+            block = str_to_block(accepted_ss.str());
+            send_msg(std::to_string(block.size()) + "\n");
+            send_block(block, "");
+        }
+        else if (type == "STEAL_JOBS") {
+            // "STEAL_JOBS cores port memory scratch", older peers leave out
+            // the memory and scratch they have room for
+            Resources room = {0, std::numeric_limits<uint64_t>::max(),
+                    std::numeric_limits<uint64_t>::max()};
+            unsigned short port = 0;
+            ss >> room.cores >> port;
+
+            uint64_t memory, scratch;
+            if (ss >> memory >> scratch) {
+                room.memory = memory;
+                room.scratch = scratch;
+            }
+
+            // our own stealer finds us under QUEUED_KEY as well
+            Config *config = m_state->get_config();
+            std::string remote_ip = get_remote_ip();
+            if (room.cores == 0 || (port == config->get_listen_port() && remote_ip == get_local_ip())) {
+                send_msg("FALSE\n");
+                continue;
+            }
+
+            PreonAddr thief = {remote_ip, port};
+            std::vector<JobOffer> jobs;
+            m_state->hand_out_jobs(room.cores, room, thief, jobs);
+
+            std::stringstream jobs_ss;
+            for (const JobOffer &job: jobs) {
+                jobs_ss << offer_to_str(job) << "\n";
+                m_state->get_straggler_detector().dispatched(job.job_id,
+                        m_state->get_job(job.job_id)->get_exec_cmd(), thief);
+
+                // its parked job worker can go on waiting for the results
+                m_state->get_retry_scheduler().wake(job.job_id);
+                info("job '" + job.job_id + "' stolen by " + remote_ip + ":" + STR(port));
+            }
+
+            if (!m_state->has_jobs_to_hand_out()) {
+                Tracker tracker(config->get_trackers(), m_state->get_dht());
+                tracker.remove_job(config->get_listen_port(), QUEUED_KEY);
+            }
+
+            std::vector<uint8_t> block = str_to_block(jobs_ss.str());
+
+            send_msg(std::to_string(block.size()) + "\n");
+            send_block(block, "");
+        }
+        else if (type == "HEARTBEAT") {
+            // a block of "job_id stage" lines follows
+            unsigned short port = 0;
+            size_t size = 0;
+            ss >> port >> size;
+            if (port == 0 || size == 0 || size > MAX_HEARTBEAT_SIZE) {
+                send_msg("FALSE\n");
+                continue;
+            }
+
+            std::vector<uint8_t> block;
+            recv_block(block, size, "");
+
+            PreonAddr worker = {get_remote_ip(), port};
+            std::stringstream block_ss(block_to_str(block));
+            std::string job_id, stage;
+            while (block_ss >> job_id >> stage)
+                m_state->get_straggler_detector().heartbeat(job_id, worker, stage);
 
             send_msg("TRUE\n");
         }
+        else if (type == "SET_RATE_LIMIT") {
+            // only from this host, e.g.
+            //     printf 'SET_RATE_LIMIT global upload 1000000\n' | nc localhost 42069
+            std::string scope_str, dir_str, rate_str;
+            ss >> scope_str >> dir_str >> rate_str;
+
+            RateScope scope;
+            RateDir dir;
+            unsigned rate;
+            try {
+                rate = str_to_unsigned(rate_str);
+            }
+            catch (PreonExcept &e) {
+                send_msg("FALSE\n");
+                continue;
+            }
+
+            if (!is_loopback(get_remote_ip()) || !parse_rate_scope(scope_str, scope)
+                    || !parse_rate_dir(dir_str, dir)) {
+                send_msg("FALSE\n");
+                continue;
+            }
+
+            m_state->get_rate_limiter().set_limit(scope, dir, rate);
+            info("rate limit " + scope_str + " " + dir_str + " set to " + rate_str + " B/s");
+
+            send_msg("TRUE\n");
+        }
+        else if (type == "GET_CACHE_SUMMARY") {
+            BloomFilter filter;
+            m_state->get_content_store().get_summary(filter);
+
+            send_msg(std::to_string(filter.get_bits().size()) + "\n");
+            send_block(filter.get_bits(), "");
+        }
+        else if (type == "STATS") {
+            std::vector<uint8_t> block = str_to_block(m_state->get_rate_limiter().report()
+                    + m_state->get_queue_report() + m_state->get_straggler_detector().report()
+                    + m_state->get_content_store().report());
+
+            send_msg(std::to_string(block.size()) + "\n");
+            send_block(block, "");
+        }
+        else if (type.compare(0, 4, "DHT_") == 0) {
+            Dht *dht = m_state->get_dht();
+            if (dht == nullptr) {
+                send_msg("FALSE\n");
+                continue;
+            }
+
+            send_msg(dht->handle_msg(header, get_remote_ip(), get_local_ip()));
+        }
     }
 }
 
@@ -333,16 +827,21 @@ void NetworkClient::send_msg(const std::string &msg) {
         throw PE("Failed to send complete message");
 }
 
-void NetworkClient::send_block(const std::vector<uint8_t> &block) {
+void NetworkClient::send_block(const std::vector<uint8_t> &block, const std::string &job_id) {
     size_t bytes_send = 0;
     while (bytes_send != block.size()) {
-        ssize_t res = send(m_fd, block.data() + bytes_send, block.size() - bytes_send, 0);
-        if (res == -1)
-            throw PE_SYS("send");
-        else if (res == 0)
-            throw PE("Stream ended unexpected");
+        size_t chunk_end = bytes_send + std::min(RATE_LIMIT_CHUNK, block.size() - bytes_send);
+        throttle(RateDir::upload, job_id, chunk_end - bytes_send);
 
-        bytes_send += res;
+        while (bytes_send != chunk_end) {
+            ssize_t res = send(m_fd, block.data() + bytes_send, chunk_end - bytes_send, 0);
+            if (res == -1)
+                throw PE_SYS("send");
+            else if (res == 0)
+                throw PE("Stream ended unexpected");
+
+            bytes_send += res;
+        }
     }
 }
 
@@ -366,17 +865,53 @@ bool NetworkClient::recv_msg(std::string &response) {
     return true;
 }
 
-void NetworkClient::recv_block(std::vector<uint8_t> &block, size_t size) {
+std::string NetworkClient::get_remote_ip() {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(m_fd, (struct sockaddr *)&addr, &addr_len) == -1)
+        throw PE_SYS("getpeername");
+
+    return addr_to_ip(addr);
+}
+
+std::string NetworkClient::get_local_ip() {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(m_fd, (struct sockaddr *)&addr, &addr_len) == -1)
+        throw PE_SYS("getsockname");
+
+    return addr_to_ip(addr);
+}
+
+// Receives straight into the block; it only grows per chunk actually
+// received, so a peer announcing a huge size can't make us allocate it
+void NetworkClient::recv_block(std::vector<uint8_t> &block, size_t size, const std::string &job_id) {
     block.clear();
 
-    while (block.size() != size) {
-        char buf[1024];
-        ssize_t ret = recv(m_fd, &buf, std::min(sizeof(buf), size - block.size()), 0);
-        if (ret == -1)
-            throw PE_SYS("recv");
-        else if (ret == 0)
-            throw PE("Network stream ended unexpected");
+    size_t bytes_recv = 0;
+    while (bytes_recv != size) {
+        size_t chunk_end = bytes_recv + std::min(RATE_LIMIT_CHUNK, size - bytes_recv);
+        throttle(RateDir::download, job_id, chunk_end - bytes_recv);
 
-        block.insert(block.end(), buf, buf + ret);
+        block.resize(chunk_end);
+        while (bytes_recv != chunk_end) {
+            ssize_t ret = recv(m_fd, block.data() + bytes_recv, chunk_end - bytes_recv, 0);
+            if (ret == -1)
+                throw PE_SYS("recv");
+            else if (ret == 0)
+                throw PE("Network stream ended unexpected");
+
+            bytes_recv += ret;
+        }
     }
 }
+
+void NetworkClient::throttle(RateDir dir, const std::string &job_id, size_t bytes) {
+    if (m_state == nullptr)
+        return;
+
+    if (m_remote_ip.empty())
+        m_remote_ip = get_remote_ip();
+
+    m_state->get_rate_limiter().throttle(dir, m_remote_ip, job_id, bytes);
+}
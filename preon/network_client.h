@@ -3,9 +3,13 @@
 
 #include <string>
 #include <cstdint>
+#include <utility>
+#include <vector>
 
+#include "cache_summary.h"
 #include "preon_types.h"
 #include "program_state.h"
+#include "rate_limiter.h"
 
 class NetworkClient {
     public:
@@ -18,22 +22,58 @@ class NetworkClient {
 
         bool has_job(const std::string &job_id);
         bool get_block(const std::string &job_id, const std::string &file,
-                int block_id, std::vector<uint8_t> &block);
+                int64_t block_id, std::vector<uint8_t> &block);
+        bool get_bitfield(const std::string &job_id, const std::string &file,
+                std::string &bitfield);
         bool get_manifest(const std::string &job_id, std::string &manifest);
         bool get_dynamic_metadata(const std::string &job_id,
                 std::vector<File> &dynamic_metadata);
-        bool inform_job(const std::string &job_id);
+        bool inform_job(const JobOffer &offer);
+        // Offers a batch of jobs; the peer accepts the ones which fit and
+        // returns those. We listen on port, for the heartbeats.
+        bool inform_jobs(const std::vector<JobOffer> &offered, unsigned short port,
+                std::vector<std::string> &accepted);
+        // Asks a master for jobs which still need a worker and fit in room
+        // (room.cores being the free workers), we listen on port. The jobs
+        // are handed to us, accept them.
+        bool steal_jobs(const Resources &room, unsigned short port,
+                std::vector<JobOffer> &jobs);
+        bool get_peers(const std::string &job_id, unsigned short port,
+                PreonAddrList &peers);
+        // The content hashes of the files the peer has
+        bool get_cache_summary(BloomFilter &filter);
+        // Tells a master the stage of each (job id, stage) of its jobs we
+        // work on, we listen on port
+        bool heartbeat(unsigned short port,
+                const std::vector<std::pair<std::string, std::string>> &jobs);
+
+        // Turns this connection into one on which the peer pushes a HAVE
+        // for every block of the job it finishes, read them with recv_have()
+        bool subscribe_have(const std::string &job_id);
+        bool recv_have(std::string &file, int64_t &block_id);
+        int get_fd() const {return m_fd;}
+
+        // Sends a raw request which is answered with a size prefixed block
+        // (or FALSE), used for the DHT_* messages
+        bool request(const std::string &msg, std::string &payload);
 
         void wait();
 
     private:
         int m_fd;
         ProgramState *m_state;
+        std::string m_remote_ip;    // cached by throttle()
 
         void send_msg(const std::string &msg);
-        void send_block(const std::vector<uint8_t> &block);
+        void send_block(const std::vector<uint8_t> &block, const std::string &job_id);
         bool recv_msg(std::string &response);
-        void recv_block(std::vector<uint8_t> &block, size_t size);
+        void recv_block(std::vector<uint8_t> &block, size_t size, const std::string &job_id);
+
+        // rate limits block traffic, only if we have a state
+        void throttle(RateDir dir, const std::string &job_id, size_t bytes);
+
+        std::string get_remote_ip();
+        std::string get_local_ip();
 };
 
 #endif //#ifndef __network_client_h__
@@ -24,6 +24,13 @@ NetworkListener::NetworkListener(unsigned short port) {
     if (m_fd == -1)
         throw PE_SYS("socket");
 
+    // a restarted peer can bind while its old connections are in TIME_WAIT
+    int one = 1;
+    if (setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+        close(m_fd);
+        throw PE_SYS("setsockopt");
+    }
+
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
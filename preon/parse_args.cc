@@ -23,6 +23,9 @@ enum State {
     JOB_ID_SET,
 
     N_WORKERS,
+    BLOCK_SIZE,
+    PRIORITY,
+    RESOURCES,
 };
 
 void print_help(const char *argv0) {
@@ -34,11 +37,17 @@ void print_help(const char *argv0) {
         << "  -d, --dynamic         Specify dynamic files"  << std::endl
         << "  -j, --job             Add existing job"       << std::endl
         << "  -n, --n_workers_set   Set number of workers"  << std::endl
+        << "  -b, --block_size      Set block size of a new job in bytes" << std::endl
+        << "  -p, --priority        Set priority of a new job (higher runs first)" << std::endl
+        << "  -r, --resources       Set cores[,memory[,scratch]] a new job needs, in bytes" << std::endl
         << std::endl
         << "Examples:"                                  << std::endl
         << " " << argv0 << " -c file0 ... file_n"       << std::endl
         << " " << argv0 << " -c file0 ... file_n -e file_i -d dfile0 ... dfile_n"
         << std::endl
+        << " " << argv0 << " -b 4194304 -c file0 ... file_n"  << std::endl
+        << " " << argv0 << " -p 5 -c file0 ... file_n -e file_i" << std::endl
+        << " " << argv0 << " -r 8,4294967296 -c file0 ... file_n -e file_i" << std::endl
         << " " << argv0 << " -j job_id"                 << std::endl;
 
 }
@@ -52,6 +61,27 @@ bool argcmp(const char *src, const char *a, const char *b) {
     return std::string(src) == a || std::string(src) == b;
 }
 
+// cores[,memory[,scratch]]
+bool parse_resources(const std::string &arg, Resources &resources) {
+    std::vector<std::string> fields;
+    split(arg, fields, ',');
+    if (fields.empty() || fields.size() > 3)
+        return false;
+
+    try {
+        resources.cores = str_to_unsigned(fields[0]);
+        if (fields.size() > 1)
+            resources.memory = std::stoull(fields[1]);
+        if (fields.size() > 2)
+            resources.scratch = std::stoull(fields[2]);
+    }
+    catch (...) {
+        return false;
+    }
+
+    return resources.cores > 0;
+}
+
 }
 
 void parse_args(int argc, char *argv[], Args &args) {
@@ -64,6 +94,12 @@ void parse_args(int argc, char *argv[], Args &args) {
     args.job_id = "";
     args.n_workers_set = false;
     args.n_workers_set = 0;
+    args.block_size_set = false;
+    args.block_size = 0;
+    args.priority_set = false;
+    args.priority = 0;
+    args.resources_set = false;
+    args.resources = Resources();
 
     State state = NONE;
     for (int i = 1; i < argc; i++) {
@@ -90,6 +126,15 @@ void parse_args(int argc, char *argv[], Args &args) {
         else if (argcmp(argv[i], "-n", "--n_workers") && state == NONE && !args.n_workers_set) {
             state = N_WORKERS;
         }
+        else if (argcmp(argv[i], "-b", "--block_size") && state == NONE && !args.block_size_set) {
+            state = BLOCK_SIZE;
+        }
+        else if (argcmp(argv[i], "-p", "--priority") && state == NONE && !args.priority_set) {
+            state = PRIORITY;
+        }
+        else if (argcmp(argv[i], "-r", "--resources") && state == NONE && !args.resources_set) {
+            state = RESOURCES;
+        }
         else if (!is_opt && (state == STATIC_FILES || state == STATIC_FILES_SET)) {
             args.static_files.push_back(argv[i]);
             state = STATIC_FILES_SET;
@@ -111,6 +156,27 @@ void parse_args(int argc, char *argv[], Args &args) {
             args.n_workers = str_to_unsigned(argv[i]);
             state = NONE;
         }
+        else if (!is_opt && state == BLOCK_SIZE) {
+            args.block_size_set = true;
+            args.block_size = str_to_unsigned(argv[i]);
+            state = NONE;
+        }
+        else if (!is_opt && state == RESOURCES) {
+            if (!parse_resources(argv[i], args.resources))
+                print_help_and_exit(argv[0]);
+            args.resources_set = true;
+            state = NONE;
+        }
+        else if (state == PRIORITY) {  // may be negative, so looks like an option
+            try {
+                args.priority = std::stoi(argv[i]);
+            }
+            catch (...) {
+                print_help_and_exit(argv[0]);
+            }
+            args.priority_set = true;
+            state = NONE;
+        }
         else {
             print_help_and_exit(argv[0]);
         }
@@ -124,6 +190,10 @@ void parse_args(int argc, char *argv[], Args &args) {
         print_help_and_exit(argv[0]);
     }
 
+    // the block size, priority and resources are part of a new job's manifest
+    if ((args.block_size_set || args.priority_set || args.resources_set) && !args.create_job)
+        print_help_and_exit(argv[0]);
+
     if (args.work_job) {
         // require that job_id is valid
         if (!is_job_hash(args.job_id))
@@ -1,6 +1,8 @@
 #ifndef __parse_args_h__
 #define __parse_args_h__
 
+#include "preon_types.h"
+
 #include <string>
 #include <vector>
 
@@ -15,6 +17,15 @@ struct Args {
 
     bool n_workers_set;
     unsigned n_workers;
+
+    bool block_size_set;
+    size_t block_size;
+
+    bool priority_set;
+    int priority;
+
+    bool resources_set;
+    Resources resources;
 };
 
 void parse_args(int argc, char *argv[], Args &args);
@@ -0,0 +1,131 @@
+#include "consts.h"
+#include "peer_scoreboard.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+void ewma(double &avg, double sample) {
+    avg = SCORE_EWMA_ALPHA * sample + (1.0 - SCORE_EWMA_ALPHA) * avg;
+}
+
+}
+
+void PeerScoreboard::record_connect(const PreonAddr &addr, double seconds) {
+    m_lock.lock();
+
+    PeerScore &score = unsafe_get(addr);
+    ewma(score.connect_latency, seconds);
+
+    m_lock.unlock();
+}
+
+void PeerScoreboard::record_transfer(const PreonAddr &addr, size_t bytes, double seconds) {
+    m_lock.lock();
+
+    PeerScore &score = unsafe_get(addr);
+    ewma(score.failure_rate, 0.0);
+
+    // the time of small transfers (the last block of a file) is mostly
+    // latency, they say little about throughput. Jobs can use blocks as
+    // small as MIN_BLOCK_SIZE, so that's the bar.
+    if (bytes >= MIN_BLOCK_SIZE) {
+        double throughput = bytes / std::max(seconds, 1e-6);
+        if (score.throughput <= 0.0)
+            score.throughput = throughput;
+        else
+            ewma(score.throughput, throughput);
+    }
+
+    m_lock.unlock();
+}
+
+void PeerScoreboard::record_failure(const PreonAddr &addr) {
+    m_lock.lock();
+    ewma(unsafe_get(addr).failure_rate, 1.0);
+    m_lock.unlock();
+}
+
+// Weighted sampling without replacement. With probability SCORE_EXPLORE a
+// peer is picked uniformly instead, and peers we never downloaded from get
+// the weight of the best peer, so they are tried early.
+PreonAddrList PeerScoreboard::order(const PreonAddrList &peers) {
+    std::vector<double> weights;
+
+    m_lock.lock();
+
+    double best = 0.0;
+    for (const auto &s: m_scores)
+        best = std::max(best, unsafe_weight(s.second, 0.0));
+    if (best <= 0.0)
+        best = 1.0;
+
+    for (const PreonAddr &addr: peers) {
+        auto it = m_scores.find(addr);
+        if (it == m_scores.end())
+            weights.push_back(best);
+        else
+            weights.push_back(unsafe_weight(it->second, best));
+    }
+
+    m_lock.unlock();
+
+    PreonAddrList remaining = peers;
+    PreonAddrList result;
+    while (!remaining.empty()) {
+        double total = 0.0;
+        for (double w: weights)
+            total += w;
+
+        size_t pick = rand() % remaining.size();
+        if (total > 0.0 && (double)rand() / RAND_MAX >= SCORE_EXPLORE) {
+            double r = total * ((double)rand() / RAND_MAX);
+            for (pick = 0; pick < remaining.size() - 1; pick++) {
+                r -= weights[pick];
+                if (r <= 0.0)
+                    break;
+            }
+        }
+
+        result.push_back(remaining[pick]);
+        remaining.erase(remaining.begin() + pick);
+        weights.erase(weights.begin() + pick);
+    }
+
+    return result;
+}
+
+bool PeerScoreboard::get_score(const PreonAddr &addr, PeerScore &score) {
+    bool found = false;
+
+    m_lock.lock();
+    auto it = m_scores.find(addr);
+    if (it != m_scores.end()) {
+        score = it->second;
+        found = true;
+    }
+    m_lock.unlock();
+
+    return found;
+}
+
+PeerScore &PeerScoreboard::unsafe_get(const PreonAddr &addr) {
+    auto it = m_scores.find(addr);
+    if (it == m_scores.end())
+        it = m_scores.insert({addr, {0.0, 0.0, 0.0}}).first;
+
+    return it->second;
+}
+
+// Expected blocks per second the peer delivers, optimistic if we never
+// downloaded from it
+double PeerScoreboard::unsafe_weight(const PeerScore &score, double optimistic) {
+    double success = 1.0 - score.failure_rate;
+    if (score.throughput <= 0.0)
+        return optimistic * success;
+
+    double block_time = score.connect_latency + PREON_BLOCK_SIZE / score.throughput;
+    return success / block_time;
+}
@@ -0,0 +1,41 @@
+#ifndef __peer_scoreboard_h__
+#define __peer_scoreboard_h__
+
+#include "preon_types.h"
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+
+struct PeerScore {
+    double  throughput;         // bytes/s, 0 until the first transfer
+    double  connect_latency;    // s
+    double  failure_rate;       // fraction of failed connects/transfers
+};
+
+// Process wide exponentially weighted averages of how well each peer served
+// us, shared by all job workers. Peers are ordered by the expected rate at
+// which they deliver blocks, with some exploration so new (or recovered)
+// peers still get tried.
+class PeerScoreboard {
+    public:
+        PeerScoreboard() {};
+
+        void record_connect(const PreonAddr &addr, double seconds);
+        void record_transfer(const PreonAddr &addr, size_t bytes, double seconds);
+        void record_failure(const PreonAddr &addr);
+
+        // peers in the order they should be tried
+        PreonAddrList order(const PreonAddrList &peers);
+
+        bool get_score(const PreonAddr &addr, PeerScore &score);
+
+    private:
+        std::mutex                      m_lock;
+        std::map<PreonAddr, PeerScore>  m_scores;
+
+        PeerScore &unsafe_get(const PreonAddr &addr);
+        double unsafe_weight(const PeerScore &score, double optimistic);
+};
+
+#endif //#ifndef __peer_scoreboard_h__
@@ -0,0 +1,43 @@
+#include "peer_set.h"
+
+bool PeerSet::add(const PreonAddr &addr) {
+    bool result;
+
+    m_lock.lock();
+    result = m_peers.insert(addr).second;
+    m_lock.unlock();
+
+    return result;
+}
+
+void PeerSet::add(const PreonAddrList &list) {
+    m_lock.lock();
+    m_peers.insert(list.begin(), list.end());
+    m_lock.unlock();
+}
+
+void PeerSet::remove(const PreonAddr &addr) {
+    m_lock.lock();
+    m_peers.erase(addr);
+    m_lock.unlock();
+}
+
+PreonAddrList PeerSet::get() {
+    PreonAddrList result;
+
+    m_lock.lock();
+    result.assign(m_peers.begin(), m_peers.end());
+    m_lock.unlock();
+
+    return result;
+}
+
+bool PeerSet::empty() {
+    bool result;
+
+    m_lock.lock();
+    result = m_peers.empty();
+    m_lock.unlock();
+
+    return result;
+}
@@ -0,0 +1,29 @@
+#ifndef __peer_set_h__
+#define __peer_set_h__
+
+#include "preon_types.h"
+
+#include <mutex>
+#include <set>
+
+// Peers known to take part in the swarm of a single job. It is bootstrapped
+// from the tracker and grown with peer exchange (GET_PEERS), so the tracker
+// is only needed again when the set runs dry.
+class PeerSet {
+    public:
+        PeerSet() {};
+
+        // true if the peer is new
+        bool add(const PreonAddr &addr);
+        void add(const PreonAddrList &list);
+        void remove(const PreonAddr &addr);
+
+        PreonAddrList get();
+        bool empty();
+
+    private:
+        std::mutex          m_lock;
+        std::set<PreonAddr> m_peers;
+};
+
+#endif //#ifndef __peer_set_h__
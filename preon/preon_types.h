@@ -1,6 +1,7 @@
 #ifndef __preon_types_h__
 #define __preon_types_h__
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -14,8 +15,8 @@ inline bool operator==(const PreonAddr &a, const PreonAddr &b) {
 }
 
 inline bool operator<(const PreonAddr &a, const PreonAddr &b) {
-    if (a.ip_addr < b.ip_addr)
-        return true;
+    if (a.ip_addr != b.ip_addr)
+        return a.ip_addr < b.ip_addr;
     return a.port < b.port;
 }
 
@@ -32,4 +33,26 @@ inline bool operator<(const File &a, const File &b) {
         return a.name < b.name;
 }
 
+// What executing a job takes, from the [resources] section of its manifest
+struct Resources {
+    unsigned    cores   = 1;
+    uint64_t    memory  = 0;    // bytes, 0 if the job doesn't say
+    uint64_t    scratch = 0;    // bytes of disk besides the inputs
+};
+
+inline bool operator==(const Resources &a, const Resources &b) {
+    return a.cores == b.cores && a.memory == b.memory && a.scratch == b.scratch;
+}
+
+inline bool operator!=(const Resources &a, const Resources &b) {
+    return !(a == b);
+}
+
+// A job handed to a worker: INFORM_JOB(S) and STEAL_JOBS
+struct JobOffer {
+    std::string job_id;
+    int         priority;
+    Resources   resources;
+};
+
 #endif // #ifndef __preon_types_h__
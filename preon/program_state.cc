@@ -1,35 +1,56 @@
 #include "program_state.h"
 #include "error.h"
 
-ProgramState::ProgramState() {
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <sys/stat.h>
+
+ProgramState::ProgramState() :
+    m_retry_scheduler([this](const std::string &job_id) {requeue_job(job_id);})
+{
     m_config = nullptr;
+    m_dht = nullptr;
+    m_prefetch_bytes = 0;
+    m_allotted_memory = 0;
 }
 
-void ProgramState::add_job(const std::string &root_dir, const std::string &job_id) {
+bool ProgramState::add_job(const std::string &root_dir, const std::string &job_id) {
+    if (get_job(job_id) != nullptr)
+        return false;
+
+    // read the manifest now if we have it: it has the priority, and our own
+    // jobs are only known to be master jobs (which can be handed out in a
+    // batch or stolen) once it is read
+    std::unique_ptr<Job> job = std::make_unique<Job>(root_dir + "/" + job_id, job_id);
+    try {
+        job->read_manifest();
+    }
+    catch (PreonExcept &e) { }
+
     m_lock.lock();
+    bool added = unsafe_add_job(std::move(job));
+    m_lock.unlock();
 
-    std::set<std::string> jobs;
-    unsafe_get_job_ids(jobs);
-    if (jobs.find(job_id) != jobs.end())
-        return;
+    return added;
+}
 
-    std::string job_dir = root_dir + "/" + job_id;
-    m_jobs.push_back(std::make_unique<Job>(job_dir, job_id));
-    m_unfinished_job_ids.insert(job_id);
+bool ProgramState::add_job(const std::string &root_dir, const std::string &job_id,
+        int priority) {
+    std::unique_ptr<Job> job = std::make_unique<Job>(root_dir + "/" + job_id, job_id);
+    job->set_priority(priority);
 
+    m_lock.lock();
+    bool added = unsafe_add_job(std::move(job));
     m_lock.unlock();
+
+    return added;
 }
 
 Job *ProgramState::get_job(const std::string &job_id) const {
-    Job *job = nullptr;
-
     m_lock.lock();
-    for (const std::unique_ptr<Job> &j: m_jobs) {
-        if (j->get_job_id() == job_id) {
-            job = j.get();
-            break;
-        }
-    }
+    Job *job = unsafe_get_job(job_id);
     m_lock.unlock();
 
     return job;
@@ -41,49 +62,278 @@ void ProgramState::get_job_ids(std::set<std::string> &job_ids) {
     m_lock.unlock();
 }
 
-std::string ProgramState::claim_unfinished_job_id() {
+std::string ProgramState::claim_job_id(JobStage stage, int timeout_s) {
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    JobQueue &queue = m_stage_queues[(size_t)stage];
+    std::condition_variable &cv = m_stage_cvs[(size_t)stage];
+    std::string checked;    // the execute stage takes the job whose resources it checked
+    if (!cv.wait_for(lock, std::chrono::seconds(timeout_s), [&]() {
+                if (queue.empty())
+                    return false;
+                if (stage != JobStage::execute)
+                    return true;
+
+                checked = queue.peek();
+                return unsafe_can_execute(checked);
+            }))
+        return "idle";
+
     std::string job_id;
+    if (stage == JobStage::execute) {
+        queue.pop(checked);
+        job_id = checked;
+    }
+    else
+        job_id = queue.pop();
+    m_working_jobs[job_id] = stage;
+    if (stage == JobStage::execute) {
+        unsafe_release_prefetch(job_id);
+        unsafe_allot(job_id);
+
+        // the next one may fit as well
+        if (!queue.empty())
+            cv.notify_one();
+    }
 
+    return job_id;
+}
+
+void ProgramState::advance_job_id(const std::string &job_id, JobStage stage) {
     m_lock.lock();
 
-    auto it = m_unfinished_job_ids.begin();
-    if (it == m_unfinished_job_ids.end()) {
+    m_working_jobs.erase(job_id);
+    unsafe_release_allotment(job_id);
+
+    Job *job = unsafe_get_job(job_id);
+    if (job != nullptr)
+        unsafe_queue_job(job_id, stage, job->get_priority());
+
+    m_lock.unlock();
+}
+
+void ProgramState::mark_finished_job_id(const std::string &job_id) {
+    m_lock.lock();
+
+    m_working_jobs.erase(job_id);
+    m_finished_job_ids.insert(job_id);
+    unsafe_release_prefetch(job_id);
+    unsafe_release_allotment(job_id);
+
+    m_lock.unlock();
+
+    m_retry_scheduler.reset(job_id);
+    m_rate_limiter.forget_job(job_id);
+}
+
+double ProgramState::defer_job(const std::string &job_id,
+        std::unique_ptr<TrackerSubscription> sub) {
+    m_lock.lock();
+    m_working_jobs.erase(job_id);
+    m_deferred_job_ids.insert(job_id);
+    unsafe_release_prefetch(job_id);
+    unsafe_release_allotment(job_id);
+    m_lock.unlock();
+
+    return m_retry_scheduler.defer(job_id, std::move(sub));
+}
+
+// Called by the retry scheduler
+void ProgramState::requeue_job(const std::string &job_id) {
+    m_lock.lock();
+    if (m_deferred_job_ids.erase(job_id) != 0) {
+        Job *job = unsafe_get_job(job_id);
+        int priority = job != nullptr ? job->get_priority() : DEFAULT_PRIORITY;
+        unsafe_queue_job(job_id, JobStage::fetch, priority);
+    }
+    m_lock.unlock();
+}
+
+bool ProgramState::reserve_prefetch(const std::string &job_id, uint64_t bytes) {
+    m_lock.lock();
+
+    // a job coming back from a failed verify keeps its reservation
+    if (m_prefetch_reserved.find(job_id) != m_prefetch_reserved.end()) {
         m_lock.unlock();
-        return "idle";
+        return true;
     }
 
-    job_id = *it;
+    if (!m_prefetch_reserved.empty()
+            && m_prefetch_bytes + bytes > m_config->get_prefetch_budget()) {
+        m_working_jobs.erase(job_id);
+        m_prefetch_waiting.insert(job_id);
+        m_lock.unlock();
+        return false;
+    }
 
-    m_unfinished_job_ids.erase(job_id);
-    m_working_job_ids.insert(job_id);
+    m_prefetch_reserved[job_id] = bytes;
+    m_prefetch_bytes += bytes;
 
     m_lock.unlock();
+    return true;
+}
 
-    return job_id;
+unsigned ProgramState::get_n_free_workers() {
+    return get_free_resources().cores;
 }
 
-void ProgramState::mark_finished_job_id(const std::string &job_id) {
+Resources ProgramState::get_free_resources() {
     m_lock.lock();
+    Resources result = unsafe_get_free_resources();
+    m_lock.unlock();
 
-    m_working_job_ids.erase(job_id);
-    m_finished_job_ids.insert(job_id);
+    return result;
+}
+
+bool ProgramState::accept_job(const JobOffer &offer, bool only_if_fits) {
+    m_lock.lock();
+    bool accepted = unsafe_accept_job(offer, only_if_fits);
+    m_lock.unlock();
+
+    return accepted;
+}
+
+void ProgramState::accept_jobs(const std::vector<JobOffer> &offered,
+        std::vector<std::string> &accepted) {
+    accepted.clear();
+
+    m_lock.lock();
+
+    for (const JobOffer &offer: offered) {
+        if (unsafe_accept_job(offer, true))
+            accepted.push_back(offer.job_id);
+    }
+
+    m_lock.unlock();
+}
+
+void ProgramState::hand_out_jobs(unsigned n, const Resources &room, const PreonAddr &worker,
+        std::vector<JobOffer> &jobs) {
+    jobs.clear();
+
+    m_lock.lock();
+
+    std::vector<Job *> candidates;
+    for (const std::unique_ptr<Job> &job: m_jobs) {
+        if (job->is_master() && !job->get_execution_finished() && !job->get_worker_informed())
+            candidates.push_back(job.get());
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [](Job *a, Job *b) {
+        return a->get_priority() > b->get_priority();
+    });
+
+    Resources left = room;
+    for (Job *job: candidates) {
+        if (jobs.size() == n)
+            break;
+
+        Resources resources = job->get_resources();
+        if (resources.cores > left.cores || resources.memory > left.memory
+                || resources.scratch > left.scratch)
+            continue;
+        if (m_straggler_detector.is_worker(job->get_job_id(), worker))
+            continue;
+
+        // a job worker may have claimed it for an INFORM_JOB meanwhile
+        if (job->mark_worker_informed()) {
+            jobs.push_back({job->get_job_id(), job->get_priority(), resources});
+            left.cores -= resources.cores;
+            left.memory -= resources.memory;
+            left.scratch -= resources.scratch;
+        }
+    }
+
+    m_lock.unlock();
+}
+
+bool ProgramState::has_jobs_to_hand_out() {
+    bool result = false;
+
+    m_lock.lock();
+    for (const std::unique_ptr<Job> &job: m_jobs) {
+        if (job->is_master() && !job->get_execution_finished() && !job->get_worker_informed()) {
+            result = true;
+            break;
+        }
+    }
+    m_lock.unlock();
+
+    return result;
+}
+
+// the waits are those of the fetch queue, where jobs wait for us to start
+std::string ProgramState::get_queue_report() {
+    std::stringstream ss;
+
+    m_lock.lock();
+
+    ss << m_stage_queues[(size_t)JobStage::fetch].report();
+    for (size_t i = 0; i < N_JOB_STAGES; i++) {
+        size_t n_working = 0;
+        for (const auto &job: m_working_jobs)
+            n_working += job.second == (JobStage)i;
+
+        std::string name = STR("stage_") + stage_name((JobStage)i);
+        ss << name << "_queued " << m_stage_queues[i].size() << "\n"
+           << name << "_working " << n_working << "\n";
+    }
+
+    ss << "execute_cores_allotted " << m_placer.get_n_slots() - m_placer.get_n_free() << "\n"
+       << "execute_memory_allotted_bytes " << m_allotted_memory << "\n";
+
+    ss << "prefetch_budget_bytes " << m_config->get_prefetch_budget() << "\n"
+       << "prefetch_reserved_bytes " << m_prefetch_bytes << "\n"
+       << "prefetch_waiting " << m_prefetch_waiting.size() << "\n";
 
     m_lock.unlock();
+
+    return ss.str();
 }
 
-unsigned ProgramState::get_n_idle_workers() {
-    unsigned result;
+std::string ProgramState::get_job_stage(const std::string &job_id) {
+    std::string result = "unknown";
 
     m_lock.lock();
 
-    unsigned n_workers = m_config->get_n_workers();
-    result = n_workers - m_working_job_ids.size();
+    auto it = m_working_jobs.find(job_id);
+    if (it != m_working_jobs.end())
+        result = stage_name(it->second);
+    else if (m_prefetch_waiting.find(job_id) != m_prefetch_waiting.end())
+        result = "waiting";
+    else if (m_deferred_job_ids.find(job_id) != m_deferred_job_ids.end())
+        result = "deferred";
+    else if (m_finished_job_ids.find(job_id) != m_finished_job_ids.end())
+        result = "finished";
+    else {
+        std::set<std::string> queued;
+        for (const JobQueue &queue: m_stage_queues)
+            queue.get_job_ids(queued);
+        if (queued.find(job_id) != queued.end())
+            result = "queued";
+    }
 
     m_lock.unlock();
 
     return result;
 }
 
+void ProgramState::get_placement(const std::string &job_id, std::vector<int> &cpus,
+        std::vector<int> &nodes) {
+    m_lock.lock();
+    m_placer.get_cpus(job_id, cpus);
+    m_placer.get_nodes(job_id, nodes);
+    m_lock.unlock();
+}
+
+int ProgramState::get_reserved_cpu() {
+    m_lock.lock();
+    unsafe_init_capacity();
+    int result = m_placer.get_reserved_cpu();
+    m_lock.unlock();
+
+    return result;
+}
+
 void ProgramState::set_config(Config *config) {
     m_lock.lock();
 
@@ -106,10 +356,183 @@ Config *ProgramState::get_config() const {
     return result;
 }
 
+void ProgramState::set_dht(Dht *dht) {
+    m_lock.lock();
+    m_dht = dht;
+    m_lock.unlock();
+}
+
+Dht *ProgramState::get_dht() const {
+    Dht *result;
+
+    m_lock.lock();
+    result = m_dht;
+    m_lock.unlock();
+
+    return result;
+}
+
+bool ProgramState::unsafe_add_job(std::unique_ptr<Job> job) {
+    std::string job_id = job->get_job_id();
+
+    std::set<std::string> jobs;
+    unsafe_get_job_ids(jobs);
+    if (jobs.find(job_id) != jobs.end())
+        return false;
+
+    unsafe_queue_job(job_id, JobStage::fetch, job->get_priority());
+    m_jobs.push_back(std::move(job));
+
+    return true;
+}
+
+void ProgramState::unsafe_queue_job(const std::string &job_id, JobStage stage, int priority) {
+    m_stage_queues[(size_t)stage].push(job_id, priority);
+    m_stage_cvs[(size_t)stage].notify_one();
+}
+
+Job *ProgramState::unsafe_get_job(const std::string &job_id) const {
+    for (const std::unique_ptr<Job> &job: m_jobs) {
+        if (job->get_job_id() == job_id)
+            return job.get();
+    }
+
+    return nullptr;
+}
+
+bool ProgramState::unsafe_accept_job(const JobOffer &offer, bool only_if_fits) {
+    if (only_if_fits) {
+        const Resources &needed = offer.resources;
+        Resources free = unsafe_get_free_resources();
+        if (needed.cores > m_capacity.cores || needed.cores > free.cores
+                || needed.memory > free.memory || needed.scratch > free.scratch)
+            return false;
+    }
+
+    std::string download_dir = m_config->get_download_folder();
+    std::string job_dir = download_dir + "/" + offer.job_id;
+
+    if (mkdir(job_dir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1) {
+        if (errno != EEXIST)
+            warn(STR("mkdir(): ") + strerror(errno));
+        return false;
+    }
+
+    std::unique_ptr<Job> job = std::make_unique<Job>(job_dir, offer.job_id);
+    job->set_priority(offer.priority);
+    job->set_resources(offer.resources);
+
+    // under the lock, so the fs watcher can't add it before us
+    return unsafe_add_job(std::move(job));
+}
+
+// The download folder exists by the time the first job comes in
+void ProgramState::unsafe_init_capacity() {
+    if (m_placer.is_initialized())
+        return;
+
+    m_capacity = m_config->get_capacity();
+    m_placer.init(m_capacity.cores, m_config->get_reserve_cpu());
+}
+
+Resources ProgramState::unsafe_get_free_resources() {
+    unsafe_init_capacity();
+
+    // parked jobs come back, they keep what they took
+    std::set<std::string> in_pipeline(m_prefetch_waiting);
+    in_pipeline.insert(m_deferred_job_ids.begin(), m_deferred_job_ids.end());
+    for (const JobQueue &queue: m_stage_queues)
+        queue.get_job_ids(in_pipeline);
+    for (const auto &job: m_working_jobs)
+        in_pipeline.insert(job.first);
+
+    // our own jobs aren't executed here, they only take a fetch worker
+    uint64_t cores = 0, memory = 0, scratch = 0;
+    for (const std::unique_ptr<Job> &job: m_jobs) {
+        if (in_pipeline.find(job->get_job_id()) == in_pipeline.end())
+            continue;
+
+        if (job->is_master()) {
+            cores++;
+            continue;
+        }
+
+        Resources resources = job->get_resources();
+        cores += resources.cores;
+        memory += resources.memory;
+        scratch += resources.scratch;
+    }
+
+    uint64_t capacity = m_config->get_n_stage_workers(JobStage::fetch) + m_capacity.cores;
+
+    Resources free;
+    free.cores = cores >= capacity ? 0 : capacity - cores;
+    free.memory = memory >= m_capacity.memory ? 0 : m_capacity.memory - memory;
+    free.scratch = scratch >= m_capacity.scratch ? 0 : m_capacity.scratch - scratch;
+    return free;
+}
+
+// A job asking for more cores than we have gets all of them, and one asking
+// for more memory than we have runs on its own
+bool ProgramState::unsafe_can_execute(const std::string &job_id) {
+    unsafe_init_capacity();
+
+    Job *job = unsafe_get_job(job_id);
+    Resources needed = job != nullptr ? job->get_resources() : Resources();
+
+    if (m_placer.get_n_free() < std::min((size_t)needed.cores, m_placer.get_n_slots()))
+        return false;
+
+    return m_allotted_memories.empty() || m_allotted_memory + needed.memory <= m_capacity.memory;
+}
+
+void ProgramState::unsafe_allot(const std::string &job_id) {
+    Job *job = unsafe_get_job(job_id);
+    Resources needed = job != nullptr ? job->get_resources() : Resources();
+
+    unsigned n = std::min((size_t)needed.cores, m_placer.get_n_slots());
+    if (!m_placer.place(job_id, n))
+        warn("No cpus free for '" + job_id + "', it runs unpinned");
+
+    m_allotted_memories[job_id] = needed.memory;
+    m_allotted_memory += needed.memory;
+}
+
+void ProgramState::unsafe_release_allotment(const std::string &job_id) {
+    auto it = m_allotted_memories.find(job_id);
+    if (it == m_allotted_memories.end())
+        return;
+
+    m_placer.release(job_id);
+    m_allotted_memory -= it->second;
+    m_allotted_memories.erase(it);
+
+    m_stage_cvs[(size_t)JobStage::execute].notify_one();
+}
+
+// Freed budget may fit any waiting job, they all try again
+void ProgramState::unsafe_release_prefetch(const std::string &job_id) {
+    auto it = m_prefetch_reserved.find(job_id);
+    if (it == m_prefetch_reserved.end())
+        return;
+
+    m_prefetch_bytes -= it->second;
+    m_prefetch_reserved.erase(it);
+
+    for (const std::unique_ptr<Job> &job: m_jobs) {
+        if (m_prefetch_waiting.erase(job->get_job_id()) != 0)
+            unsafe_queue_job(job->get_job_id(), JobStage::fetch, job->get_priority());
+    }
+}
+
 void ProgramState::unsafe_get_job_ids(std::set<std::string> &job_ids) {
     job_ids.clear();
 
-    job_ids.insert(m_unfinished_job_ids.begin(), m_unfinished_job_ids.end());
+    for (const JobQueue &queue: m_stage_queues)
+        queue.get_job_ids(job_ids);
     job_ids.insert(m_finished_job_ids.begin(), m_finished_job_ids.end());
-    job_ids.insert(m_working_job_ids.begin(), m_working_job_ids.end());
+    for (const auto &job: m_working_jobs)
+        job_ids.insert(job.first);
+    job_ids.insert(m_deferred_job_ids.begin(), m_deferred_job_ids.end());
+    job_ids.insert(m_prefetch_waiting.begin(), m_prefetch_waiting.end());
 }
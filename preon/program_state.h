@@ -1,41 +1,154 @@
 #ifndef __program_state_h__
 #define __program_state_h__
 
+#include "cache_summary.h"
+#include "content_store.h"
 #include "job.h"
+#include "job_queue.h"
 #include "config.h"
+#include "cpu_placer.h"
+#include "dht.h"
+#include "peer_scoreboard.h"
+#include "rate_limiter.h"
+#include "retry_scheduler.h"
+#include "straggler_detector.h"
 
+#include <condition_variable>
+#include <cstdint>
+#include <map>
 #include <set>
 #include <string>
 #include <mutex>
 #include <memory>
+#include <utility>
+#include <vector>
 
 class ProgramState {
     public:
         ProgramState();
 
-        void add_job(const std::string &root_dir, const std::string &job_id);
+        // False if the job was already known. Without a priority, the one
+        // in the job's manifest is used if we have it.
+        bool add_job(const std::string &root_dir, const std::string &job_id);
+        bool add_job(const std::string &root_dir, const std::string &job_id, int priority);
         Job *get_job(const std::string &job_id) const;
 
         void get_job_ids(std::set<std::string> &job_ids);
 
-        std::string claim_unfinished_job_id();
+        // Blocks until a job is queued for the stage, or returns "idle"
+        // after timeout_s. Jobs are claimed by priority, see JobQueue. New
+        // and requeued jobs start at JobStage::fetch. The execute stage
+        // only claims the job at the head once its cores and memory are
+        // free, so small jobs can't starve a large one.
+        std::string claim_job_id(JobStage stage, int timeout_s);
+        // queues a claimed job for its next stage
+        void advance_job_id(const std::string &job_id, JobStage stage);
         void mark_finished_job_id(const std::string &job_id);
 
-        unsigned get_n_idle_workers();
+        // Hands a claimed job which can't make progress to the retry
+        // scheduler, which queues it again later. Returns the backoff in s.
+        double defer_job(const std::string &job_id, std::unique_ptr<TrackerSubscription> sub);
+
+        // Inputs downloaded for jobs which don't execute yet count against
+        // the prefetch budget, until the job is claimed for execution. False
+        // if the job's inputs don't fit; it then waits, and goes back to
+        // fetch once a job starts executing. A job always fits when nothing
+        // is reserved, so one larger than the budget still runs.
+        bool reserve_prefetch(const std::string &job_id, uint64_t bytes);
+
+        // Jobs we can still take on, in cores: a fetch and an execute worker
+        // per core, minus the cores of the jobs queued, deferred or worked on
+        // in any stage
+        unsigned get_n_free_workers();
+        // The free cores above, and the memory and scratch disk not yet
+        // promised to the jobs in the pipeline (deferred ones included)
+        Resources get_free_resources();
+
+        // Creates the job directory of a job a master handed to us and adds
+        // the job. False if it doesn't fit (unless only_if_fits is false),
+        // or the directory exists already or failed.
+        bool accept_job(const JobOffer &offer, bool only_if_fits = true);
+        // INFORM_JOBS: accepts the offered jobs which fit, in order. Decided
+        // under a single lock, so concurrent offers can't take the same room.
+        void accept_jobs(const std::vector<JobOffer> &offered, std::vector<std::string> &accepted);
+
+        // Marks up to n of our master jobs which still need a worker and fit
+        // in room together as informed, highest priority first, and returns
+        // them, leaving out those the worker already works on (the original
+        // of a duplicate). For STEAL_JOBS, and to fill up an INFORM_JOBS batch.
+        void hand_out_jobs(unsigned n, const Resources &room, const PreonAddr &worker,
+                std::vector<JobOffer> &jobs);
+        bool has_jobs_to_hand_out();
+        std::string get_queue_report();
+
+        // where a job is: the stage it's worked on or "queued", "waiting"
+        // (for prefetch budget), "deferred" or "finished"; for heartbeats
+        std::string get_job_stage(const std::string &job_id);
+
+        // The cpus (and their NUMA nodes) the execute stage placed a job
+        // on, empty if none
+        void get_placement(const std::string &job_id, std::vector<int> &cpus,
+                std::vector<int> &nodes);
+        // For the daemon's network threads, -1 if no cpu is reserved
+        int get_reserved_cpu();
 
         void set_config(Config *config);
         Config *get_config() const;
 
+        // have their own locking
+        PeerScoreboard &get_scoreboard() {return m_scoreboard;}
+        RateLimiter &get_rate_limiter() {return m_rate_limiter;}
+        RetryScheduler &get_retry_scheduler() {return m_retry_scheduler;}
+        StragglerDetector &get_straggler_detector() {return m_straggler_detector;}
+        CacheSummaries &get_cache_summaries() {return m_cache_summaries;}
+        ContentStore &get_content_store() {return m_content_store;}
+
+        // nullptr unless running in dht mode
+        void set_dht(Dht *dht);
+        Dht *get_dht() const;
+
     private:
         mutable std::mutex                  m_lock;
+        std::condition_variable             m_stage_cvs[N_JOB_STAGES];  // a job was queued
         std::vector<std::unique_ptr<Job>>   m_jobs;
         Config                             *m_config;
+        Dht                                *m_dht;
+        PeerScoreboard                      m_scoreboard;
+        RateLimiter                         m_rate_limiter;
+        StragglerDetector                   m_straggler_detector;
+        CacheSummaries                      m_cache_summaries;  // of other peers
+        ContentStore                        m_content_store;
 
-        std::set<std::string>               m_unfinished_job_ids;
+        JobQueue                            m_stage_queues[N_JOB_STAGES];
+        std::map<std::string, JobStage>     m_working_jobs;
         std::set<std::string>               m_finished_job_ids;
-        std::set<std::string>               m_working_job_ids;
+        std::set<std::string>               m_deferred_job_ids;
+
+        std::map<std::string, uint64_t>     m_prefetch_reserved;
+        uint64_t                            m_prefetch_bytes;  // sum of the above
+        std::set<std::string>               m_prefetch_waiting;
+
+        // the execute stage: the cpus and memory of the executing jobs
+        Resources                           m_capacity;     // known once the placer is
+        CpuPlacer                           m_placer;
+        std::map<std::string, uint64_t>     m_allotted_memories;
+        uint64_t                            m_allotted_memory;  // sum of the above
+
+        // last, so its timer thread stops before the rest is destroyed
+        RetryScheduler                      m_retry_scheduler;
 
         void unsafe_get_job_ids(std::set<std::string> &job_ids);
+        bool unsafe_add_job(std::unique_ptr<Job> job);
+        void unsafe_queue_job(const std::string &job_id, JobStage stage, int priority);
+        Job *unsafe_get_job(const std::string &job_id) const;
+        bool unsafe_accept_job(const JobOffer &offer, bool only_if_fits);
+        void unsafe_init_capacity();
+        Resources unsafe_get_free_resources();
+        bool unsafe_can_execute(const std::string &job_id);
+        void unsafe_allot(const std::string &job_id);
+        void unsafe_release_allotment(const std::string &job_id);
+        void unsafe_release_prefetch(const std::string &job_id);
+        void requeue_job(const std::string &job_id);
 };
 
 #endif //#ifndef __program_state_h__
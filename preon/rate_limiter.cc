@@ -0,0 +1,175 @@
+#include "consts.h"
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <unistd.h>
+
+namespace {
+
+double now_seconds() {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double burst_size(unsigned rate) {
+    return std::max((double)rate * RATE_LIMIT_BURST, (double)RATE_LIMIT_CHUNK);
+}
+
+}
+
+bool parse_rate_scope(const std::string &str, RateScope &scope) {
+    if (str == "global")
+        scope = RateScope::global;
+    else if (str == "peer")
+        scope = RateScope::peer;
+    else if (str == "job")
+        scope = RateScope::job;
+    else
+        return false;
+
+    return true;
+}
+
+bool parse_rate_dir(const std::string &str, RateDir &dir) {
+    if (str == "upload")
+        dir = RateDir::upload;
+    else if (str == "download")
+        dir = RateDir::download;
+    else
+        return false;
+
+    return true;
+}
+
+TokenBucket::TokenBucket(unsigned rate) :
+    m_rate(rate),
+    m_tokens(1e18),     // full, capped at the first reserve()
+    m_last(now_seconds()) {}
+
+void TokenBucket::set_rate(unsigned rate) {
+    m_rate = rate;
+}
+
+// The bucket holds at most RATE_LIMIT_BURST seconds worth of tokens (and
+// at least one chunk), so an idle connection can't burst for long.
+double TokenBucket::reserve(size_t bytes, double now) {
+    if (m_rate == 0) {
+        m_last = now;
+        return 0.0;
+    }
+
+    m_tokens = std::min(burst_size(m_rate), m_tokens + (now - m_last) * m_rate);
+    m_last = now;
+
+    m_tokens -= bytes;
+    if (m_tokens >= 0.0)
+        return 0.0;
+
+    return -m_tokens / m_rate;
+}
+
+bool TokenBucket::is_full(double now) const {
+    return m_rate == 0 || m_tokens + (now - m_last) * m_rate >= burst_size(m_rate);
+}
+
+void RateLimiter::set_limit(RateScope scope, RateDir dir, unsigned rate) {
+    m_lock.lock();
+
+    Direction &d = unsafe_dir(dir);
+    if (scope == RateScope::global)
+        d.global.set_rate(rate);
+    else if (scope == RateScope::peer) {
+        d.peer_rate = rate;
+        for (auto &bucket: d.peers)
+            bucket.second.set_rate(rate);
+    }
+    else {
+        d.job_rate = rate;
+        for (auto &bucket: d.jobs)
+            bucket.second.set_rate(rate);
+    }
+
+    m_lock.unlock();
+}
+
+void RateLimiter::throttle(RateDir dir, const std::string &peer_ip,
+        const std::string &job_id, size_t bytes) {
+    double now = now_seconds();
+
+    m_lock.lock();
+
+    unsafe_prune(now);
+
+    Direction &d = unsafe_dir(dir);
+    d.bytes += bytes;
+
+    // all buckets go into debt, the slowest one determines the wait
+    double wait = d.global.reserve(bytes, now);
+
+    auto peer = d.peers.find(peer_ip);
+    if (peer == d.peers.end())
+        peer = d.peers.insert({peer_ip, TokenBucket(d.peer_rate)}).first;
+    wait = std::max(wait, peer->second.reserve(bytes, now));
+
+    if (!job_id.empty()) {
+        auto job = d.jobs.find(job_id);
+        if (job == d.jobs.end())
+            job = d.jobs.insert({job_id, TokenBucket(d.job_rate)}).first;
+        wait = std::max(wait, job->second.reserve(bytes, now));
+    }
+
+    if (wait > 0.0) {
+        d.n_throttled++;
+        d.throttled_s += wait;
+    }
+
+    m_lock.unlock();
+
+    if (wait > 0.0)
+        usleep((useconds_t)(wait * 1000000));
+}
+
+void RateLimiter::forget_job(const std::string &job_id) {
+    m_lock.lock();
+    for (Direction &d: m_dirs)
+        d.jobs.erase(job_id);
+    m_lock.unlock();
+}
+
+// Peers come and go, their buckets would pile up on a long running daemon
+void RateLimiter::unsafe_prune(double now) {
+    if (now < m_next_prune)
+        return;
+    m_next_prune = now + RATE_LIMIT_PRUNE_INTERVAL;
+
+    for (Direction &d: m_dirs) {
+        for (auto it = d.peers.begin(); it != d.peers.end();) {
+            if (it->second.is_full(now))
+                it = d.peers.erase(it);
+            else
+                it++;
+        }
+    }
+}
+
+std::string RateLimiter::report() {
+    std::stringstream ss;
+
+    m_lock.lock();
+    for (RateDir dir: {RateDir::upload, RateDir::download}) {
+        const Direction &d = unsafe_dir(dir);
+        std::string name = dir == RateDir::upload ? "upload" : "download";
+
+        ss << name << "_bytes " << d.bytes << "\n"
+           << name << "_global_limit " << d.global.get_rate() << "\n"
+           << name << "_throttled " << d.n_throttled << "\n"
+           << name << "_throttled_s " << d.throttled_s << "\n"
+           << name << "_peer_limit " << d.peer_rate << "\n"
+           << name << "_job_limit " << d.job_rate << "\n";
+    }
+    m_lock.unlock();
+
+    return ss.str();
+}
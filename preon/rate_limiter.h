@@ -0,0 +1,93 @@
+#ifndef __rate_limiter_h__
+#define __rate_limiter_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class RateScope {
+    global,
+    peer,   // each peer (ip) gets its own bucket with this rate
+    job,    // each job gets its own bucket with this rate
+};
+
+enum class RateDir {
+    upload,
+    download,
+};
+
+struct RateLimit {
+    RateScope   scope;
+    RateDir     dir;
+    unsigned    rate;   // bytes/s, 0 is unlimited
+};
+
+bool parse_rate_scope(const std::string &str, RateScope &scope);
+bool parse_rate_dir(const std::string &str, RateDir &dir);
+
+class TokenBucket {
+    public:
+        TokenBucket(unsigned rate = 0);
+
+        void set_rate(unsigned rate);
+        unsigned get_rate() const {return m_rate;}
+
+        // Takes bytes from the bucket, which may go into debt, and returns
+        // how long to wait (s) until the debt is paid off
+        double reserve(size_t bytes, double now);
+        // A full bucket is the same as a new one, so it can be dropped
+        bool is_full(double now) const;
+
+    private:
+        unsigned    m_rate;
+        double      m_tokens;
+        double      m_last;
+};
+
+// Token bucket rate limits on block traffic, global, per peer and per job,
+// separately for uploads and downloads. Transfers are throttled in chunks of
+// RATE_LIMIT_CHUNK bytes by sleeping in throttle(). All limits can be changed
+// at runtime.
+class RateLimiter {
+    public:
+        RateLimiter() {};
+
+        void set_limit(RateScope scope, RateDir dir, unsigned rate);
+
+        // job_id may be empty for traffic of no particular job
+        void throttle(RateDir dir, const std::string &peer_ip,
+                const std::string &job_id, size_t bytes);
+
+        // drops the job's buckets, once it finished
+        void forget_job(const std::string &job_id);
+
+        // limits, bytes and time spent throttled, one "key value" per line
+        std::string report();
+
+    private:
+        struct Direction {
+            unsigned    peer_rate = 0;
+            unsigned    job_rate = 0;
+            TokenBucket global;
+            std::map<std::string, TokenBucket> peers;
+            std::map<std::string, TokenBucket> jobs;
+
+            uint64_t    bytes = 0;
+            uint64_t    n_throttled = 0;
+            double      throttled_s = 0.0;
+        };
+
+        std::mutex  m_lock;
+        Direction   m_dirs[2];
+        double      m_next_prune = 0.0;
+
+        // drops the full buckets of peers, every RATE_LIMIT_PRUNE_INTERVAL
+        void unsafe_prune(double now);
+
+        Direction &unsafe_dir(RateDir dir) {return m_dirs[dir == RateDir::upload ? 0 : 1];}
+};
+
+#endif //#ifndef __rate_limiter_h__
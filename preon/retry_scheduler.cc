@@ -0,0 +1,162 @@
+#include "consts.h"
+#include "error.h"
+#include "retry_scheduler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+RetryScheduler::RetryScheduler(std::function<void(const std::string &)> requeue) :
+    m_requeue(requeue),
+    m_stop(false)
+{
+    m_event_fd = eventfd(0, EFD_NONBLOCK);
+    if (m_event_fd == -1)
+        throw PE_SYS("eventfd");
+
+    m_thread = std::thread(&RetryScheduler::timer_thread, this);
+}
+
+RetryScheduler::~RetryScheduler() {
+    m_lock.lock();
+    m_stop = true;
+    m_lock.unlock();
+    notify();
+
+    if (m_thread.joinable())
+        m_thread.join();
+    close(m_event_fd);
+}
+
+double RetryScheduler::defer(const std::string &job_id, std::unique_ptr<TrackerSubscription> sub) {
+    m_lock.lock();
+
+    unsigned n_failures = m_n_failures[job_id]++;
+    double backoff = std::min((double)RETRY_MAX_TIME,
+            RETRY_MIN_TIME * std::pow(2.0, std::min(n_failures, 30u)));
+    backoff *= 0.5 + 0.5 * rand() / RAND_MAX;
+
+    Retry &retry = m_parked[job_id];
+    retry.deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(backoff));
+    retry.sub = std::move(sub);
+
+    m_lock.unlock();
+    notify();
+
+    return backoff;
+}
+
+void RetryScheduler::reset(const std::string &job_id) {
+    m_lock.lock();
+    m_n_failures.erase(job_id);
+    m_lock.unlock();
+}
+
+// Only the timer thread removes parked jobs, as it may be polling their
+// subscriptions
+void RetryScheduler::wake(const std::string &job_id) {
+    m_lock.lock();
+    auto it = m_parked.find(job_id);
+    if (it != m_parked.end())
+        it->second.deadline = Clock::now();
+    m_lock.unlock();
+
+    notify();
+}
+
+void RetryScheduler::notify() {
+    uint64_t one = 1;
+    if (write(m_event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        warn(STR("retry scheduler: write(): ") + strerror(errno));
+}
+
+// Sleeps until the first deadline, a tracker push for a parked job or a
+// notify(), and requeues the jobs which are due
+void RetryScheduler::timer_thread() {
+    for (;;) {
+        std::vector<struct pollfd> pfds = {{m_event_fd, POLLIN, 0}};
+        std::vector<std::string> owners = {""};
+        std::vector<std::string> due;
+        int timeout = -1;
+
+        m_lock.lock();
+        if (m_stop) {
+            m_lock.unlock();
+            return;
+        }
+
+        Clock::time_point now = Clock::now();
+        for (auto it = m_parked.begin(); it != m_parked.end();) {
+            if (it->second.deadline <= now) {
+                due.push_back(it->first);
+                it = m_parked.erase(it);
+                continue;
+            }
+
+            int left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                    it->second.deadline - now).count() + 1;
+            timeout = timeout == -1 ? left : std::min(timeout, left);
+
+            if (it->second.sub) {
+                for (int fd: it->second.sub->get_fds()) {
+                    pfds.push_back({fd, POLLIN, 0});
+                    owners.push_back(it->first);
+                }
+            }
+            it++;
+        }
+        m_lock.unlock();
+
+        // outside the lock, the callback takes the program state's lock
+        for (const std::string &job_id: due)
+            m_requeue(job_id);
+        if (!due.empty())
+            continue;
+
+        int ret = poll(pfds.data(), pfds.size(), timeout);
+        if (ret == -1) {
+            if (errno != EINTR)
+                warn(STR("retry scheduler: poll(): ") + strerror(errno));
+            continue;
+        }
+
+        if (pfds[0].revents != 0) {
+            uint64_t value;
+            if (read(m_event_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+                warn(STR("retry scheduler: read(): ") + strerror(errno));
+        }
+
+        m_lock.lock();
+        for (size_t i = 1; i < pfds.size(); i++) {
+            if (pfds[i].revents == 0)
+                continue;
+
+            auto it = m_parked.find(owners[i]);
+            if (it == m_parked.end() || !it->second.sub)
+                continue;
+
+            try {
+                TrackerEvent event;
+                while (it->second.sub->wait_event(event, 0)) {
+                    if (event.joined)
+                        it->second.deadline = Clock::now();
+                }
+            }
+            catch (PreonExcept &e) {
+                // the backoff still brings the job back
+                warn(STR("Lost tracker subscription: ") + e.what());
+                it->second.sub.reset();
+            }
+        }
+        m_lock.unlock();
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef __retry_scheduler_h__
+#define __retry_scheduler_h__
+
+#include "tracker.h"
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Jobs which can't make progress (no peer has the manifest or a block, no
+// idle worker, ...) are parked here instead of sleeping on a worker thread.
+// A parked job is given back through the requeue callback once its backoff
+// expired, or earlier when what it waits for happens: a JOIN on the tracker
+// subscription it was parked with, or wake() (e.g. a new peer contacted us).
+// Consecutive failures of a job double its backoff from RETRY_MIN_TIME up to
+// RETRY_MAX_TIME, with jitter so peers don't retry in lockstep.
+class RetryScheduler {
+    public:
+        RetryScheduler(std::function<void(const std::string &)> requeue);
+        ~RetryScheduler();
+
+        RetryScheduler(const RetryScheduler &) = delete;
+        RetryScheduler &operator=(const RetryScheduler &) = delete;
+
+        // Parks the job, sub may be nullptr. Returns the backoff in seconds.
+        double defer(const std::string &job_id, std::unique_ptr<TrackerSubscription> sub);
+
+        // The job made progress, its next failure starts from the minimum again
+        void reset(const std::string &job_id);
+
+        // Requeues the job now if it is parked
+        void wake(const std::string &job_id);
+
+    private:
+        struct Retry {
+            std::chrono::steady_clock::time_point   deadline;
+            std::unique_ptr<TrackerSubscription>    sub;
+        };
+
+        std::function<void(const std::string &)> m_requeue;
+
+        std::mutex                          m_lock;
+        std::map<std::string, Retry>        m_parked;
+        std::map<std::string, unsigned>     m_n_failures;   // consecutive
+
+        int                                 m_event_fd;     // wakes up the timer thread
+        bool                                m_stop;
+        std::thread                         m_thread;
+
+        void timer_thread();
+        void notify();
+};
+
+#endif //#ifndef __retry_scheduler_h__
@@ -2,6 +2,8 @@
 #include "status.h"
 #include "utils.h"
 
+#include <climits>
+#include <cstdlib>
 #include <fstream>
 
 namespace {
@@ -21,6 +23,7 @@ Status::Status(const std::string &filename) :
 {
     m_master = false;
     m_execution_status = false;
+    m_block_size = PREON_BLOCK_SIZE;
 }
 
 bool Status::get_master() {
@@ -39,6 +42,14 @@ void Status::set_execution_status(bool execution_status) {
     m_execution_status = execution_status;
 }
 
+size_t Status::get_block_size() {
+    return m_block_size;
+}
+
+void Status::set_block_size(size_t block_size) {
+    m_block_size = block_size;
+}
+
 void Status::add_file(const File &file) {
     m_file_blk_status[file.name];
     set_file(file, DONE);
@@ -48,7 +59,7 @@ void Status::set_file(const File &file, int state) {
     auto it = m_file_blk_status.find(file.name);
     if (it == m_file_blk_status.end())
         throw PE("file not in status");
-    it->second.set_n_blocks(size_to_nblks(file.size), state);
+    it->second.set_n_blocks(size_to_nblks(file.size, m_block_size), state);
 }
 
 void Status::reset_file(const std::string &filename) {
@@ -59,14 +70,14 @@ void Status::reset_file(const std::string &filename) {
     it->second.reset();
 }
 
-void Status::set_block_status(const std::string &filename, int blk_id, int state) {
+void Status::set_block_status(const std::string &filename, int64_t blk_id, int state) {
     auto it = m_file_blk_status.find(filename);
     if (it == m_file_blk_status.end())
         throw PE("file not in status");
     it->second.set_state(blk_id, state);
 }
 
-bool Status::file_has_block(const std::string &filename, int blk_id) {
+bool Status::file_has_block(const std::string &filename, int64_t blk_id) {
     auto it = m_file_blk_status.find(filename);
     if (it == m_file_blk_status.end())
         throw PE("File does not exist");
@@ -74,6 +85,14 @@ bool Status::file_has_block(const std::string &filename, int blk_id) {
     return it->second.get_state(blk_id) == DONE;
 }
 
+int Status::file_get_block_state(const std::string &filename, int64_t blk_id) {
+    auto it = m_file_blk_status.find(filename);
+    if (it == m_file_blk_status.end())
+        throw PE("File does not exist");
+
+    return it->second.get_state(blk_id);
+}
+
 bool Status::file_is_finished(const std::string &filename) {
     auto it = m_file_blk_status.find(filename);
     if (it == m_file_blk_status.end())
@@ -82,7 +101,7 @@ bool Status::file_is_finished(const std::string &filename) {
     return it->second.finished();
 }
 
-int Status::file_get_n_blocks(const std::string &filename) {
+int64_t Status::file_get_n_blocks(const std::string &filename) {
     auto it = m_file_blk_status.find(filename);
     if (it == m_file_blk_status.end())
         throw PE("File not in status");
@@ -90,35 +109,66 @@ int Status::file_get_n_blocks(const std::string &filename) {
     return it->second.get_n_blocks();
 }
 
-int Status::file_claim_empty_block(const std::string &filename) {
+int64_t Status::file_get_n_missing_blocks(const std::string &filename) {
+    auto it = m_file_blk_status.find(filename);
+    if (it == m_file_blk_status.end())
+        throw PE("File not in status");
+
+    return it->second.get_n_blocks() - it->second.get_n_done();
+}
+
+// Claims the EMPTY block the fewest peers have (availability[i] is the
+// number of peers with block i), ties are broken randomly. Blocks no peer has
+// are only claimed when nothing else is left.
+int64_t Status::file_claim_rarest_block(const std::string &filename,
+        const std::vector<int> &availability) {
     auto it = m_file_blk_status.find(filename);
     if (it == m_file_blk_status.end())
         throw PE("File does not exist");
 
     Blocks &blocks = it->second;
-    int n_blocks = blocks.get_n_blocks();
-    if (n_blocks == 0)
-        return -1;
+    int64_t n_blocks = blocks.get_n_blocks();
 
-    int random_block = rand() % n_blocks;
+    int64_t block = -1;
+    int rarest = INT_MAX;
+    int n_ties = 0;
+    for (int64_t i = 0; i < n_blocks; i++) {
+        if (blocks.get_state(i) != EMPTY)
+            continue;
 
-    int i;
-    for (i = random_block; i < n_blocks; i++) {
-        if (blocks.get_state(i) == EMPTY) {
-            blocks.set_state(i, DOWNLOADING);
-            return i;
-        }
-    }
+        int n_peers = (uint64_t)i < availability.size() ? availability[i] : 0;
+        if (n_peers == 0)
+            n_peers = INT_MAX;
 
-    for (i = 0; i < random_block; i++) {
-        if (blocks.get_state(i) == EMPTY) {
-            blocks.set_state(i, DOWNLOADING);
-            return i;
+        if (n_peers < rarest || block == -1) {
+            block = i;
+            rarest = n_peers;
+            n_ties = 1;
+        }
+        else if (n_peers == rarest && rand() % ++n_ties == 0) {
+            block = i;
         }
     }
 
     // No empty blocks
-    return -1;
+    if (block == -1)
+        return -1;
+
+    blocks.set_state(block, DOWNLOADING);
+    return block;
+}
+
+// One character per block, '1' if we have it
+std::string Status::file_get_bitfield(const std::string &filename) {
+    auto it = m_file_blk_status.find(filename);
+    if (it == m_file_blk_status.end())
+        throw PE("File does not exist");
+
+    std::string bitfield;
+    for (int state: it->second)
+        bitfield += state == DONE ? '1' : '0';
+
+    return bitfield;
 }
 
 void Status::init(const std::vector<File> &files) {
@@ -126,7 +176,7 @@ void Status::init(const std::vector<File> &files) {
     m_execution_status = false;
 
     for (const File &f: files) {
-        int n_blocks = size_to_nblks(f.size);
+        int64_t n_blocks = size_to_nblks(f.size, m_block_size);
         m_file_blk_status[f.name] = Blocks(n_blocks);
     }
 }
@@ -230,7 +280,7 @@ void Status::check_file_consistency(const std::vector<File> &files) {
         auto it = m_file_blk_status.find(file.name);
         if (it == m_file_blk_status.end()) {
             // file does not exist, add it
-            m_file_blk_status[file.name] = Blocks(size_to_nblks(file.size));
+            m_file_blk_status[file.name] = Blocks(size_to_nblks(file.size, m_block_size));
             continue;
         }
 
@@ -240,9 +290,9 @@ void Status::check_file_consistency(const std::vector<File> &files) {
         if (file.hash.empty())
             continue;
 
-        if (it->second.get_n_blocks() != size_to_nblks(file.size)) {
+        if (it->second.get_n_blocks() != size_to_nblks(file.size, m_block_size)) {
             warn("file: '" + file.name + "' had an invalid amount of blocks.");
-            m_file_blk_status[file.name] = Blocks(size_to_nblks(file.size));
+            m_file_blk_status[file.name] = Blocks(size_to_nblks(file.size, m_block_size));
         }
     }
 
@@ -250,6 +300,6 @@ void Status::check_file_consistency(const std::vector<File> &files) {
         warn("m_fileblk.size != files.size()");
         m_file_blk_status.clear();
         for (const File &file: files)
-            m_file_blk_status[file.name] = Blocks(size_to_nblks(file.size));
+            m_file_blk_status[file.name] = Blocks(size_to_nblks(file.size, m_block_size));
     }
 }
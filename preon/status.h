@@ -4,6 +4,7 @@
 #include "blocks.h"
 #include "preon_types.h"
 
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <map>
@@ -18,14 +19,22 @@ class Status {
         bool get_execution_status();
         void set_execution_status(bool execution_status);
 
+        // Block size of the job, determines the number of blocks per file
+        size_t get_block_size();
+        void set_block_size(size_t block_size);
+
         void add_file(const File &file);
         void set_file(const File &file, int state = EMPTY);
         void reset_file(const std::string &filename);
-        void set_block_status(const std::string &filename, int blk_id, int state);
-        bool file_has_block(const std::string &filename, int blk_id);
+        void set_block_status(const std::string &filename, int64_t blk_id, int state);
+        bool file_has_block(const std::string &filename, int64_t blk_id);
+        int file_get_block_state(const std::string &filename, int64_t blk_id);
         bool file_is_finished(const std::string &filename);
-        int file_get_n_blocks(const std::string &filename);
-        int file_claim_empty_block(const std::string &filename);
+        int64_t file_get_n_blocks(const std::string &filename);
+        int64_t file_get_n_missing_blocks(const std::string &filename);
+        int64_t file_claim_rarest_block(const std::string &filename,
+                const std::vector<int> &availability);
+        std::string file_get_bitfield(const std::string &filename);
 
         void init(const std::vector<File> &files);
         bool read(const std::vector<File> &files);
@@ -36,6 +45,7 @@ class Status {
 
         bool                m_master;
         bool                m_execution_status;
+        size_t              m_block_size;
         std::map<std::string, Blocks> m_file_blk_status;
 
         void check_file_consistency(const std::vector<File> &files);
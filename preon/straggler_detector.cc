@@ -0,0 +1,156 @@
+#include "consts.h"
+#include "error.h"
+#include "straggler_detector.h"
+
+#include <algorithm>
+#include <sstream>
+
+void StragglerDetector::dispatched(const std::string &job_id, const std::string &job_class,
+        const PreonAddr &worker) {
+    Clock::time_point now = Clock::now();
+
+    m_lock.lock();
+
+    auto it = m_running.find(job_id);
+    if (it == m_running.end()) {
+        Running &running = m_running[job_id];
+        running.job_class = job_class;
+        running.dispatched = now;
+        running.workers.push_back({worker, now, "dispatched"});
+    }
+    else {
+        it->second.workers.push_back({worker, now, "dispatched"});
+        it->second.redispatching = false;
+        m_n_duplicates++;
+    }
+
+    m_lock.unlock();
+}
+
+void StragglerDetector::heartbeat(const std::string &job_id, const PreonAddr &worker,
+        const std::string &stage) {
+    m_lock.lock();
+
+    auto it = m_running.find(job_id);
+    if (it != m_running.end()) {
+        for (Worker &w: it->second.workers) {
+            if (w.addr == worker) {
+                w.last_heartbeat = Clock::now();
+                w.stage = stage;
+            }
+        }
+    }
+
+    m_lock.unlock();
+}
+
+void StragglerDetector::finished(const std::string &job_id) {
+    m_lock.lock();
+
+    auto it = m_running.find(job_id);
+    if (it == m_running.end()) {
+        m_lock.unlock();
+        return;
+    }
+
+    Durations &durations = m_durations[it->second.job_class];
+    double duration = std::chrono::duration<double>(Clock::now() - it->second.dispatched).count();
+    if (durations.samples.size() < STRAGGLER_SAMPLES)
+        durations.samples.push_back(duration);
+    else
+        durations.samples[durations.next] = duration;
+    durations.next = (durations.next + 1) % STRAGGLER_SAMPLES;
+
+    m_running.erase(it);
+
+    m_lock.unlock();
+}
+
+bool StragglerDetector::is_worker(const std::string &job_id, const PreonAddr &addr) {
+    bool result = false;
+
+    m_lock.lock();
+    auto it = m_running.find(job_id);
+    if (it != m_running.end()) {
+        for (const Worker &worker: it->second.workers)
+            result = result || worker.addr == addr;
+    }
+    m_lock.unlock();
+
+    return result;
+}
+
+// A silent job is dispatched again however often that happened before, a
+// slow one gets at most MAX_DUPLICATES
+void StragglerDetector::find_stragglers(std::vector<std::string> &job_ids) {
+    job_ids.clear();
+
+    Clock::time_point now = Clock::now();
+    std::chrono::seconds timeout(HEARTBEAT_TIMEOUT);
+
+    m_lock.lock();
+
+    for (auto &job: m_running) {
+        Running &running = job.second;
+        if (running.redispatching)
+            continue;
+
+        // a worker has the results, we're just collecting them
+        bool finished = false;
+        bool alive = false;
+        for (const Worker &worker: running.workers) {
+            finished = finished || worker.stage == "finished";
+            alive = alive || now - worker.last_heartbeat < timeout;
+        }
+        if (finished)
+            continue;
+
+        double elapsed = std::chrono::duration<double>(now - running.dispatched).count();
+        double median;
+        bool slow = running.workers.size() <= MAX_DUPLICATES
+                && unsafe_get_median(running.job_class, median)
+                && elapsed > STRAGGLER_FACTOR * median;
+
+        if (!alive || slow) {
+            running.redispatching = true;
+            job_ids.push_back(job.first);
+
+            std::stringstream ss;
+            ss << "job '" << job.first << "' " << (alive ? "straggles" : "has no live worker")
+               << " after " << (int)elapsed << "s, dispatching it again";
+            info(ss.str());
+        }
+    }
+
+    m_lock.unlock();
+}
+
+std::string StragglerDetector::report() {
+    std::stringstream ss;
+
+    m_lock.lock();
+
+    ss << "straggler_jobs_running " << m_running.size() << "\n"
+       << "straggler_duplicates " << m_n_duplicates << "\n";
+    for (const auto &durations: m_durations) {
+        double median;
+        if (unsafe_get_median(durations.first, median))
+            ss << "straggler_class_" << durations.first << "_median_s " << median << "\n";
+    }
+
+    m_lock.unlock();
+
+    return ss.str();
+}
+
+bool StragglerDetector::unsafe_get_median(const std::string &job_class, double &median) {
+    auto it = m_durations.find(job_class);
+    if (it == m_durations.end() || it->second.samples.size() < STRAGGLER_MIN_SAMPLES)
+        return false;
+
+    std::vector<double> sorted = it->second.samples;
+    std::sort(sorted.begin(), sorted.end());
+    median = sorted[sorted.size() / 2];
+
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef __straggler_detector_h__
+#define __straggler_detector_h__
+
+#include "preon_types.h"
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Master side of heartbeats. Tracks our jobs from their dispatch until the
+// results are in, and which workers are on them. A job straggles if none of
+// its workers sent a heartbeat for HEARTBEAT_TIMEOUT (the worker is gone),
+// or if it runs STRAGGLER_FACTOR times the median of the jobs of its class
+// which finished. Then it is dispatched once more; the first result wins.
+// A job a worker reported "finished" for never straggles, its results are
+// being collected.
+class StragglerDetector {
+    public:
+        StragglerDetector() {};
+
+        // also for the duplicates
+        void dispatched(const std::string &job_id, const std::string &job_class,
+                const PreonAddr &worker);
+        void heartbeat(const std::string &job_id, const PreonAddr &worker,
+                const std::string &stage);
+        // the results are in
+        void finished(const std::string &job_id);
+
+        bool is_worker(const std::string &job_id, const PreonAddr &addr);
+
+        // Jobs to dispatch again; they aren't returned again until the
+        // next dispatch
+        void find_stragglers(std::vector<std::string> &job_ids);
+
+        std::string report();
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Worker {
+            PreonAddr           addr;
+            Clock::time_point   last_heartbeat;
+            std::string         stage;
+        };
+
+        struct Running {
+            std::string         job_class;
+            Clock::time_point   dispatched;
+            std::vector<Worker> workers;
+            bool                redispatching = false;
+        };
+
+        // recent durations (s) of finished jobs, a ring buffer
+        struct Durations {
+            std::vector<double> samples;
+            size_t              next = 0;
+        };
+
+        std::mutex                          m_lock;
+        std::map<std::string, Running>      m_running;
+        std::map<std::string, Durations>    m_durations;
+        uint64_t                            m_n_duplicates = 0;
+
+        bool unsafe_get_median(const std::string &job_class, double &median);
+};
+
+#endif //#ifndef __straggler_detector_h__
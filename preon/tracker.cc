@@ -1,9 +1,11 @@
 #include <algorithm>
+#include <chrono>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <netdb.h>
+#include <poll.h>
 #include <stdexcept>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -12,12 +14,17 @@
 #include <sstream>
 #include <vector>
 
+#include "consts.h"
 #include "error.h"
+#include "sha256.h"
 #include "tracker.h"
 #include "utils.h"
 
 namespace {
 
+// points per tracker on the hash ring, evens out the shard sizes
+const int VIRTUAL_NODES = 64;
+
 void verify_job_id(const std::string &job_id) {
     if (job_id == "idle")
         return;
@@ -32,34 +39,186 @@ void verify_job_id(const std::string &job_id) {
     }
 }
 
+uint64_t ring_hash(const std::string &key) {
+    SHA256_CTX ctx;
+    BYTE hash[SHA256_BLOCK_SIZE];
+    sha256_init(&ctx);
+    sha256_update(&ctx, (const BYTE *)key.data(), key.size());
+    sha256_final(&ctx, hash);
+
+    uint64_t result = 0;
+    for (int i = 0; i < 8; i++)
+        result = (result << 8) | hash[i];
+
+    return result;
+}
+
+std::string local_hostname() {
+    char buf[256];
+    if (gethostname(buf, sizeof(buf)) == -1)
+        return "localhost";
+    buf[sizeof(buf) - 1] = '\0';
+
+    return buf;
+}
+
+}
+
+TrackerSubscription::~TrackerSubscription() {
+    for (int fd: m_fds)
+        close(fd);
+    m_fds.clear();
+}
+
+void TrackerSubscription::add_connection(int fd) {
+    m_fds.push_back(fd);
+    m_bufs.push_back("");
+}
+
+bool TrackerSubscription::wait_event(TrackerEvent &event, int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    while (!pop_event(event)) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+        if (left < 0 || (left == 0 && timeout_ms != 0))
+            return false;
+
+        std::vector<struct pollfd> pfds;
+        for (int fd: m_fds)
+            pfds.push_back({fd, POLLIN, 0});
+
+        int ret = poll(pfds.data(), pfds.size(), (int)left);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        else if (ret == -1)
+            throw PE_SYS("poll");
+        else if (ret == 0)
+            return false;
+
+        for (size_t i = 0; i < pfds.size(); i++) {
+            if (pfds[i].revents == 0)
+                continue;
+
+            char buf[512];
+            ssize_t n = recv(m_fds[i], buf, sizeof(buf), 0);
+            if (n == -1)
+                throw PE_SYS("recv");
+            else if (n == 0)
+                throw PE("Tracker closed subscription");
+
+            m_bufs[i].append(buf, n);
+        }
+    }
+
+    return true;
+}
+
+bool TrackerSubscription::pop_event(TrackerEvent &event) {
+    for (std::string &buf: m_bufs) {
+        size_t eol = buf.find('\n');
+        if (eol == std::string::npos)
+            continue;
+
+        std::string line(buf.begin(), buf.begin() + eol);
+        buf.erase(0, eol + 1);
+
+        std::stringstream ss(line);
+        std::string type;
+        int port = -1;
+        ss >> type >> event.addr.ip_addr >> port;
+        if ((type != "JOIN" && type != "LEAVE") || port < 0 || port > 65535)
+            throw PE("Invalid subscription event: " + line);
+
+        event.joined = type == "JOIN";
+        event.addr.port = (unsigned short)port;
+
+        return true;
+    }
+
+    return false;
 }
 
-Tracker::Tracker(const std::string &hostname, unsigned short port) {
-    m_hostname = hostname;
-    m_port = std::to_string(port);
+Tracker::Tracker(const PreonAddrList &trackers, Dht *dht) :
+    m_trackers(trackers),
+    m_dht(dht)
+{
+    if (m_dht != nullptr)
+        return;
+
+    if (m_trackers.empty())
+        throw PE("No trackers");
+
+    for (size_t i = 0; i < m_trackers.size(); i++) {
+        const PreonAddr &t = m_trackers[i];
+        for (int v = 0; v < VIRTUAL_NODES; v++)
+            m_ring[ring_hash(t.ip_addr + ":" + STR(t.port) + "#" + STR(v))] = i;
+    }
 }
 
 void Tracker::inform_job(unsigned short port, const std::string &job_id) {
     verify_job_id(job_id);
 
+    if (m_dht != nullptr) {
+        m_dht->announce(job_id, port);
+        return;
+    }
+
     std::stringstream ss;
     ss << "INFORM " << port << " " << job_id << "\n";
 
     std::string resp;
-    msg_tracker(resp, ss.str());
+    msg_tracker(shard_for_job(port, job_id), resp, ss.str());
 
     if (resp != "OK\n")
         throw PE("Response not OK\nResponse: " + resp);
 }
 
+void Tracker::inform_jobs(unsigned short port, const std::vector<std::string> &job_ids) {
+    for (const std::string &job_id: job_ids)
+        verify_job_id(job_id);
+
+    if (m_dht != nullptr) {
+        for (const std::string &job_id: job_ids)
+            m_dht->announce(job_id, port);
+        return;
+    }
+
+    std::map<size_t, std::vector<std::string>> shards;
+    for (const std::string &job_id: job_ids)
+        shards[shard_for_job(port, job_id)].push_back(job_id);
+
+    for (const auto &shard: shards) {
+        const std::vector<std::string> &ids = shard.second;
+        for (size_t i = 0; i < ids.size(); i += TRACKER_BATCH_MAX) {
+            std::stringstream ss;
+            ss << "INFORM_BATCH " << port;
+            for (size_t j = i; j < std::min(ids.size(), i + TRACKER_BATCH_MAX); j++)
+                ss << " " << ids[j];
+            ss << "\n";
+
+            std::string resp;
+            msg_tracker(shard.first, resp, ss.str());
+
+            if (resp != "OK\n")
+                throw PE("Response not OK\nResponse: " + resp);
+        }
+    }
+}
+
 void Tracker::remove_job(unsigned short port, const std::string &job_id) {
     verify_job_id(job_id);
 
+    if (m_dht != nullptr) {
+        m_dht->withdraw(job_id, port);
+        return;
+    }
+
     std::stringstream ss;
     ss << "DELETE " << port << " " << job_id << "\n";
 
     std::string resp;
-    msg_tracker(resp, ss.str());
+    msg_tracker(shard_for_job(port, job_id), resp, ss.str());
 
     if (resp != "OK\n")
         throw PE("Response not OK");
@@ -68,44 +227,114 @@ void Tracker::remove_job(unsigned short port, const std::string &job_id) {
 PreonAddrList Tracker::query_job(const std::string &job_id) {
     verify_job_id(job_id);
 
+    if (m_dht != nullptr) {
+        PreonAddrList list = m_dht->lookup(job_id);
+        std::random_shuffle(list.begin(), list.end());
+        return list;
+    }
+
     std::stringstream ss;
     ss << "QUERY " << job_id << "\n";
 
-    std::string resp;
-    msg_tracker(resp, ss.str());
-
-    if (resp == "FAILED\n")
-        throw PE("Response FAILED");
+    // Idle peers are spread over all shards. Start at a random one, so the
+    // masters don't all pick the same idle peers, and stop at the first
+    // shard that has some.
+    std::vector<size_t> shards;
+    if (job_id == "idle") {
+        size_t first = rand() % m_trackers.size();
+        for (size_t i = 0; i < m_trackers.size(); i++)
+            shards.push_back((first + i) % m_trackers.size());
+    }
+    else
+        shards.push_back(shard_for_key(job_id));
 
     PreonAddrList list;
-    std::vector<std::string> strings;
-    split(resp, strings, '\n');
-    for (auto &s: strings) {
-        if (s.empty())
-            continue;
-
-        size_t index = s.find(' ');
-        if (index == std::string::npos)
-            throw PE("Invalid IP:port string");
-
-        int port;
+    bool reached = false;
+    for (size_t shard: shards) {
+        std::string resp;
         try {
-            port = std::stoi(s.substr(index));
-            if (port < 0 || port > 65535)
-                throw PE("Invalid port");
+            msg_tracker(shard, resp, ss.str());
         }
-        catch (...) {
-            throw PE("Invalid port");
+        catch (PreonExcept &e) {
+            if (shards.size() == 1)
+                throw;
+            debug(e.what());
+            continue;
+        }
+        reached = true;
+
+        if (resp == "FAILED\n")
+            throw PE("Response FAILED");
+
+        std::vector<std::string> strings;
+        split(resp, strings, '\n');
+        for (auto &s: strings) {
+            if (s.empty())
+                continue;
+
+            size_t index = s.find(' ');
+            if (index == std::string::npos)
+                throw PE("Invalid IP:port string");
+
+            int port;
+            try {
+                port = std::stoi(s.substr(index));
+                if (port < 0 || port > 65535)
+                    throw PE("Invalid port");
+            }
+            catch (...) {
+                throw PE("Invalid port");
+            }
+            list.push_back({s.substr(0, index), (unsigned short)port});
         }
-        list.push_back({s.substr(0, index), (unsigned short)port});
+
+        if (!list.empty())
+            break;
     }
 
+    if (!reached)
+        throw PE("No tracker reachable");
+
     std::random_shuffle(list.begin(), list.end());
 
     return list;
 }
 
-int Tracker::connect_tracker() {
+std::unique_ptr<TrackerSubscription> Tracker::subscribe_job(const std::string &job_id) {
+    verify_job_id(job_id);
+
+    if (m_dht != nullptr)
+        return nullptr;
+
+    std::unique_ptr<TrackerSubscription> sub(new TrackerSubscription());
+    if (job_id == "idle") {
+        for (size_t i = 0; i < m_trackers.size(); i++)
+            sub->add_connection(subscribe_shard(i, job_id));
+    }
+    else
+        sub->add_connection(subscribe_shard(shard_for_key(job_id), job_id));
+
+    return sub;
+}
+
+size_t Tracker::shard_for_key(const std::string &key) const {
+    auto it = m_ring.lower_bound(ring_hash(key));
+    if (it == m_ring.end())
+        it = m_ring.begin();
+
+    return it->second;
+}
+
+size_t Tracker::shard_for_job(unsigned short port, const std::string &job_id) const {
+    if (job_id == "idle")
+        return shard_for_key(local_hostname() + ":" + STR(port));
+
+    return shard_for_key(job_id);
+}
+
+int Tracker::connect_tracker(size_t shard) {
+    const PreonAddr &tracker = m_trackers[shard];
+
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
@@ -114,7 +343,7 @@ int Tracker::connect_tracker() {
     hints.ai_protocol = 0;
 
     struct addrinfo *result;
-    int ret = getaddrinfo(m_hostname.c_str(), m_port.c_str(), &hints, &result);
+    int ret = getaddrinfo(tracker.ip_addr.c_str(), STR(tracker.port).c_str(), &hints, &result);
     if (ret != 0) {
         throw PE_SYS("getaddrinfo");
     }
@@ -140,8 +369,39 @@ int Tracker::connect_tracker() {
     return fd;
 }
 
-void Tracker::msg_tracker(std::string &response, const std::string &msg) {
-    int fd = connect_tracker();
+int Tracker::subscribe_shard(size_t shard, const std::string &job_id) {
+    int fd = connect_tracker(shard);
+
+    try {
+        std::stringstream ss;
+        ss << "SUBSCRIBE " << job_id << "\n";
+        send_tracker(fd, ss.str());
+
+        // Read byte wise, everything after the first line are events
+        std::string resp;
+        char c;
+        do {
+            ssize_t ret = recv(fd, &c, 1, 0);
+            if (ret == -1)
+                throw PE_SYS("recv");
+            else if (ret == 0)
+                throw PE("Tracker refused subscription");
+            resp += c;
+        } while (c != '\n');
+
+        if (resp != "OK\n")
+            throw PE("Response not OK");
+    }
+    catch (PreonExcept &e) {
+        close(fd);
+        throw;
+    }
+
+    return fd;
+}
+
+void Tracker::msg_tracker(size_t shard, std::string &response, const std::string &msg) {
+    int fd = connect_tracker(shard);
 
     response.clear();
     try {
@@ -1,25 +1,76 @@
 #ifndef __tracker_h__
 #define __tracker_h__
 
+#include "dht.h"
 #include "preon_types.h"
 
+#include <cstdint>
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
+struct TrackerEvent {
+    bool        joined;     // false if the peer left
+    PreonAddr   addr;
+};
+
+// Persistent connections on which the tracker(s) push JOIN/LEAVE deltas
+// for a single job id. The idle pool is spread over all tracker shards,
+// so an "idle" subscription has a connection to every shard.
+class TrackerSubscription {
+    public:
+        TrackerSubscription() {};
+        ~TrackerSubscription();
+
+        TrackerSubscription(const TrackerSubscription &) = delete;
+        TrackerSubscription &operator=(const TrackerSubscription &) = delete;
+
+        // Returns false if no event arrived within timeout_ms; with a timeout
+        // of 0 it only reads what already arrived
+        bool wait_event(TrackerEvent &event, int timeout_ms);
+
+        // takes ownership of fd
+        void add_connection(int fd);
+
+        // to poll several subscriptions at once, then read with wait_event(e, 0)
+        const std::vector<int> &get_fds() const {return m_fds;}
+
+    private:
+        std::vector<int>            m_fds;
+        std::vector<std::string>    m_bufs;
+
+        bool pop_event(TrackerEvent &event);
+};
+
+// Client for a set of tracker shards. Job ids are routed to a shard with
+// consistent hashing; every peer reports idle to the shard its own
+// hostname:port hashes to, and idle queries walk the shards from a random one.
+// Given a dht, the trackers are not used and the records are stored in the
+// dht instead. The dht can't push deltas, so subscribe_job returns nullptr.
 class Tracker {
     public:
-        Tracker(const std::string &hostname, unsigned short port);
+        Tracker(const PreonAddrList &trackers, Dht *dht = nullptr);
 
         void inform_job(unsigned short port, const std::string &job_id);
+        // One INFORM_BATCH per shard (of at most TRACKER_BATCH_MAX ids)
+        // instead of a message per job
+        void inform_jobs(unsigned short port, const std::vector<std::string> &job_ids);
         void remove_job(unsigned short port, const std::string &job_id);
         PreonAddrList query_job(const std::string &job_id);
+        std::unique_ptr<TrackerSubscription> subscribe_job(const std::string &job_id);
 
     private:
-        std::string     m_hostname;
-        std::string     m_port;
+        PreonAddrList                   m_trackers;
+        Dht                            *m_dht;
+        std::map<uint64_t, size_t>      m_ring;     // point -> m_trackers index
+
+        size_t shard_for_key(const std::string &key) const;
+        size_t shard_for_job(unsigned short port, const std::string &job_id) const;
 
-        int connect_tracker();
-        void msg_tracker(std::string &response, const std::string &msg);
+        int connect_tracker(size_t shard);
+        int subscribe_shard(size_t shard, const std::string &job_id);
+        void msg_tracker(size_t shard, std::string &response, const std::string &msg);
         void send_tracker(int fd, const std::string &msg);
         void recv_tracker(int fd, std::string &response);
 };
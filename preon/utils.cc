@@ -12,9 +12,13 @@
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <sched.h>
+#include <sys/ioctl.h>
 #include <sys/sendfile.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <linux/fs.h>
 
 std::string lstrip(const std::string &str) {
     size_t begin = 0;
@@ -266,6 +270,27 @@ void copy_file(const std::string &dst, const std::string &src) {
     close(dest);
 }
 
+// A reflink shares the blocks until either side writes, which only
+// copy-on-write filesystems (btrfs, xfs) can do
+void clone_file(const std::string &dst, const std::string &src) {
+    int source = open(src.c_str(), O_RDONLY);
+    if (source == -1)
+        throw PE_SYS("open");
+
+    int dest = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest == -1) {
+        close(source);
+        throw PE_SYS("open");
+    }
+
+    int ret = ioctl(dest, FICLONE, source);
+    close(source);
+    close(dest);
+
+    if (ret == -1)
+        copy_file(dst, src);
+}
+
 std::string file_to_str(const std::string &filename) {
     int fd = open(filename.c_str(), O_RDONLY);
     if (fd == -1)
@@ -309,3 +334,44 @@ void write_file(const std::string &filename, const std::string &src) {
 
     file.close();
 }
+
+void get_cpus(std::vector<int> &cpus) {
+    cpus.clear();
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == -1)
+        throw PE_SYS("sched_getaffinity");
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus.push_back(cpu);
+    }
+}
+
+void set_thread_cpus(const std::vector<int> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus)
+        CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        throw PE_SYS("sched_setaffinity");
+}
+
+uint64_t physical_memory() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages == -1 || page_size == -1)
+        throw PE_SYS("sysconf");
+
+    return (uint64_t)pages * (uint64_t)page_size;
+}
+
+uint64_t free_disk_space(const std::string &path) {
+    struct statvfs buf;
+    if (statvfs(path.c_str(), &buf) == -1)
+        throw PE_SYS("statvfs");
+
+    return (uint64_t)buf.f_bavail * buf.f_frsize;
+}
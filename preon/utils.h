@@ -1,6 +1,7 @@
 #ifndef __utils_h__
 #define __utils_h__
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -23,8 +24,16 @@ size_t file_size(const std::string &filename);
 void create_dir(std::string dirname, bool fail_if_exists = false);
 void remove_dir(const std::string &dirname);
 void copy_file(const std::string &dst, const std::string &src);
+// a reflink if the filesystem can, a copy otherwise
+void clone_file(const std::string &dst, const std::string &src);
 
 std::string file_to_str(const std::string &filename);
 void write_file(const std::string &filename, const std::string &src);
 
+// Host resources
+void get_cpus(std::vector<int> &cpus);  // the ones we may run on
+void set_thread_cpus(const std::vector<int> &cpus);     // of the calling thread
+uint64_t physical_memory();
+uint64_t free_disk_space(const std::string &path);
+
 #endif //#ifndef __utils_h__
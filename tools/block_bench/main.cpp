@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "blocks.h"
+#include "consts.h"
+#include "error.h"
+#include "job.h"
+#include "manifest.h"
+#include "network_client.h"
+#include "network_listener.h"
+#include "program_state.h"
+#include "status.h"
+#include "utils.h"
+
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    size_t file_size = 256 * 1024 * 1024;
+    std::vector<size_t> block_sizes;
+    int port = 21000;
+    int rounds = 3;
+    int seed = 0;
+};
+
+struct Result {
+    double reused;      // MB/s over a single connection
+    double per_block;   // MB/s with a connection per block, like preon does
+    double latency;     // s per block on a reused connection (median)
+};
+
+
+void parse_args(unsigned int argc, char* argv[], Options &opts) {
+    for(unsigned int i = 1; i < argc; i++) {
+        try {
+            if(strcmp(argv[i], "-f") == 0 && argc > i + 1)
+                opts.file_size = std::stoull(argv[++i]) * 1024 * 1024;
+            else if(strcmp(argv[i], "-b") == 0 && argc > i + 1)
+                opts.block_sizes.push_back(std::stoull(argv[++i]) * 1024);
+            else if(strcmp(argv[i], "-p") == 0 && argc > i + 1)
+                opts.port = std::stoi(argv[++i]);
+            else if(strcmp(argv[i], "-r") == 0 && argc > i + 1)
+                opts.rounds = std::stoi(argv[++i]);
+            else if(strcmp(argv[i], "-s") == 0 && argc > i + 1)
+                opts.seed = std::stoi(argv[++i]);
+            else
+                throw std::invalid_argument(argv[i]);
+        }
+        catch(...) {
+            if(strcmp(argv[i], "-h") != 0 && strcmp(argv[i], "--help") != 0)
+                std::cout << "Incorrect usage.\n" << std::endl;
+
+            std::cout << "Flags:\n"
+                      << "  -f <MiB>       - Size of the served file (default 256)\n"
+                      << "  -b <KiB>       - Block size to test, can be repeated (default 64 KiB to 64 MiB)\n"
+                      << "  -p <port>      - Port to serve on (default 21000)\n"
+                      << "  -r <rounds>    - Downloads of the file per block size, the best counts (default 3)\n"
+                      << "  -s <seed>      - Set seed\n"
+                      << "  -h             - Prints help\n"
+                      << std::endl;
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    if(opts.block_sizes.empty()) {
+        for(size_t size = MIN_BLOCK_SIZE; size <= MAX_BLOCK_SIZE; size *= 4)
+            opts.block_sizes.push_back(size);
+    }
+
+    for(size_t size: opts.block_sizes) {
+        if(size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE) {
+            std::cout << "Error: block sizes must be between " << MIN_BLOCK_SIZE / 1024
+                      << " and " << MAX_BLOCK_SIZE / 1024 << " KiB" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(opts.file_size == 0 || opts.rounds < 1) {
+        std::cout << "Error: file size and rounds must be positive" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Serves the jobs like preon's main() does
+void listen_thread(NetworkListener &listener, ProgramState &state) {
+    for(;;) {
+        int fd = listener.wait();
+        std::thread([&state, fd]() {
+            try {
+                NetworkClient client(fd, &state);
+                client.wait();
+            }
+            catch(PreonExcept &e) {
+                debug(e.what());
+            }
+        }).detach();
+    }
+}
+
+// Creates a finished job serving data_file with the given block size, the
+// way `preon -b size -c data_file` does
+std::string create_job(const std::string &root, const std::string &data_file,
+                       size_t block_size) {
+    std::string tmp_dir = root + "/tmp";
+    create_dir(tmp_dir, true);
+
+    Manifest manifest(tmp_dir + "/" + PREON_MANIFEST_FILE);
+    manifest.set_block_size(block_size);
+    Status status(tmp_dir + "/" + PREON_STATUS_FILE);
+    status.set_master(true);
+    status.set_block_size(block_size);
+
+    copy_file(tmp_dir + "/data.bin", data_file);
+    File f = {"data.bin", calc_hash(data_file), file_size(data_file), false};
+    manifest.add_file(f);
+    status.add_file(f);
+
+    manifest.write();
+    status.write();
+
+    std::string job_id = calc_hash(tmp_dir + "/" + PREON_MANIFEST_FILE);
+    if(rename(tmp_dir.c_str(), (root + "/" + job_id).c_str()) == -1)
+        throw PE_SYS("rename");
+
+    return job_id;
+}
+
+// Downloads every block of the file and returns the throughput in MB/s
+double download(const PreonAddr &addr, const std::string &job_id, int64_t n_blocks,
+                size_t block_size, bool reuse, std::vector<double> *latencies) {
+    std::vector<uint8_t> block;
+    block.reserve(block_size);
+
+    uint64_t bytes = 0;
+    std::unique_ptr<NetworkClient> client;
+    Clock::time_point start = Clock::now();
+    for(int64_t i = 0; i < n_blocks; i++) {
+        if(!reuse || !client)
+            client.reset(new NetworkClient(addr, nullptr));
+
+        Clock::time_point block_start = Clock::now();
+        if(!client->get_block(job_id, "data.bin", i, block))
+            throw PE("Block " + STR(i) + " not served");
+        bytes += block.size();
+
+        if(latencies != nullptr) {
+            std::chrono::duration<double> latency = Clock::now() - block_start;
+            latencies->push_back(latency.count());
+        }
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    return bytes / elapsed.count() / 1e6;
+}
+
+Result run(ProgramState &state, const std::string &root, const std::string &data_file,
+           const Options &opts, size_t block_size, std::vector<std::string> &dirs) {
+    std::string job_root = root + "/" + STR(block_size);
+    create_dir(job_root, true);
+    dirs.push_back(job_root);
+    std::string job_id = create_job(job_root, data_file, block_size);
+    dirs.push_back(job_root + "/" + job_id);
+
+    state.add_job(job_root, job_id);
+    Job *job = state.get_job(job_id);
+    job->read_manifest();
+
+    PreonAddr addr = {"127.0.0.1", (unsigned short)opts.port};
+    int64_t n_blocks = size_to_nblks(opts.file_size, block_size);
+
+    Result result = {0.0, 0.0, 0.0};
+    std::vector<double> latencies;
+    for(int round = 0; round < opts.rounds; round++) {
+        result.reused = std::max(result.reused,
+                download(addr, job_id, n_blocks, block_size, true, &latencies));
+        result.per_block = std::max(result.per_block,
+                download(addr, job_id, n_blocks, block_size, false, nullptr));
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    result.latency = latencies[latencies.size() / 2];
+
+    return result;
+}
+
+void cleanup(const std::vector<std::string> &dirs) {
+    for(auto it = dirs.rbegin(); it != dirs.rend(); it++) {
+        try {
+            remove_dir(*it);
+        }
+        catch(PreonExcept &e) {
+            std::cout << "Failed to remove " << *it << ": " << e.what() << std::endl;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Options opts;
+    parse_args(argc, argv, opts);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "Benchmarking block transfers over loopback with:\n"
+              << "  File " << opts.file_size / (1024 * 1024) << " MiB\n"
+              << "  Port " << opts.port << "\n"
+              << "  Rounds " << opts.rounds << "\n"
+              << std::endl;
+
+    char root_buf[] = "/tmp/block_bench.XXXXXX";
+    if(mkdtemp(root_buf) == nullptr) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    std::string root = root_buf;
+
+    // remove_dir() isn't recursive, so they are removed innermost first
+    std::vector<std::string> dirs = {root};
+    ProgramState state;
+    std::unique_ptr<NetworkListener> listener;
+    try {
+        std::string data_file = root + "/data.bin";
+        std::mt19937_64 rng(opts.seed);
+        std::vector<uint64_t> buf(1024 * 1024 / sizeof(uint64_t));
+        std::ofstream out(data_file, std::ios::binary);
+        for(size_t written = 0; written < opts.file_size; written += 1024 * 1024) {
+            for(uint64_t &x: buf)
+                x = rng();
+            out.write((const char *)buf.data(), std::min((size_t)1024 * 1024, opts.file_size - written));
+        }
+        out.close();
+
+        listener.reset(new NetworkListener(opts.port));
+        std::thread(listen_thread, std::ref(*listener), std::ref(state)).detach();
+
+        std::cout << "  block size      blocks     MB/s  MB/s (conn/block)  latency (ms)\n";
+        for(size_t block_size: opts.block_sizes) {
+            Result r = run(state, root, data_file, opts, block_size, dirs);
+
+            std::cout << std::fixed << std::setprecision(1)
+                      << std::setw(9) << block_size / 1024 << " KiB"
+                      << std::setw(12) << size_to_nblks(opts.file_size, block_size)
+                      << std::setw(9) << r.reused
+                      << std::setw(19) << r.per_block
+                      << std::setprecision(3) << std::setw(14) << r.latency * 1e3
+                      << std::endl;
+        }
+    }
+    catch(PreonExcept &e) {
+        std::cout << "Error: " << e.what() << std::endl;
+        cleanup(dirs);
+        _exit(EXIT_FAILURE);
+    }
+
+    cleanup(dirs);
+
+    // don't run the destructors, the detached threads still use them
+    _exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "dht.h"
+#include "error.h"
+#include "network_client.h"
+#include "network_listener.h"
+#include "program_state.h"
+#include "tracker.h"
+
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    int n_nodes = 200;
+    int base_port = 20000;
+    int n_keys = 100;
+    int n_lookups = 1000;
+    double settle = 5.0;        // s
+    int tracker_port = 0;       // central tracker on localhost to compare with
+    int seed = 0;
+};
+
+// Result of one publish or lookup, as reported by a node
+struct Sample {
+    double latency;     // s
+    uint64_t msgs;      // messages the node sent
+    bool found;
+};
+
+struct Node {
+    pid_t pid;
+    FILE *cmd;          // parent -> node
+    FILE *res;          // node -> parent
+};
+
+
+void parse_args(unsigned int argc, char* argv[], Options &opts) {
+    for(unsigned int i = 1; i < argc; i++) {
+        try {
+            if(strcmp(argv[i], "-n") == 0 && argc > i + 1)
+                opts.n_nodes = std::stoi(argv[++i]);
+            else if(strcmp(argv[i], "-p") == 0 && argc > i + 1)
+                opts.base_port = std::stoi(argv[++i]);
+            else if(strcmp(argv[i], "-k") == 0 && argc > i + 1)
+                opts.n_keys = std::stoi(argv[++i]);
+            else if(strcmp(argv[i], "-l") == 0 && argc > i + 1)
+                opts.n_lookups = std::stoi(argv[++i]);
+            else if(strcmp(argv[i], "-w") == 0 && argc > i + 1)
+                opts.settle = std::stod(argv[++i]);
+            else if(strcmp(argv[i], "-t") == 0 && argc > i + 1)
+                opts.tracker_port = std::stoi(argv[++i]);
+            else if(strcmp(argv[i], "-s") == 0 && argc > i + 1)
+                opts.seed = std::stoi(argv[++i]);
+            else
+                throw std::invalid_argument(argv[i]);
+        }
+        catch(...) {
+            if(strcmp(argv[i], "-h") != 0 && strcmp(argv[i], "--help") != 0)
+                std::cout << "Incorrect usage.\n" << std::endl;
+
+            std::cout << "Flags:\n"
+                      << "  -n <nodes>     - Number of dht node processes (default 200)\n"
+                      << "  -p <port>      - Port of the first node, the others follow (default 20000)\n"
+                      << "  -k <keys>      - Number of published job ids (default 100)\n"
+                      << "  -l <lookups>   - Number of lookups (default 1000)\n"
+                      << "  -w <seconds>   - Time to settle after all nodes joined (default 5)\n"
+                      << "  -t <port>      - Also run the benchmark against the tracker on this local port\n"
+                      << "  -s <seed>      - Set seed\n"
+                      << "  -h             - Prints help\n"
+                      << std::endl;
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    if(opts.n_nodes < 1 || opts.n_keys < 1 || opts.n_lookups < 0) {
+        std::cout << "Error: nodes and keys must be positive" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if(opts.base_port < 1 || opts.base_port + opts.n_nodes > 65535) {
+        std::cout << "Error: ports out of range" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+std::string random_job_id(std::mt19937 &rng) {
+    const char *hex = "0123456789abcdef";
+    std::string id;
+    for(int i = 0; i < 64; i++)
+        id += hex[rng() % 16];
+    return id;
+}
+
+// Serves the dht like preon's main() does
+void listen_thread(NetworkListener &listener, ProgramState &state) {
+    for(;;) {
+        int fd = listener.wait();
+        std::thread([&state, fd]() {
+            try {
+                NetworkClient client(fd, &state);
+                client.wait();
+            }
+            catch(PreonExcept &e) {
+                debug(e.what());
+            }
+        }).detach();
+    }
+}
+
+// A node executes commands from the parent, one per line:
+//   P <mode> <key>   publish key with its own port
+//   L <mode> <key>   look key up
+//   Q                quit
+// where mode is 'd' (dht) or 't' (central tracker). It answers every
+// command with "latency_us msgs found".
+void node_main(const Options &opts, int index, FILE *cmd, FILE *res) {
+    signal(SIGPIPE, SIG_IGN);
+    srand(opts.seed * 7919 + index + 1);
+
+    unsigned short port = opts.base_port + index;
+    NetworkListener listener(port);
+
+    ProgramState state;
+    Dht dht(port);
+    state.set_dht(&dht);
+    std::thread(listen_thread, std::ref(listener), std::ref(state)).detach();
+
+    PreonAddrList bootstrap;
+    if(index != 0)
+        bootstrap.push_back({"127.0.0.1", (unsigned short)opts.base_port});
+    dht.start(bootstrap);
+
+    while(index != 0 && dht.get_n_contacts() == 0)
+        usleep(1000);
+    fprintf(res, "R\n");
+    fflush(res);
+
+    Tracker through_dht(PreonAddrList(), &dht);
+    std::unique_ptr<Tracker> central;
+    if(opts.tracker_port != 0)
+        central.reset(new Tracker({{"127.0.0.1", (unsigned short)opts.tracker_port}}));
+
+    char line[256];
+    while(fgets(line, sizeof(line), cmd) != nullptr) {
+        char type, mode;
+        char key[128];
+        if(line[0] == 'Q' || sscanf(line, "%c %c %127s", &type, &mode, key) != 3)
+            break;
+
+        Tracker &t = mode == 'd' ? through_dht : *central;
+        uint64_t n_rpcs = dht.get_n_rpcs();
+        bool found = true;
+
+        Clock::time_point start = Clock::now();
+        try {
+            if(type == 'P')
+                t.inform_job(port, key);
+            else
+                found = !t.query_job(key).empty();
+        }
+        catch(PreonExcept &e) {
+            found = false;
+        }
+        std::chrono::duration<double> latency = Clock::now() - start;
+
+        // the tracker client sends one message per request
+        uint64_t msgs = mode == 'd' ? dht.get_n_rpcs() - n_rpcs : 1;
+
+        fprintf(res, "%.0f %lu %d\n", latency.count() * 1e6, (unsigned long)msgs, found ? 1 : 0);
+        fflush(res);
+    }
+
+    // don't run the destructors, the detached threads still use them
+    _exit(EXIT_SUCCESS);
+}
+
+Node spawn_node(const Options &opts, int index, const std::vector<Node> &nodes) {
+    int cmd_pipe[2], res_pipe[2];
+    if(pipe(cmd_pipe) == -1 || pipe(res_pipe) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t pid = fork();
+    if(pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    else if(pid == 0) {
+        for(const Node &n: nodes) {
+            fclose(n.cmd);
+            fclose(n.res);
+        }
+        close(cmd_pipe[1]);
+        close(res_pipe[0]);
+
+        try {
+            node_main(opts, index, fdopen(cmd_pipe[0], "r"), fdopen(res_pipe[1], "w"));
+        }
+        catch(PreonExcept &e) {
+            std::cerr << "node " << index << ": " << e.what() << std::endl;
+        }
+        _exit(EXIT_FAILURE);
+    }
+
+    close(cmd_pipe[0]);
+    close(res_pipe[1]);
+
+    Node node = {pid, fdopen(cmd_pipe[1], "w"), fdopen(res_pipe[0], "r")};
+
+    char line[16];
+    if(fgets(line, sizeof(line), node.res) == nullptr || line[0] != 'R') {
+        std::cout << "Error: node " << index << " failed to start" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return node;
+}
+
+Sample command(Node &node, char type, char mode, const std::string &key) {
+    fprintf(node.cmd, "%c %c %s\n", type, mode, key.c_str());
+    fflush(node.cmd);
+
+    double latency_us;
+    unsigned long msgs;
+    int found;
+    if(fscanf(node.res, "%lf %lu %d", &latency_us, &msgs, &found) != 3) {
+        std::cout << "Error: node died" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return {latency_us / 1e6, msgs, found == 1};
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+    if(sorted.empty())
+        return 0.0;
+
+    size_t index = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void print_samples(const std::string &name, const std::vector<Sample> &samples) {
+    std::vector<double> latencies;
+    double msgs = 0.0;
+    size_t n_found = 0;
+    for(const Sample &s: samples) {
+        latencies.push_back(s.latency);
+        msgs += s.msgs;
+        n_found += s.found;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    size_t n = std::max(samples.size(), (size_t)1);
+    std::cout << "  " << std::left << std::setw(16) << name << std::right
+              << std::setw(8) << samples.size()
+              << std::setw(10) << percentile(latencies, 50.0) * 1e6
+              << std::setw(10) << percentile(latencies, 99.0) * 1e6
+              << std::setw(10) << (latencies.empty() ? 0.0 : latencies.back() * 1e6)
+              << std::setw(10) << msgs / n
+              << std::setw(9) << 100.0 * n_found / n << "%"
+              << "\n";
+}
+
+// Every key is published by one node and looked up by random other nodes,
+// one operation at a time so the latencies don't include queueing.
+void run(std::vector<Node> &nodes, const std::vector<std::string> &keys,
+         const Options &opts, char mode, const std::string &name) {
+    std::mt19937 rng(opts.seed);
+
+    std::vector<Sample> publishes;
+    for(const std::string &key: keys)
+        publishes.push_back(command(nodes[rng() % nodes.size()], 'P', mode, key));
+
+    std::vector<Sample> lookups;
+    for(int i = 0; i < opts.n_lookups; i++)
+        lookups.push_back(command(nodes[rng() % nodes.size()], 'L', mode, keys[rng() % keys.size()]));
+
+    print_samples(name + " publish", publishes);
+    print_samples(name + " lookup", lookups);
+}
+
+int main(int argc, char *argv[]) {
+    Options opts;
+    parse_args(argc, argv, opts);
+    std::cout << "Benchmarking dht lookups with:\n"
+              << "  Nodes " << opts.n_nodes << " (ports " << opts.base_port
+              << "-" << opts.base_port + opts.n_nodes - 1 << ")\n"
+              << "  Keys " << opts.n_keys << "\n"
+              << "  Lookups " << opts.n_lookups << "\n";
+    if(opts.tracker_port != 0)
+        std::cout << "  Tracker 127.0.0.1:" << opts.tracker_port << "\n";
+    std::cout << std::endl;
+
+    // nodes join one by one through the first node
+    std::vector<Node> nodes;
+    Clock::time_point start = Clock::now();
+    for(int i = 0; i < opts.n_nodes; i++)
+        nodes.push_back(spawn_node(opts, i, nodes));
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    std::cout << std::fixed << std::setprecision(1)
+              << "Nodes joined in " << elapsed.count() << " s\n" << std::endl;
+
+    usleep((useconds_t)(opts.settle * 1e6));
+
+    std::mt19937 rng(opts.seed);
+    std::vector<std::string> keys;
+    for(int i = 0; i < opts.n_keys; i++)
+        keys.push_back(random_job_id(rng));
+
+    std::cout << "Latency (us) and messages per operation:\n"
+              << "  operation          count       p50       p99       max      msgs    found\n";
+    run(nodes, keys, opts, 'd', "dht");
+    if(opts.tracker_port != 0)
+        run(nodes, keys, opts, 't', "tracker");
+
+    for(Node &node: nodes) {
+        fprintf(node.cmd, "Q\n");
+        fclose(node.cmd);
+        fclose(node.res);
+    }
+    for(Node &node: nodes)
+        waitpid(node.pid, nullptr, 0);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+
+typedef std::chrono::steady_clock Clock;
+
+// simulated peers listen on consecutive ports from here
+const int FIRST_PEER_PORT = 10000;
+const int MAX_PEERS = 65535 - FIRST_PEER_PORT + 1;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    std::string port = "8080";
+    int n_peers = 1000;
+    int n_jobs = 256;
+    int n_threads = 8;
+    double rate = 1000.0;       // messages per second, all threads together
+    double duration = 10.0;     // s
+    int seed = 0;
+};
+
+enum MsgType {
+    INFORM,
+    DELETE,
+    QUERY,
+    N_MSG_TYPES,
+};
+
+const char *MSG_NAMES[N_MSG_TYPES] = {"INFORM", "DELETE", "QUERY"};
+
+// A virtual peer runs the same life cycle as a worker_thread of preon:
+// it reports itself idle, is dispatched a job (DELETE idle, INFORM job),
+// queries the swarm for every block it downloads, re-announces the job when
+// it is done and becomes idle again. Idle peers also act as masters looking
+// for idle workers (QUERY idle).
+struct Peer {
+    unsigned short port;
+    bool working = false;
+    int job = 0;
+    int queries_left = 0;
+
+    // the messages of a state transition are sent in successive ticks
+    std::vector<std::string> pending;
+};
+
+struct Sample {
+    MsgType type;
+    double latency;     // s, measured from the intended send time
+    bool ok;
+};
+
+void parse_args(unsigned int argc, char* argv[], Options &opts) {
+    for(unsigned int i = 1; i < argc; i++) {
+        try {
+            if(strcmp(argv[i], "-a") == 0 && argc > i + 1)
+                opts.host = argv[++i];
+            else if(strcmp(argv[i], "-p") == 0 && argc > i + 1)
+                opts.port = argv[++i];
+            else if(strcmp(argv[i], "-n") == 0 && argc > i + 1)
+                opts.n_peers = std::stoi(argv[++i]);
+            else if(strcmp(argv[i], "-j") == 0 && argc > i + 1)
+                opts.n_jobs = std::stoi(argv[++i]);
+            else if(strcmp(argv[i], "-c") == 0 && argc > i + 1)
+                opts.n_threads = std::stoi(argv[++i]);
+            else if(strcmp(argv[i], "-r") == 0 && argc > i + 1)
+                opts.rate = std::stod(argv[++i]);
+            else if(strcmp(argv[i], "-t") == 0 && argc > i + 1)
+                opts.duration = std::stod(argv[++i]);
+            else if(strcmp(argv[i], "-s") == 0 && argc > i + 1)
+                opts.seed = std::stoi(argv[++i]);
+            else
+                throw std::invalid_argument(argv[i]);
+        }
+        catch(...) {
+            if(strcmp(argv[i], "-h") != 0 && strcmp(argv[i], "--help") != 0)
+                std::cout << "Incorrect usage.\n" << std::endl;
+
+            std::cout << "Flags:\n"
+                      << "  -a <host>      - Tracker address (default 127.0.0.1)\n"
+                      << "  -p <port>      - Tracker port (default 8080)\n"
+                      << "  -n <peers>     - Number of virtual peers (default 1000)\n"
+                      << "  -j <jobs>      - Number of distinct jobs (default 256)\n"
+                      << "  -c <threads>   - Number of client threads (default 8)\n"
+                      << "  -r <rate>      - Messages per second (default 1000)\n"
+                      << "  -t <seconds>   - Duration (default 10)\n"
+                      << "  -s <seed>      - Set seed\n"
+                      << "  -h             - Prints help\n"
+                      << std::endl;
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    if(opts.n_peers < 1 || opts.n_jobs < 1 || opts.n_threads < 1 || opts.rate <= 0.0) {
+        std::cout << "Error: peers, jobs, threads and rate must be positive" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if(opts.duration <= 0.0) {
+        std::cout << "Error: duration must be positive" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if(opts.n_peers > MAX_PEERS) {
+        std::cout << "Error: at most " << MAX_PEERS << " peers, they get a port each" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+std::string random_job_id(std::mt19937 &rng) {
+    const char *hex = "0123456789abcdef";
+    std::string id;
+    for(int i = 0; i < 64; i++)
+        id += hex[rng() % 16];
+    return id;
+}
+
+// One request per connection and read until the tracker closes it, exactly
+// like preon's Tracker class does. An empty QUERY response is valid.
+bool tracker_request(const struct addrinfo *addr, const std::string &msg, MsgType type) {
+    int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if(fd == -1)
+        return false;
+
+    if(connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+        close(fd);
+        return false;
+    }
+
+    if(send(fd, msg.c_str(), msg.size(), MSG_NOSIGNAL) != (ssize_t)msg.size()) {
+        close(fd);
+        return false;
+    }
+
+    std::string response;
+    char buf[4096];
+    ssize_t ret;
+    while((ret = recv(fd, buf, sizeof(buf), 0)) > 0)
+        response.append(buf, ret);
+
+    close(fd);
+
+    return ret == 0 && (type == QUERY || response == "OK\n");
+}
+
+std::string next_message(Peer &peer, const std::vector<std::string> &jobs,
+                         std::mt19937 &rng, MsgType &type) {
+    std::string port = std::to_string(peer.port);
+
+    if(peer.pending.empty()) {
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+        if(!peer.working && uniform(rng) < 0.2) {
+            // dispatched a job
+            peer.working = true;
+            peer.job = rng() % jobs.size();
+            peer.queries_left = 1 + rng() % 16;
+            peer.pending.push_back("DELETE " + port + " idle\n");
+            peer.pending.push_back("INFORM " + port + " " + jobs[peer.job] + "\n");
+        }
+        else if(!peer.working) {
+            // idle report or looking for idle workers as a master
+            if(uniform(rng) < 0.5)
+                peer.pending.push_back("INFORM " + port + " idle\n");
+            else
+                peer.pending.push_back("QUERY idle\n");
+        }
+        else if(peer.queries_left > 0) {
+            // downloading a block
+            peer.queries_left--;
+            peer.pending.push_back("QUERY " + jobs[peer.job] + "\n");
+        }
+        else {
+            // finished, re-announce and become idle again
+            peer.working = false;
+            peer.pending.push_back("INFORM " + port + " " + jobs[peer.job] + "\n");
+            peer.pending.push_back("INFORM " + port + " idle\n");
+        }
+    }
+
+    std::string msg = peer.pending.front();
+    peer.pending.erase(peer.pending.begin());
+
+    if(msg.compare(0, 6, "INFORM") == 0)
+        type = INFORM;
+    else if(msg.compare(0, 6, "DELETE") == 0)
+        type = DELETE;
+    else
+        type = QUERY;
+
+    return msg;
+}
+
+void client_thread(const Options &opts, const struct addrinfo *addr,
+                   const std::vector<std::string> &jobs, int thread_id,
+                   Clock::time_point start, std::vector<Sample> &samples) {
+    std::mt19937 rng(opts.seed * 1000 + thread_id);
+
+    std::vector<Peer> peers;
+    for(int i = thread_id; i < opts.n_peers; i += opts.n_threads) {
+        Peer peer;
+        peer.port = FIRST_PEER_PORT + i;
+        peers.push_back(peer);
+    }
+    if(peers.empty())
+        return;
+
+    // Open loop: messages are sent on a fixed schedule and latency is taken
+    // from the intended send time, so a slow tracker is not hidden by the
+    // generator backing off (coordinated omission).
+    std::chrono::duration<double> interval(opts.n_threads / opts.rate);
+    Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(opts.duration));
+    Clock::time_point next = start;
+
+    while(next < end) {
+        std::this_thread::sleep_until(next);
+
+        Peer &peer = peers[rng() % peers.size()];
+        MsgType type;
+        std::string msg = next_message(peer, jobs, rng, type);
+
+        bool ok = tracker_request(addr, msg, type);
+        std::chrono::duration<double> latency = Clock::now() - next;
+        samples.push_back({type, latency.count(), ok});
+
+        next += std::chrono::duration_cast<Clock::duration>(interval);
+    }
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+    if(sorted.empty())
+        return 0.0;
+
+    size_t index = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void print_latencies(const std::string &name, std::vector<double> &latencies) {
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << "  " << std::left << std::setw(8) << name << std::right
+              << std::setw(10) << latencies.size()
+              << std::setw(12) << percentile(latencies, 50.0) * 1e6
+              << std::setw(12) << percentile(latencies, 99.0) * 1e6
+              << std::setw(12) << percentile(latencies, 99.9) * 1e6
+              << std::setw(12) << (latencies.empty() ? 0.0 : latencies.back() * 1e6)
+              << "\n";
+}
+
+int main(int argc, char *argv[]) {
+    Options opts;
+    parse_args(argc, argv, opts);
+    std::cout << "Generating tracker load with:\n"
+              << "  Tracker " << opts.host << ":" << opts.port << "\n"
+              << "  Peers " << opts.n_peers << "\n"
+              << "  Jobs " << opts.n_jobs << "\n"
+              << "  Threads " << opts.n_threads << "\n"
+              << "  Rate " << opts.rate << " msg/s\n"
+              << "  Duration " << opts.duration << " s\n"
+              << std::endl;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addr;
+    if(getaddrinfo(opts.host.c_str(), opts.port.c_str(), &hints, &addr) != 0) {
+        std::cout << "Error: Couldn't resolve tracker address" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::mt19937 rng(opts.seed);
+    std::vector<std::string> jobs;
+    for(int i = 0; i < opts.n_jobs; i++)
+        jobs.push_back(random_job_id(rng));
+
+    std::vector<std::vector<Sample>> samples(opts.n_threads);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for(int i = 0; i < opts.n_threads; i++)
+        threads.push_back(std::thread(client_thread, std::cref(opts), addr,
+                                      std::cref(jobs), i, start, std::ref(samples[i])));
+
+    for(auto &t: threads)
+        t.join();
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    freeaddrinfo(addr);
+
+    std::vector<double> all;
+    std::vector<double> per_type[N_MSG_TYPES];
+    size_t n_failed = 0;
+    for(auto &thread_samples: samples) {
+        for(const Sample &s: thread_samples) {
+            if(!s.ok) {
+                n_failed++;
+                continue;
+            }
+            all.push_back(s.latency);
+            per_type[s.type].push_back(s.latency);
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "Sent " << all.size() + n_failed << " messages in " << elapsed.count() << " s\n"
+              << "  Throughput " << all.size() / elapsed.count() << " msg/s\n"
+              << "  Failed " << n_failed << "\n"
+              << "\n"
+              << "Latency (us):\n"
+              << "  type         count         p50         p99        p999         max\n";
+    for(int i = 0; i < N_MSG_TYPES; i++)
+        print_latencies(MSG_NAMES[i], per_type[i]);
+    print_latencies("all", all);
+
+    return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
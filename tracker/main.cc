@@ -11,15 +11,77 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
 #include <map>
 #include <set>
 #include <sstream>
+#include <vector>
 
 #include "string_check.h"
+#include "msg_check.h"
+#include "stats.h"
 #include "../preon/preon_types.h"
 
+// an INFORM_BATCH of TRACKER_BATCH_MAX job ids fits
+const size_t MAX_HEADER_SIZE = 8192;
+
 std::map<std::string, std::set<PreonAddr>> g_db;
 
+// job_id -> connections which receive JOIN/LEAVE deltas for that job
+std::map<std::string, std::set<int>> g_subscribers;
+
+Stats g_stats;
+
+void update_table_stats() {
+    size_t n_entries = 0;
+    for (auto &pair: g_db)
+        n_entries += pair.second.size();
+    g_stats.set_table_size(g_db.size(), n_entries);
+
+    size_t n_subscribers = 0;
+    for (auto &pair: g_subscribers)
+        n_subscribers += pair.second.size();
+    g_stats.set_n_subscribers(n_subscribers);
+}
+
+void drop_subscriber(int fd) {
+    for (auto it = g_subscribers.begin(); it != g_subscribers.end();) {
+        it->second.erase(fd);
+        if (it->second.empty())
+            it = g_subscribers.erase(it);
+        else
+            it++;
+    }
+
+    close(fd);
+}
+
+// Pushes a delta to everyone subscribed to job_id. Subscribers which can't
+// keep up (full socket buffer) or went away are dropped; they can resubscribe.
+void notify_subscribers(const std::string &job_id, const std::string &event,
+        const PreonAddr &pa) {
+    auto it = g_subscribers.find(job_id);
+    if (it == g_subscribers.end())
+        return;
+
+    std::stringstream ss;
+    ss << event << " " << pa.ip_addr << " " << pa.port << "\n";
+    std::string data = ss.str();
+
+    std::vector<int> failed;
+    for (int fd: it->second) {
+        ssize_t ret = send(fd, data.c_str(), data.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret != (ssize_t)data.size())
+            failed.push_back(fd);
+    }
+
+    for (int fd: failed)
+        drop_subscriber(fd);
+}
+
 bool handle_inform_msg(std::string ip_addr, std::string header) {
     std::stringstream ss(header);
     std::string msg;
@@ -30,6 +92,27 @@ bool handle_inform_msg(std::string ip_addr, std::string header) {
     PreonAddr pa = {ip_addr, port};
     g_db[job_id].insert(pa);
 
+    // Also pushed for re-announcements, so a peer can signal progress on a
+    // job it already has (e.g. finished execution)
+    notify_subscribers(job_id, "JOIN", pa);
+
+    return true;
+}
+
+// One INFORM per job id, sent by a peer taking on several jobs at once
+bool handle_inform_batch_msg(std::string ip_addr, std::string header) {
+    std::stringstream ss(header);
+    std::string msg;
+    unsigned short port;
+    ss >> msg >> port;
+
+    PreonAddr pa = {ip_addr, port};
+    std::string job_id;
+    while (ss >> job_id) {
+        g_db[job_id].insert(pa);
+        notify_subscribers(job_id, "JOIN", pa);
+    }
+
     return true;
 }
 
@@ -40,8 +123,16 @@ bool handle_delete_msg(std::string ip_addr, std::string header) {
     std::string job_id;
     ss >> msg >> port >> job_id;
 
+    auto it = g_db.find(job_id);
+    if (it == g_db.end())
+        return true;
+
     PreonAddr pa = {ip_addr, port};
-    g_db[job_id].erase(pa);
+    if (it->second.erase(pa) != 0)
+        notify_subscribers(job_id, "LEAVE", pa);
+
+    if (it->second.empty())
+        g_db.erase(it);
 
     return true;
 }
@@ -52,33 +143,76 @@ bool handle_query_msg(PreonAddrList &list, std::string header) {
     std::string job_id;
     ss >> msg >> job_id;
 
-    auto &jobs = g_db[job_id];
-    list.assign(jobs.begin(), jobs.end());
+    // don't use operator[], unknown job ids would grow the table
+    list.clear();
+    auto it = g_db.find(job_id);
+    if (it != g_db.end())
+        list.assign(it->second.begin(), it->second.end());
+
+    return true;
+}
+
+bool handle_subscribe_msg(int fd, std::string header) {
+    std::stringstream ss(header);
+    std::string msg;
+    std::string job_id;
+    ss >> msg >> job_id;
+
+    if (send(fd, "OK\n", 3, MSG_NOSIGNAL) != 3)
+        return false;
+
+    g_subscribers[job_id].insert(fd);
 
     return true;
 }
 
-void handle_connection(struct sockaddr_in *addr, int fd) {
+// Returns true if the connection should be kept open
+bool handle_connection(struct sockaddr_in *addr, int fd) {
+    uint64_t start = monotonic_ns();
+    g_stats.record_accept();
+
     char ip_addr[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &(addr->sin_addr), ip_addr, INET_ADDRSTRLEN);
 
     // TODO check if local, if so return?
 
-    char header[128];
-    ssize_t header_size = recv(fd, header, sizeof(header) - 1, 0);
-    if (header_size == -1)
-        return;
+    // batches don't fit a single segment, read up to the newline
+    char header[MAX_HEADER_SIZE];
+    size_t header_size = 0;
+    while (header_size < sizeof(header) - 1) {
+        ssize_t ret = recv(fd, header + header_size, sizeof(header) - 1 - header_size, 0);
+        if (ret == -1) {
+            g_stats.record_msg(MsgType::invalid, monotonic_ns() - start);
+            return false;
+        }
+        else if (ret == 0)
+            break;
+
+        header_size += ret;
+        if (memchr(header, '\n', header_size) != nullptr)
+            break;
+    }
     header[header_size] = '\0';
 
+    bool keep_open = false;
+    MsgType type = MsgType::invalid;
     if (is_inform_msg(header)) {
+        type = MsgType::inform;
         handle_inform_msg(ip_addr, header);
-        send(fd, "OK\n", 3, 0);
+        send(fd, "OK\n", 3, MSG_NOSIGNAL);
+    }
+    else if (is_inform_batch_msg(header)) {
+        type = MsgType::inform_batch;
+        handle_inform_batch_msg(ip_addr, header);
+        send(fd, "OK\n", 3, MSG_NOSIGNAL);
     }
     else if (is_delete_msg(header)) {
+        type = MsgType::remove;
         handle_delete_msg(ip_addr, header);
-        send(fd, "OK\n", 3, 0);
+        send(fd, "OK\n", 3, MSG_NOSIGNAL);
     }
     else if (is_query_msg(header)) {
+        type = MsgType::query;
         PreonAddrList list;
         handle_query_msg(list, header);
         std::stringstream ss;
@@ -86,15 +220,47 @@ void handle_connection(struct sockaddr_in *addr, int fd) {
             ss << addr.ip_addr << " " << addr.port << "\n";
         }
         std::string data = ss.str();
-        send(fd, data.c_str(), data.size(), 0);
+        send(fd, data.c_str(), data.size(), MSG_NOSIGNAL);
+    }
+    else if (is_subscribe_msg(header)) {
+        type = MsgType::subscribe;
+        keep_open = handle_subscribe_msg(fd, header);
     }
+    else if (is_stats_msg(header)) {
+        type = MsgType::stats;
+        update_table_stats();
+        std::string data = g_stats.report();
+        send(fd, data.c_str(), data.size(), MSG_NOSIGNAL);
+    }
+
+    g_stats.record_msg(type, monotonic_ns() - start);
+
+    return keep_open;
+}
+
+void usage(const char *name) {
+    std::cerr << "usage: " << name << " port [stats_file [interval_s]]" << std::endl;
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        std::cerr << "usage: " << argv[0] << " port" << std::endl;
-        return EXIT_FAILURE;
+    if (argc < 2 || argc > 4)
+        usage(argv[0]);
+
+    // optional periodic dump of the STATS report, every interval_s > 0
+    std::string stats_file = argc > 2 ? argv[2] : "";
+    double stats_interval = 10.0;
+    if (argc > 3) {
+        char *end;
+        errno = 0;
+        stats_interval = strtod(argv[3], &end);
+        if (end == argv[3] || *end != '\0' || errno != 0 || !(stats_interval > 0.0)
+                || !std::isfinite(stats_interval))
+            usage(argv[0]);
     }
+    double next_dump = monotonic_seconds() + stats_interval;
+
+    signal(SIGPIPE, SIG_IGN);
 
     int fd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -112,14 +278,49 @@ int main(int argc, char *argv[]) {
     listen(fd, 10);
 
     for (;;) {
+        // Subscribers never send anything after SUBSCRIBE, so the only thing
+        // their connections can become readable for is a hangup.
+        std::vector<struct pollfd> fds;
+        fds.push_back({fd, POLLIN, 0});
+        for (auto &sub: g_subscribers) {
+            for (int sfd: sub.second)
+                fds.push_back({sfd, POLLIN, 0});
+        }
+
+        int timeout = -1;
+        if (!stats_file.empty()) {
+            double now = monotonic_seconds();
+            if (now >= next_dump) {
+                update_table_stats();
+                g_stats.dump(stats_file);
+                next_dump = now + stats_interval;
+            }
+            timeout = (int)((next_dump - now) * 1000) + 1;
+        }
+
+        if (poll(fds.data(), fds.size(), timeout) <= 0)
+            continue;
+
+        for (size_t i = 1; i < fds.size(); i++) {
+            if (fds[i].revents == 0)
+                continue;
+
+            char buf[128];
+            if (recv(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT) <= 0)
+                drop_subscriber(fds[i].fd);
+        }
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
         struct sockaddr_in caddr;
         socklen_t caddr_len = sizeof(caddr);
         int cfd = accept(fd, (struct sockaddr *)&caddr, &caddr_len);
         if (cfd == -1)
             continue;
 
-        handle_connection(&caddr, cfd);
-        close(cfd);
+        if (!handle_connection(&caddr, cfd))
+            close(cfd);
     }
 
     return 0;
@@ -0,0 +1,65 @@
+#include <cstring>
+
+#include "msg_check.h"
+
+bool is_job_id(const char *str, size_t len) {
+    if (len == 4 && strncmp(str, "idle", 4) == 0)
+        return true;
+
+    if (len != 64)
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = str[i];
+        if ((c < '0' || c > '9') && (c < 'a' || c > 'f'))
+            return false;
+    }
+
+    return true;
+}
+
+// SUBSCRIBE job_id\n
+bool is_subscribe_msg(const char *str) {
+    const char *prefix = "SUBSCRIBE ";
+    size_t prefix_len = strlen(prefix);
+    if (strncmp(str, prefix, prefix_len) != 0)
+        return false;
+
+    const char *job_id = str + prefix_len;
+    const char *end = strchr(job_id, '\n');
+    if (end == nullptr || end[1] != '\0')
+        return false;
+
+    return is_job_id(job_id, end - job_id);
+}
+
+// INFORM_BATCH port job_id [job_id ...]\n
+bool is_inform_batch_msg(const char *str) {
+    const char *prefix = "INFORM_BATCH ";
+    size_t prefix_len = strlen(prefix);
+    if (strncmp(str, prefix, prefix_len) != 0)
+        return false;
+
+    const char *port = str + prefix_len;
+    size_t port_len = strspn(port, "0123456789");
+    if (port_len == 0 || port_len > 5 || port[port_len] != ' ')
+        return false;
+
+    const char *job_id = port + port_len + 1;
+    for (;;) {
+        size_t len = strcspn(job_id, " \n");
+        if (!is_job_id(job_id, len))
+            return false;
+
+        if (job_id[len] == '\n')
+            return job_id[len + 1] == '\0';
+        else if (job_id[len] != ' ')
+            return false;
+        job_id += len + 1;
+    }
+}
+
+// STATS\n
+bool is_stats_msg(const char *str) {
+    return strcmp(str, "STATS\n") == 0;
+}
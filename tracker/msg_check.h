@@ -0,0 +1,14 @@
+#ifndef __msg_check_h__
+#define __msg_check_h__
+
+#include <cstddef>
+
+// Hand written checks for messages which are not covered by the
+// generated automatons in string_check.h
+
+bool is_job_id(const char *str, size_t len);
+bool is_subscribe_msg(const char *str);
+bool is_inform_batch_msg(const char *str);
+bool is_stats_msg(const char *str);
+
+#endif //#ifndef __msg_check_h__
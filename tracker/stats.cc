@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+#include "stats.h"
+
+namespace {
+
+const char *msg_type_name(MsgType type) {
+    switch (type) {
+        case MsgType::inform:       return "INFORM";
+        case MsgType::inform_batch: return "INFORM_BATCH";
+        case MsgType::remove:       return "DELETE";
+        case MsgType::query:        return "QUERY";
+        case MsgType::subscribe:    return "SUBSCRIBE";
+        case MsgType::stats:        return "STATS";
+        case MsgType::invalid:      return "INVALID";
+    }
+
+    return "UNKNOWN";
+}
+
+// Resident set size in bytes, 0 if unknown
+size_t rss_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages_total, pages_resident;
+    if (!(statm >> pages_total >> pages_resident))
+        return 0;
+
+    return pages_resident * sysconf(_SC_PAGESIZE);
+}
+
+}
+
+double monotonic_seconds() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec + (tp.tv_nsec / 1000000000.0);
+}
+
+uint64_t monotonic_ns() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+Histogram::Histogram() :
+    m_buckets((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS, 0),
+    m_count(0), m_sum(0), m_max(0) {}
+
+void Histogram::record(uint64_t value) {
+    m_buckets[bucket_index(value)]++;
+    m_count++;
+    m_sum += value;
+    if (value > m_max)
+        m_max = value;
+}
+
+double Histogram::get_mean() const {
+    if (m_count == 0)
+        return 0.0;
+    return (double)m_sum / m_count;
+}
+
+// Upper bound of the bucket containing the p'th percentile (0 < p <= 100)
+uint64_t Histogram::percentile(double p) const {
+    if (m_count == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)std::ceil(p / 100.0 * m_count);
+    if (target == 0)
+        target = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < m_buckets.size(); i++) {
+        seen += m_buckets[i];
+        if (seen >= target)
+            return std::min(bucket_upper(i), m_max);
+    }
+
+    return m_max;
+}
+
+size_t Histogram::bucket_index(uint64_t value) {
+    if (value < (uint64_t)SUB_BUCKETS)
+        return value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SUB_BUCKET_BITS;
+    size_t sub = (value >> shift) & (SUB_BUCKETS - 1);
+
+    return (shift + 1) * SUB_BUCKETS + sub;
+}
+
+uint64_t Histogram::bucket_upper(size_t index) {
+    size_t magnitude = index / SUB_BUCKETS;
+    uint64_t sub = index % SUB_BUCKETS;
+    if (magnitude == 0)
+        return sub;
+
+    int shift = magnitude - 1;
+    uint64_t lower = (SUB_BUCKETS + sub) << shift;
+
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+Stats::Stats() {
+    m_start = monotonic_seconds();
+    m_n_accepted = 0;
+    m_n_subscribers = 0;
+    m_n_jobs = 0;
+    m_n_entries = 0;
+}
+
+void Stats::record_msg(MsgType type, uint64_t latency_ns) {
+    m_latency[type].record(latency_ns);
+}
+
+void Stats::set_table_size(size_t n_jobs, size_t n_entries) {
+    m_n_jobs = n_jobs;
+    m_n_entries = n_entries;
+}
+
+std::string Stats::report() const {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(3);
+
+    double uptime = monotonic_seconds() - m_start;
+    ss << "uptime_s "           << uptime           << "\n"
+       << "connections_total "  << m_n_accepted     << "\n"
+       << "connections_active " << m_n_subscribers  << "\n"
+       << "jobs "               << m_n_jobs         << "\n"
+       << "entries "            << m_n_entries      << "\n"
+       << "rss_bytes "          << rss_bytes()      << "\n";
+
+    // latencies in μs
+    for (auto &pair: m_latency) {
+        const Histogram &h = pair.second;
+        ss << "msg " << msg_type_name(pair.first)
+           << " count "     << h.get_count()
+           << " rate "      << (uptime > 0.0 ? h.get_count() / uptime : 0.0)
+           << " mean_us "   << h.get_mean() / 1000.0
+           << " p50_us "    << h.percentile(50.0) / 1000.0
+           << " p99_us "    << h.percentile(99.0) / 1000.0
+           << " p999_us "   << h.percentile(99.9) / 1000.0
+           << " max_us "    << h.get_max() / 1000.0
+           << "\n";
+    }
+
+    return ss.str();
+}
+
+void Stats::dump(const std::string &filename) const {
+    // write and rename, so readers never see a partial dump
+    std::string tmp_filename = filename + ".tmp";
+    std::ofstream file(tmp_filename);
+    if (!file.is_open()) {
+        std::cerr << "Error: Couldn't open " << tmp_filename << std::endl;
+        return;
+    }
+
+    file << report();
+    file.close();
+
+    if (rename(tmp_filename.c_str(), filename.c_str()) == -1)
+        std::cerr << "Error: Couldn't rename " << tmp_filename << std::endl;
+}
@@ -0,0 +1,72 @@
+#ifndef __stats_h__
+#define __stats_h__
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Log-linear (HDR style) latency histogram. Values are bucketed by their
+// most significant bit and then linearly into SUB_BUCKETS, which bounds the
+// relative error to 1 / SUB_BUCKETS over the full uint64_t range.
+class Histogram {
+    public:
+        Histogram();
+
+        void record(uint64_t value);
+
+        uint64_t get_count() const {return m_count;}
+        uint64_t get_max() const {return m_max;}
+        double get_mean() const;
+        uint64_t percentile(double p) const;
+
+    private:
+        static const int SUB_BUCKET_BITS = 4;
+        static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+        std::vector<uint64_t> m_buckets;
+        uint64_t m_count;
+        uint64_t m_sum;
+        uint64_t m_max;
+
+        static size_t bucket_index(uint64_t value);
+        static uint64_t bucket_upper(size_t index);
+};
+
+enum class MsgType {
+    inform,
+    inform_batch,
+    remove,
+    query,
+    subscribe,
+    stats,
+    invalid,
+};
+
+class Stats {
+    public:
+        Stats();
+
+        // latency in ns from accept() until the response was sent
+        void record_msg(MsgType type, uint64_t latency_ns);
+        void record_accept() {m_n_accepted++;}
+        void set_n_subscribers(size_t n) {m_n_subscribers = n;}
+        void set_table_size(size_t n_jobs, size_t n_entries);
+
+        std::string report() const;
+        void dump(const std::string &filename) const;
+
+    private:
+        double      m_start;
+        uint64_t    m_n_accepted;
+        size_t      m_n_subscribers;
+        size_t      m_n_jobs;
+        size_t      m_n_entries;
+
+        std::map<MsgType, Histogram> m_latency;
+};
+
+double monotonic_seconds();
+uint64_t monotonic_ns();
+
+#endif //#ifndef __stats_h__